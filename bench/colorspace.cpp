@@ -0,0 +1,184 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Measures the conversion of RGBA frames to YUV 4:2:0, with swscale as the encoder
+// used to do it and with the direct converter, and checks the direct converter
+// against a floating point implementation of the same formulas.
+//
+// Usage: colorspace-bench [frames]
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <stdlib.h>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+#include <gpsmap/colorspace.h>
+
+using namespace gpsmap;
+
+static const int s_width = 512;
+static const int s_height = 512;
+
+struct Planes {
+    std::vector<uint8_t> y, u, v;
+
+    Planes() : y(s_width * s_height), u(s_width * s_height / 4), v(s_width * s_height / 4) {
+    }
+};
+
+// Flat areas of a few colors with thin lines, like a map, plus some noise
+static std::vector<uint8_t> GenerateFrame() {
+    std::vector<uint8_t> ret(s_width * s_height * 4);
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> color(0, 255);
+    std::uniform_int_distribution<int> noise(-3, 3);
+
+    uint8_t palette[8][3];
+    for (auto &c : palette) {
+        c[0] = color(rng);
+        c[1] = color(rng);
+        c[2] = color(rng);
+    }
+
+    for (int y = 0; y < s_height; ++y) {
+        for (int x = 0; x < s_width; ++x) {
+            auto p = &ret[(y * s_width + x) * 4];
+            const auto &c = (x % 97 == 0 || y % 61 == 0) ? palette[0] : palette[1 + ((x / 64) ^ (y / 48)) % 7];
+            for (int i = 0; i < 3; ++i) {
+                p[i] = std::clamp(c[i] + noise(rng), 0, 255);
+            }
+            p[3] = 255;
+        }
+    }
+
+    return ret;
+}
+
+static inline uint8_t ToByte(double v) {
+    return (uint8_t) std::clamp(floor(v + 0.5), 0.0, 255.0);
+}
+
+static void ConvertReference(const std::vector<uint8_t> &rgba, Planes &out) {
+    for (int y = 0; y < s_height; ++y) {
+        for (int x = 0; x < s_width; ++x) {
+            auto p = &rgba[(y * s_width + x) * 4];
+            out.y[y * s_width + x] = ToByte(16 + 0.256788 * p[0] + 0.504129 * p[1] + 0.097906 * p[2]);
+        }
+    }
+
+    for (int y = 0; y < s_height / 2; ++y) {
+        for (int x = 0; x < s_width / 2; ++x) {
+            double r = 0, g = 0, b = 0;
+            for (int i = 0; i < 4; ++i) {
+                auto p = &rgba[((y * 2 + i / 2) * s_width + x * 2 + i % 2) * 4];
+                r += p[0] / 4.0;
+                g += p[1] / 4.0;
+                b += p[2] / 4.0;
+            }
+            out.u[y * s_width / 2 + x] = ToByte(128 - 0.148223 * r - 0.290993 * g + 0.439216 * b);
+            out.v[y * s_width / 2 + x] = ToByte(128 + 0.439216 * r - 0.367788 * g - 0.071427 * b);
+        }
+    }
+}
+
+static int MaxError(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+    int ret = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        ret = std::max(ret, abs(a[i] - b[i]));
+    }
+    return ret;
+}
+
+static double TimeSws(int flags, const std::vector<uint8_t> &rgba, Planes &out, int frames) {
+    auto ctx = sws_getContext(s_width, s_height, AV_PIX_FMT_RGBA, s_width, s_height, AV_PIX_FMT_YUV420P, flags,
+                              nullptr, nullptr, nullptr);
+    if (!ctx) {
+        std::cerr << "Could not create the swscale context\n";
+        exit(-1);
+    }
+
+    const uint8_t *src[4] = {rgba.data()};
+    int srcStride[4] = {s_width * 4};
+    uint8_t *dst[4] = {out.y.data(), out.u.data(), out.v.data()};
+    int dstStride[4] = {s_width, s_width / 2, s_width / 2};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        sws_scale(ctx, src, srcStride, 0, s_height, dst, dstStride);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    sws_freeContext(ctx);
+    return elapsed.count();
+}
+
+static double TimeDirect(const std::vector<uint8_t> &rgba, Planes &out, int frames) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        ConvertRGBAToI420(rgba.data(), s_width * 4, out.y.data(), s_width, out.u.data(), s_width / 2, out.v.data(),
+                          s_width / 2, s_width, s_height);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void Report(const char *name, double seconds, int frames) {
+    std::cout << "  " << name << ": " << seconds * 1e9 / frames << " ns/frame\n";
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 1000;
+    if (frames < 1) {
+        std::cerr << "Need at least 1 frame\n";
+        return -1;
+    }
+
+    auto rgba = GenerateFrame();
+    std::cout << frames << " frames of " << s_width << "x" << s_height << "\n";
+
+    Planes bicubic, point, direct, reference;
+    Report("swscale bicubic", TimeSws(SWS_BICUBIC, rgba, bicubic, frames), frames);
+    Report("swscale point", TimeSws(SWS_POINT, rgba, point, frames), frames);
+    Report("direct", TimeDirect(rgba, direct, frames), frames);
+
+    ConvertReference(rgba, reference);
+    auto lumaError = MaxError(direct.y, reference.y);
+    auto chromaError = std::max(MaxError(direct.u, reference.u), MaxError(direct.v, reference.v));
+    std::cout << "  max error of direct: luma " << lumaError << ", chroma " << chromaError << "\n";
+
+    // swscale filters chroma differently, so only the luma is expected to match closely
+    std::cout << "  max difference with swscale bicubic: luma " << MaxError(direct.y, bicubic.y) << ", chroma "
+              << std::max(MaxError(direct.u, bicubic.u), MaxError(direct.v, bicubic.v)) << "\n";
+
+    if (lumaError > 1 || chromaError > 1) {
+        std::cerr << "Direct conversion does not agree with the reference implementation\n";
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,454 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Measures the throughput of each stage of the video pipeline on a synthetic track,
+// with procedurally generated tiles so that no network access is needed.
+// Timings are written as JSON, to compare them across versions.
+//
+// Usage: gps-bench -rsrcdir /path/to/resources [-points n] [-interval seconds] [-frames n]
+//                  [-zoom n] [-encoder name] [-tile-store dir|pack] [-workdir dir] [-json file]
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <sstream>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <boost/filesystem.hpp>
+
+#include <OpenImageIO/imagebuf.h>
+#include <OpenImageIO/imagebufalgo.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include <gpsmap/colorspace.h>
+#include <gpsmap/composedtiles.h>
+#include <gpsmap/downloader.h>
+#include <gpsmap/encoder.h>
+#include <gpsmap/framerenderer.h>
+#include <gpsmap/gpx.h>
+#include <gpsmap/mapgen.h>
+#include <gpsmap/prefetcher.h>
+#include <gpsmap/resources.h>
+#include <gpsmap/tilemanager.h>
+#include <gpsmap/tilestore.h>
+#include <gpsmap/trackindex.h>
+
+OIIO_NAMESPACE_USING
+
+using namespace gpsmap;
+
+static const int s_width = 512;
+static const int s_height = 512;
+static const int s_fps = 25;
+
+struct BenchArguments {
+    boost::filesystem::path ResourceDir;
+    boost::filesystem::path WorkDir;
+    std::string JsonPath;
+    size_t Points = 20000;
+    int Interval = 1;
+    int Frames = 2000;
+    int Zoom = 16;
+    std::string TileStore = "dir";
+    VideoEncoder::Params Encoder;
+};
+
+static bool ParseCommandLine(int argc, char **argv, BenchArguments &args) {
+    for (auto i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-rsrcdir")) {
+            args.ResourceDir = argv[i + 1];
+        } else if (!strcmp(argv[i], "-workdir")) {
+            args.WorkDir = argv[i + 1];
+        } else if (!strcmp(argv[i], "-json")) {
+            args.JsonPath = argv[i + 1];
+        } else if (!strcmp(argv[i], "-points")) {
+            args.Points = std::max(2l, atol(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-interval")) {
+            args.Interval = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-frames")) {
+            args.Frames = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-zoom")) {
+            args.Zoom = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-encoder")) {
+            args.Encoder.backend = argv[i + 1];
+        } else if (!strcmp(argv[i], "-tile-store")) {
+            args.TileStore = argv[i + 1];
+        } else {
+            std::cerr << "Invalid argument " << i << ": " << argv[i] << "\n";
+            return false;
+        }
+    }
+
+    return !args.ResourceDir.empty();
+}
+
+// A ride with turns, climbs and stops, one point every interval seconds
+static bool WriteTrack(const std::string &path, size_t points, int interval) {
+    std::ofstream os(path);
+    if (!os) {
+        std::cerr << "Could not create " << path << "\n";
+        return false;
+    }
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> turn(-0.2, 0.2);
+    std::uniform_real_distribution<double> speed(4.0, 10.0);
+    std::uniform_real_distribution<double> climb(-0.5, 0.5);
+    std::uniform_int_distribution<int> stop(0, 600);
+
+    os << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<gpx version=\"1.1\" creator=\"gps-bench\">\n<trk><trkseg>\n";
+    os << std::fixed;
+
+    double lat = 46.5, lon = 6.6, elevation = 400, heading = 0;
+    time_t t = 1577872800;
+    int stopped = 0;
+    for (size_t i = 0; i < points; ++i) {
+        double v = 0;
+        if (stopped) {
+            --stopped;
+        } else if (!stop(rng)) {
+            stopped = 30;
+        } else {
+            heading += turn(rng);
+            v = speed(rng);
+            auto meters = v * interval;
+            lat += meters * cos(heading) / 111195.0;
+            lon += meters * sin(heading) / (111195.0 * cos(lat * M_PI / 180.0));
+            elevation += climb(rng);
+        }
+
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+        os << "<trkpt lat=\"" << std::setprecision(7) << lat << "\" lon=\"" << lon << "\"><ele>"
+           << std::setprecision(1) << elevation << "</ele><time>" << date << "</time><speed>" << v
+           << "</speed></trkpt>\n";
+        t += interval;
+    }
+
+    os << "</trkseg></trk>\n</gpx>\n";
+    return (bool) os;
+}
+
+// Blocks of a few colors crossed by streets, which compress and draw like real map tiles
+static bool WriteTile(const std::string &path, const TileDesc &td) {
+    ImageBuf ib(ImageSpec(s_width, s_height, 3, TypeDesc::UINT8));
+    std::mt19937 rng(td.x * 7919 + td.y * 104729 + td.z);
+    std::uniform_real_distribution<float> shade(0.8f, 0.95f);
+    std::uniform_int_distribution<int> pos(0, s_width - 1);
+
+    ImageBufAlgo::fill(ib, {shade(rng), shade(rng), shade(rng)});
+    for (int i = 0; i < 8; ++i) {
+        auto x = pos(rng), y = pos(rng);
+        ImageBufAlgo::fill(ib, {shade(rng), 0.9f, shade(rng)}, ROI(x, std::min(s_width, x + 96), y,
+                                                                  std::min(s_height, y + 64)));
+    }
+    for (int i = 0; i < 12; ++i) {
+        ImageBufAlgo::render_line(ib, pos(rng), 0, pos(rng), s_height - 1, {1.0f, 1.0f, 1.0f});
+        ImageBufAlgo::render_line(ib, 0, pos(rng), s_width - 1, pos(rng), {1.0f, 1.0f, 1.0f});
+    }
+
+    boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+    if (!ib.write(path)) {
+        std::cerr << "Could not write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+struct StageResult {
+    std::string name;
+    // What the stage processes, e.g., frame
+    std::string unit;
+    uint64_t count = 0;
+    double seconds = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void WriteJson(std::ostream &os, const BenchArguments &args, size_t points, int frames,
+                      const std::vector<StageResult> &stages, const PipelineStats &pipeline, double encodeSeconds) {
+    os << std::fixed << std::setprecision(1);
+    os << "{\n";
+    os << "  \"points\": " << points << ",\n";
+    os << "  \"frames\": " << frames << ",\n";
+    os << "  \"width\": " << s_width << ",\n";
+    os << "  \"height\": " << s_height << ",\n";
+    os << "  \"zoom\": " << args.Zoom << ",\n";
+    os << "  \"encoder\": \"" << args.Encoder.backend << "\",\n";
+    os << "  \"stages\": {\n";
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const auto &s = stages[i];
+        os << "    \"" << s.name << "\": {\"unit\": \"" << s.unit << "\", \"count\": " << s.count
+           << ", \"seconds\": " << std::setprecision(6) << s.seconds << std::setprecision(1)
+           << ", \"ns_per_unit\": " << (s.count ? s.seconds * 1e9 / s.count : 0) << "}"
+           << (i + 1 < stages.size() ? "," : "") << "\n";
+    }
+    os << "  },\n";
+
+    // Busy times are summed over the threads of each stage of the pipeline
+    auto perFrame = [&](const PipelineStageStats &s) { return s.frames ? s.busySeconds * 1e9 / s.frames : 0; };
+    os << "  \"encode\": {\"frames\": " << pipeline.encode.frames << ", \"seconds\": " << std::setprecision(6)
+       << encodeSeconds << std::setprecision(1) << ", \"frames_per_second\": "
+       << (encodeSeconds > 0 ? pipeline.encode.frames / encodeSeconds : 0)
+       << ", \"render_ns_per_frame\": " << perFrame(pipeline.render)
+       << ", \"convert_ns_per_frame\": " << perFrame(pipeline.convert)
+       << ", \"encode_ns_per_frame\": " << perFrame(pipeline.encode) << "},\n";
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    os << "  \"peak_rss_kb\": " << usage.ru_maxrss << "\n";
+    os << "}\n";
+}
+
+// Draws the frames like gps does, with a single zoom level
+static FrameRendererPtr CreateRenderer(GPXPtr gpx, GeoSamplesPtr samples, TileManagerPtr tiles,
+                                       ComposedTileCachePtr composedTiles, ResourcesPtr resources, int zoom) {
+    FrameRenderer::Params rp;
+    rp.wholeTrack = gpx;
+    rp.samples = samples;
+    rp.tiles = tiles;
+    rp.composedTiles = composedTiles;
+    rp.resources = resources;
+    rp.zoomLevels = {{zoom, 60}};
+    rp.markers = FrameRenderer::GetMarkers(*resources, gpx->First().Latitude, gpx->First().Longitude,
+                                           gpx->Last().Latitude, gpx->Last().Longitude);
+    rp.layers = {"map", "date", "stats"};
+    rp.width = s_width;
+    rp.height = s_height;
+    rp.duration = gpx->Last().Timestamp - gpx->First().Timestamp;
+    return FrameRenderer::Create(rp);
+}
+
+int main(int argc, char **argv) {
+    BenchArguments args;
+    if (!ParseCommandLine(argc, argv, args)) {
+        std::cerr << "usage: " << argv[0] << " -rsrcdir /path/to/resources [-points n] [-interval seconds] "
+                  << "[-frames n] [-zoom n] [-encoder name] [-tile-store dir|pack] [-workdir dir] [-json file]\n";
+        return -1;
+    }
+
+    // Keep stdout for the results, the libraries log progress there
+    auto coutBuf = std::cout.rdbuf(std::cerr.rdbuf());
+
+    bool removeWorkDir = args.WorkDir.empty();
+    if (removeWorkDir) {
+        args.WorkDir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("gps-bench-%%%%%%");
+    }
+    auto tilesDir = args.WorkDir / "tiles";
+    boost::filesystem::create_directories(tilesDir);
+
+    // Tiles are generated in a directory, then imported into other stores
+    auto storeDir = args.TileStore == "dir" ? tilesDir : args.WorkDir / args.TileStore;
+    boost::filesystem::create_directories(storeDir);
+    auto store = ITileStore::Create(args.TileStore, storeDir.string());
+    if (!store) {
+        return -1;
+    }
+
+    auto resources = Resources::Create(args.ResourceDir);
+    if (!resources) {
+        return -1;
+    }
+
+    // Tiles that are not generated below fail to download instead of going to the network
+    auto mapPath = (args.WorkDir / "map.xml").string();
+    {
+        std::ofstream os(mapPath);
+        os << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           << "<map><name>gps-bench</name><url>file:///nonexistent/$z/$x/$y.png</url></map>\n";
+    }
+
+    Downloader::Params dp;
+    dp.maxRetries = 0;
+    auto downloader = Downloader::Create(dp);
+    auto tiles = downloader ? TileManager::Create(store, mapPath, downloader) : nullptr;
+    if (!tiles) {
+        std::cerr << "Could not create tile manager\n";
+        return -1;
+    }
+
+    std::vector<StageResult> stages;
+
+    auto gpxPath = (args.WorkDir / "track.gpx").string();
+    if (!WriteTrack(gpxPath, args.Points, args.Interval)) {
+        return -1;
+    }
+
+    auto gpx = GPX::Create();
+    gpx->SetUseCache(false);
+    auto start = Clock::now();
+    if (!gpx->LoadFromFile(gpxPath)) {
+        std::cerr << "Could not load " << gpxPath << "\n";
+        return -1;
+    }
+    gpx->CreateSegments();
+    stages.push_back({"gpx_load", "point", gpx->GetItems().size(), SecondsSince(start)});
+
+    auto last = gpx->GetItems().size() - 1;
+    auto samples = GeoSamples::Create(*gpx, 0, last, s_fps);
+    auto frames = (int) std::min<size_t>(args.Frames, samples->Size());
+
+    // Only generate the tiles that the rendered frames need
+    size_t lastItem = 0;
+    for (size_t i = 0; i <= last && gpx->GetItems()[i].Timestamp <= gpx->First().Timestamp + frames / s_fps + 1; ++i) {
+        lastItem = i;
+    }
+    auto trackTiles = TilePrefetcher::GetTrackTiles(*tiles, *gpx, 0, lastItem, {args.Zoom});
+    for (const auto &td : trackTiles) {
+        std::stringstream ss;
+        ss << tilesDir.string() << "/" << td.z << "/" << td.x << "/" << td.y << ".png";
+        if (!WriteTile(ss.str(), td)) {
+            return -1;
+        }
+    }
+
+    if (storeDir != tilesDir && ITileStore::ImportDirectory(*store, tilesDir.string()) < 0) {
+        return -1;
+    }
+
+    // Decoding tiles and drawing the track over them
+    auto trackIndex = TrackIndex::Create(gpx, tiles);
+    auto composedTiles = ComposedTileCache::Create(tiles, trackIndex);
+    start = Clock::now();
+    for (const auto &td : trackTiles) {
+        if (!composedTiles->GetTile(td.x, td.y, td.z)) {
+            return -1;
+        }
+    }
+    stages.push_back({"compose_tiles", "tile", trackTiles.size(), SecondsSince(start)});
+
+    // The generators of each layer on their own
+    ImageBuf scratch(ImageSpec(s_width, s_height, 4));
+    auto tracker = GeoTracker::Create(samples);
+    auto markers = FrameRenderer::GetMarkers(*resources, gpx->First().Latitude, gpx->First().Longitude,
+                                             gpx->Last().Latitude, gpx->Last().Longitude);
+    MapImageGenerator::Params mp = {gpx, tracker, tiles, resources, args.Zoom, markers, composedTiles};
+    auto mapGenerator = MapImageGenerator::Create(mp);
+    auto date = LabelGenerator::Create(tracker, resources, LabelGenerator::Date);
+    auto stats = LabelGenerator::Create(tracker, resources, LabelGenerator::Stats);
+
+    StageResult geo = {"geo", "frame"}, map = {"map", "frame"}, labels = {"labels", "frame"};
+    for (int f = 0; f < frames; ++f) {
+        start = Clock::now();
+        tracker->Generate(scratch, f, s_fps);
+        geo.seconds += SecondsSince(start);
+
+        start = Clock::now();
+        if (!mapGenerator->Generate(scratch, f, s_fps)) {
+            return -1;
+        }
+        map.seconds += SecondsSince(start);
+
+        start = Clock::now();
+        date->Generate(scratch, f, s_fps);
+        stats->Generate(scratch, f, s_fps);
+        labels.seconds += SecondsSince(start);
+    }
+    geo.count = map.count = labels.count = frames;
+    stages.push_back(geo);
+    stages.push_back(map);
+    stages.push_back(labels);
+
+    // Whole frames as gps draws them, only repainting what changed
+    auto renderer = CreateRenderer(gpx, samples, tiles, composedTiles, resources, args.Zoom);
+    if (!renderer) {
+        return -1;
+    }
+    uint64_t unchangedFrames = 0;
+    start = Clock::now();
+    for (int f = 0; f < frames; ++f) {
+        ROI damage;
+        if (!renderer->Render(f, s_fps, damage)) {
+            return -1;
+        }
+        unchangedFrames += damage.ybegin >= damage.yend || damage.xbegin >= damage.xend;
+    }
+    stages.push_back({"compose_frame", "frame", (uint64_t) frames, SecondsSince(start)});
+    std::cerr << unchangedFrames << " of " << frames << " frames were unchanged\n";
+
+    std::vector<uint8_t> yuv(s_width * s_height * 3 / 2);
+    const auto &canvas = renderer->GetCanvas();
+    auto rgba = (const uint8_t *) canvas.localpixels();
+    start = Clock::now();
+    for (int f = 0; f < frames; ++f) {
+        ConvertRGBAToI420(rgba, s_width * 4, yuv.data(), s_width, yuv.data() + s_width * s_height, s_width / 2,
+                          yuv.data() + s_width * s_height * 5 / 4, s_width / 2, s_width, s_height);
+    }
+    stages.push_back({"convert", "frame", (uint64_t) frames, SecondsSince(start)});
+
+    // The whole pipeline, with a fresh generator for each render thread
+    auto factory = [&]() -> FrameGeneratorCallback {
+        auto state = CreateRenderer(gpx, samples, tiles, composedTiles, resources, args.Zoom);
+        return [state, frames](VideoEncoder &encoder, AVFrame *frame, FrameInfo &info) {
+            ROI damage;
+            if (!state || info.index >= frames || !state->Render(info.index, s_fps, damage)) {
+                return false;
+            }
+
+            info.unchanged = damage.ybegin >= damage.yend || damage.xbegin >= damage.xend;
+            if (info.unchanged) {
+                return true;
+            }
+
+            const auto &canvas = state->GetCanvas();
+            for (int y = 0; y < s_height; ++y) {
+                memcpy(frame->data[0] + y * frame->linesize[0], canvas.pixeladdr(0, y), s_width * 4);
+            }
+            return true;
+        };
+    };
+
+    auto videoPath = (args.WorkDir / "bench.mp4").string();
+    auto encoder = VideoEncoder::Create(videoPath, s_width, s_height, s_fps, factory, args.Encoder);
+    if (!encoder) {
+        std::cerr << "Could not create encoder\n";
+        return -1;
+    }
+    start = Clock::now();
+    encoder->EncodeLoop();
+    encoder->Finalize();
+    auto encodeSeconds = SecondsSince(start);
+
+    std::cout.rdbuf(coutBuf);
+    if (args.JsonPath.empty()) {
+        WriteJson(std::cout, args, gpx->GetItems().size(), frames, stages, encoder->GetPipelineStats(), encodeSeconds);
+    } else {
+        std::ofstream os(args.JsonPath);
+        WriteJson(os, args, gpx->GetItems().size(), frames, stages, encoder->GetPipelineStats(), encodeSeconds);
+    }
+
+    if (removeWorkDir) {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(args.WorkDir, ec);
+    }
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares the batched track math against the scalar code it replaced,
+// both for speed and for the agreement of the results.
+//
+// Usage: trackmath-bench [points]
+
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <stdlib.h>
+#include <vector>
+
+#include <gpsmap/trackmath.h>
+
+using namespace gpsmap;
+
+namespace reference {
+
+static inline double to_rad(double deg) {
+    return deg * M_PI / 180.0;
+}
+
+static inline double to_deg(double rad) {
+    return rad * 180.0 / M_PI;
+}
+
+static double distance(double lat1, double lon1, double lat2, double lon2) {
+    // Radius of Earth in meters, R = 6371 * 1000
+    long double R = 6371 * 1000;
+
+    lat1 = to_rad(lat1);
+    lon1 = to_rad(lon1);
+    lat2 = to_rad(lat2);
+    lon2 = to_rad(lon2);
+
+    // Haversine Formula
+    long double dlon = lon2 - lon1;
+    long double dlat = lat2 - lat1;
+
+    long double ans = pow(sin(dlat / 2), 2) + cos(lat1) * cos(lat2) * pow(sin(dlon / 2), 2);
+
+    return R * 2 * asin(sqrt(ans));
+}
+
+static double bearing(double lat1, double lon1, double lat2, double lon2) {
+    lat1 = to_rad(lat1);
+    lon1 = to_rad(lon1);
+    lat2 = to_rad(lat2);
+    lon2 = to_rad(lon2);
+
+    auto x = cos(lat2) * sin(lon2 - lon1);
+    auto y = cos(lat1) * sin(lat2) - sin(lat1) * cos(lat2) * cos(lon2 - lon1);
+    auto bearing = atan2(x, y);
+    return to_deg(bearing);
+}
+
+static double GetGrade(const std::vector<double> &deltas, const std::vector<double> &elevations, int i) {
+    const double maxDist = 50.0;
+
+    // Get altitude and cumulative distance on the left
+    double ldist = 0.0;
+    double lelev = 0.0;
+    for (auto l = i; l >= 0; --l) {
+        ldist += deltas[l];
+        lelev = elevations[l];
+        if (ldist >= maxDist) {
+            break;
+        }
+    }
+
+    // Get altitude and cumulative distance on the right
+    double rdist = 0.0;
+    double relev = 0.0;
+    for (size_t l = i; l < deltas.size(); ++l) {
+        rdist += deltas[l];
+        relev = elevations[l];
+        if (rdist >= maxDist) {
+            break;
+        }
+    }
+
+    auto td = ldist + rdist;
+    if (td < 0.01) {
+        return 0.0;
+    }
+
+    return (relev - lelev) / td * 100;
+}
+
+} // namespace reference
+
+struct Track {
+    std::vector<double> lat, lon, elevation;
+};
+
+// A 10 Hz ride with turns, climbs, and stops where the position does not change
+static Track GenerateTrack(size_t count) {
+    Track t;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> turn(-0.2, 0.2);
+    std::uniform_real_distribution<double> speed(0.0, 1.5);
+    std::uniform_real_distribution<double> climb(-0.05, 0.05);
+    std::uniform_int_distribution<int> stop(0, 200);
+
+    double lat = 46.5, lon = 6.6, elevation = 400, heading = 0;
+    int stopped = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (stopped) {
+            --stopped;
+        } else if (!stop(rng)) {
+            stopped = 50;
+        } else {
+            heading += turn(rng);
+            auto meters = speed(rng);
+            lat += meters * cos(heading) / 111195.0;
+            lon += meters * sin(heading) / (111195.0 * cos(lat * M_PI / 180.0));
+            elevation += climb(rng);
+        }
+
+        t.lat.push_back(lat);
+        t.lon.push_back(lon);
+        t.elevation.push_back(elevation);
+    }
+
+    return t;
+}
+
+template <typename F> static double Time(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void Report(const char *name, double refSeconds, double newSeconds, double maxError, const char *unit) {
+    std::cout << "  " << name << ": reference " << refSeconds * 1000 << " ms, batched " << newSeconds * 1000
+              << " ms (" << refSeconds / newSeconds << "x), max error " << maxError << " " << unit << "\n";
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    if (count < 2) {
+        std::cerr << "Need at least 2 points\n";
+        return -1;
+    }
+
+    auto t = GenerateTrack(count);
+    std::cout << count << " points\n";
+
+    std::vector<double> refDist(count), newDist(count);
+    auto refDistTime = Time([&] {
+        refDist[0] = 0;
+        for (size_t i = 1; i < count; ++i) {
+            refDist[i] = reference::distance(t.lat[i - 1], t.lon[i - 1], t.lat[i], t.lon[i]);
+        }
+    });
+    auto newDistTime = Time([&] { ComputeDistances(t.lat.data(), t.lon.data(), count, newDist.data()); });
+
+    double distError = 0;
+    for (size_t i = 0; i < count; ++i) {
+        distError = std::max(distError, fabs(newDist[i] - refDist[i]));
+    }
+
+    std::vector<double> refBearing(count - 1), newBearing(count - 1);
+    auto refBearingTime = Time([&] {
+        for (size_t i = 0; i + 1 < count; ++i) {
+            refBearing[i] = reference::bearing(t.lat[i], t.lon[i], t.lat[i + 1], t.lon[i + 1]);
+        }
+    });
+    auto newBearingTime = Time([&] { ComputeBearings(t.lat.data(), t.lon.data(), count, newBearing.data()); });
+
+    // The bearing between points a few millimeters apart is mostly rounding noise in both
+    // implementations, so only compare it for points that are at least 10 cm apart.
+    // Identical points must keep a bearing of exactly 0, the loader relies on it.
+    double bearingError = 0;
+    size_t zeroMismatches = 0;
+    for (size_t i = 0; i + 1 < count; ++i) {
+        if (refDist[i + 1] >= 0.1) {
+            auto d = fabs(newBearing[i] - refBearing[i]);
+            bearingError = std::max(bearingError, std::min(d, 360 - d));
+        }
+        zeroMismatches += (newBearing[i] == 0) != (refBearing[i] == 0);
+    }
+
+    std::vector<double> refGrade(count), newGrade(count);
+    auto refGradeTime = Time([&] {
+        for (size_t i = 0; i < count; ++i) {
+            refGrade[i] = reference::GetGrade(refDist, t.elevation, i);
+        }
+    });
+    auto newGradeTime = Time([&] { ComputeGrades(refDist.data(), t.elevation.data(), count, newGrade.data()); });
+
+    double gradeError = 0;
+    for (size_t i = 0; i < count; ++i) {
+        gradeError = std::max(gradeError, fabs(newGrade[i] - refGrade[i]));
+    }
+
+    Report("distance", refDistTime, newDistTime, distError, "m");
+    Report("bearing", refBearingTime, newBearingTime, bearingError, "deg");
+    Report("grade", refGradeTime, newGradeTime, gradeError, "%");
+
+    bool ok = distError < 1e-6 && bearingError < 1e-5 && !zeroMismatches && gradeError < 1e-6;
+    if (!ok) {
+        std::cerr << "Results do not agree with the reference implementation (" << zeroMismatches
+                  << " zero bearing mismatches)\n";
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COLORSPACE_H
+
+#define COLORSPACE_H
+
+#include <stdint.h>
+
+namespace gpsmap {
+
+// Same-size conversion of RGBA frames to the YUV formats of the encoders, with BT.601
+// limited range coefficients like swscale. Chroma is the average of each 2x2 block.
+// Alpha is ignored. The loops are written so that the compiler vectorizes them.
+
+// Planar Y, U and V, with chroma subsampled by 2 in both directions
+void ConvertRGBAToI420(const uint8_t *rgba, int rgbaStride, uint8_t *y, int yStride, uint8_t *u, int uStride,
+                       uint8_t *v, int vStride, int width, int height);
+
+// Planar Y followed by interleaved U and V, as uploaded to hardware encoders
+void ConvertRGBAToNV12(const uint8_t *rgba, int rgbaStride, uint8_t *y, int yStride, uint8_t *uv, int uvStride,
+                       int width, int height);
+
+} // namespace gpsmap
+
+#endif
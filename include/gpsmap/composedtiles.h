@@ -0,0 +1,124 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMPOSEDTILES_H
+
+#define COMPOSEDTILES_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <OpenImageIO/imagebuf.h>
+
+#include "tilemanager.h"
+#include "trackindex.h"
+
+namespace gpsmap {
+
+class ComposedTile;
+using ComposedTilePtr = std::shared_ptr<const ComposedTile>;
+
+// A map tile with the segments of the track that cross it drawn over it
+class ComposedTile {
+private:
+    TileDesc m_desc;
+    OIIO::ImageBuf m_image;
+
+    ComposedTile(const TileDesc &desc, int width, int height)
+        : m_desc(desc), m_image(OIIO::ImageSpec(width, height, 4)) {
+    }
+
+    friend class ComposedTileCache;
+
+public:
+    const TileDesc &Desc() const {
+        return m_desc;
+    }
+
+    // Always 4 channels of UINT8
+    const OIIO::ImageBuf &GetImage() const {
+        return m_image;
+    }
+};
+
+class ComposedTileCache;
+using ComposedTileCachePtr = std::shared_ptr<ComposedTileCache>;
+
+// Composed tiles shared by the map generators of all segments, so that a tile
+// is only decoded and overlaid with the track once per run, instead of once
+// per generator every time the map moves over it.
+class ComposedTileCache {
+private:
+    // Built by the first thread that needs the tile, the others wait for it
+    struct Entry {
+        std::mutex lock;
+        ComposedTilePtr tile;
+        bool failed = false;
+    };
+
+    using EntryPtr = std::shared_ptr<Entry>;
+
+    TileManagerPtr m_tiles;
+    TrackIndexPtr m_trackIndex;
+
+    std::mutex m_lock;
+    std::unordered_map<TileDesc, EntryPtr> m_entries;
+
+    // Composed tiles, most recently used first. Protected by m_lock.
+    using LRUList = std::list<TileDesc>;
+    LRUList m_lru;
+    std::unordered_map<TileDesc, LRUList::iterator> m_resident;
+    size_t m_residentBytes = 0;
+    size_t m_cacheBudget = 0;
+
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+    std::atomic<uint64_t> m_evictions{0};
+
+    ComposedTileCache(TileManagerPtr tiles, TrackIndexPtr trackIndex) : m_tiles(tiles), m_trackIndex(trackIndex) {
+    }
+
+    ComposedTilePtr Compose(const TileDesc &desc);
+    void Evict();
+
+public:
+    static ComposedTileCachePtr Create(TileManagerPtr tiles, TrackIndexPtr trackIndex) {
+        return ComposedTileCachePtr(new ComposedTileCache(tiles, trackIndex));
+    }
+
+    // Returns the given tile with the track drawn over it, composing it on first use
+    ComposedTilePtr GetTile(int x, int y, int zoom);
+
+    // Limits the memory used by composed tiles. Least recently used tiles are
+    // dropped when the budget is exceeded, except those that are still referenced
+    // by a map generator. A budget of 0 means no limit.
+    void SetCacheBudget(size_t bytes) {
+        m_cacheBudget = bytes;
+    }
+
+    TileCacheStats GetCacheStats();
+};
+
+} // namespace gpsmap
+
+#endif
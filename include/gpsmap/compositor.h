@@ -0,0 +1,106 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMPOSITOR_H
+
+#define COMPOSITOR_H
+
+#include <OpenImageIO/imagebuf.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapgen.h"
+#include "metrics.h"
+
+namespace gpsmap {
+
+class Compositor;
+using CompositorPtr = std::shared_ptr<Compositor>;
+
+// Draws a stack of layers into a canvas that is kept from one frame to the next.
+// Only the area where layers changed since the canvas was last drawn is repainted.
+// Layers that are partly in that area are drawn aside and only that part is copied,
+// opaque layers keep what they drew there for as long as their state does not change.
+class Compositor {
+public:
+    struct LayerKey {
+        bool valid = false;
+        FrameKey key;
+    };
+
+    // State of every layer, see IFrameGenerator::GetStateKey()
+    using LayerKeys = std::vector<LayerKey>;
+
+private:
+    struct Layer {
+        std::string name;
+        IFrameGeneratorPtr generator;
+        // Time spent drawing the layer, shared by the compositors of all the videos
+        MetricHistogram *drawTime;
+
+        // Where the layer is drawn when only part of it is damaged. Opaque layers
+        // keep their drawing in the state of bufferKey.
+        OIIO::ImageBuf buffer;
+        LayerKey bufferKey;
+    };
+
+    OIIO::ImageBuf m_canvas;
+    std::vector<Layer> m_layers;
+
+    // State of the layers drawn on the canvas, if m_canvasValid is set
+    LayerKeys m_canvasKeys;
+    bool m_canvasValid;
+
+    Compositor(int width, int height) : m_canvas(OIIO::ImageSpec(width, height, 4)), m_canvasValid(false) {
+    }
+
+    bool DrawPart(Layer &layer, const LayerKey &key, const OIIO::ROI &bounds, const OIIO::ROI &area, int frameIndex,
+                  int fps);
+
+public:
+    static CompositorPtr Create(int width, int height) {
+        return CompositorPtr(new Compositor(width, height));
+    }
+
+    // Layers are drawn in the order in which they are added
+    void AddLayer(const std::string &name, IFrameGeneratorPtr generator) {
+        m_layers.push_back({name, generator, &Metrics::GetHistogram("render.layer." + name + "_ns"), {}, {}});
+        m_canvasValid = false;
+    }
+
+    const OIIO::ImageBuf &GetCanvas() const {
+        return m_canvas;
+    }
+
+    void GetKeys(LayerKeys &keys) const;
+
+    // Returns the smallest area that contains every pixel that differs between
+    // the two states. The area is empty when both states look the same.
+    OIIO::ROI GetDamage(const LayerKeys &a, const LayerKeys &b) const;
+
+    // Brings the canvas up to date with the given frame, whose layers are in the given state
+    bool Compose(int frameIndex, int fps, const LayerKeys &keys);
+};
+
+} // namespace gpsmap
+
+#endif
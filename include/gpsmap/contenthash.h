@@ -0,0 +1,64 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CONTENTHASH_H
+
+#define CONTENTHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <type_traits>
+
+namespace gpsmap {
+
+// Incremental 64-bit FNV-1a
+class ContentHash {
+private:
+    uint64_t m_hash = 0xcbf29ce484222325ULL;
+
+public:
+    void AddBytes(const void *data, size_t size) {
+        auto p = (const uint8_t *) data;
+        for (size_t i = 0; i < size; ++i) {
+            m_hash ^= p[i];
+            m_hash *= 0x100000001b3ULL;
+        }
+    }
+
+    template <typename T> void AddValue(T value) {
+        static_assert(std::is_arithmetic<T>::value, "only numbers have a well defined representation");
+        AddBytes(&value, sizeof(value));
+    }
+
+    // The length goes first, so that consecutive strings can't be confused
+    void AddString(std::string_view str) {
+        AddValue((uint64_t) str.size());
+        AddBytes(str.data(), str.size());
+    }
+
+    uint64_t Value() const {
+        return m_hash;
+    }
+};
+
+} // namespace gpsmap
+
+#endif
@@ -0,0 +1,118 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef DOWNLOADER_H
+
+#define DOWNLOADER_H
+
+#include <atomic>
+#include <chrono>
+#include <curl/curl.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gpsmap {
+
+class Downloader;
+using DownloaderPtr = std::shared_ptr<Downloader>;
+
+// Called from the downloader thread when a transfer completes.
+// Must not block, as it would stall all the other transfers.
+using DownloadCallback = std::function<void(bool success)>;
+
+// Downloads files over a pool of persistent connections.
+// All transfers run on a single thread that drives a curl multi handle,
+// which reuses connections and multiplexes requests over HTTP/2 when
+// the server supports it.
+class Downloader {
+public:
+    struct Params {
+        // Maximum number of concurrent transfers
+        int maxTransfers = 8;
+
+        // How many times a failed transfer is retried
+        int maxRetries = 3;
+
+        // Delay before the first retry, doubled for each subsequent one
+        int retryDelayMs = 500;
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        std::string url;
+        std::string filePath;
+        DownloadCallback cb;
+
+        int attempts = 0;
+        Clock::time_point notBefore;
+
+        CURL *curl = nullptr;
+        FILE *fp = nullptr;
+    };
+
+    using RequestPtr = std::shared_ptr<Request>;
+
+    Params m_params;
+
+    CURLM *m_multi;
+    CURLSH *m_share;
+    std::vector<CURL *> m_idleHandles;
+
+    // Requests submitted by clients, protected by m_lock
+    std::mutex m_lock;
+    std::deque<RequestPtr> m_submitted;
+
+    // Requests owned by the downloader thread
+    std::deque<RequestPtr> m_pending;
+    std::vector<RequestPtr> m_active;
+
+    std::atomic_bool m_terminated;
+    std::thread m_thread;
+
+    Downloader(const Params &params);
+
+    bool Initialize();
+    void Loop();
+    void StartTransfers();
+    bool StartTransfer(RequestPtr &req);
+    void CompleteTransfer(CURL *curl, CURLcode result);
+
+public:
+    ~Downloader();
+
+    static DownloaderPtr Create(const Params &params);
+
+    // Queues the download of url into filePath and returns immediately.
+    void Submit(const std::string &url, const std::string &filePath, DownloadCallback cb);
+
+    // Downloads url into filePath and waits for completion.
+    bool Download(const std::string &url, const std::string &filePath);
+};
+
+} // namespace gpsmap
+
+#endif
@@ -22,9 +22,18 @@
 
 #define ENCODER_H
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "queue.h"
 
 extern "C" {
 struct AVOutputFormat;
@@ -34,6 +43,7 @@ struct AVCodec;
 struct AVStream;
 struct AVCodecContext;
 struct AVFrame;
+struct AVBufferRef;
 #include <libavcodec/avcodec.h>
 }
 
@@ -48,29 +58,93 @@ struct OutputStream {
     int64_t next_pts = 0;
     int samples_count = 0;
 
-    AVFrame *frame = nullptr;
-    AVFrame *tmp_frame = nullptr;
-
     float t = 0.0f, tincr = 0.0f, tincr2 = 0.0f;
 
     struct SwsContext *sws_ctx = nullptr;
+    // Converts bands of rows, for frames that only changed in part
+    struct SwsContext *band_sws_ctx = nullptr;
     struct SwrContext *swr_ctx = nullptr;
 
     ~OutputStream();
-
-    void *GetPixels() {
-        return tmp_frame->data[0];
-    }
 };
 
 using OutputStreamPtr = std::shared_ptr<OutputStream>;
 
+struct EncoderBackend;
+
 class VideoEncoder;
 using VideoEncoderPtr = std::shared_ptr<VideoEncoder>;
 
-using FrameGeneratorCallback = std::function<bool(VideoEncoder &encoder, OutputStream &os)>;
+struct FrameInfo {
+    // Index of the frame to render, which is also its pts
+    int64_t index;
+
+    // Set by the generator when the frame is identical to the previous one.
+    // The frame is then left as is and the previous frame is encoded again.
+    bool unchanged = false;
+
+    // Set by the generator to the rows that differ from the previous frame, in which case
+    // only those are converted. The whole frame must still be rendered.
+    int damageBegin = 0;
+    int damageEnd = std::numeric_limits<int>::max();
+};
+
+// Renders one RGBA frame. Returns false when there are no more frames to render.
+using FrameGeneratorCallback = std::function<bool(VideoEncoder &encoder, AVFrame *frame, FrameInfo &info)>;
+
+// Creates an independent generator for each render thread.
+// Every generator sees frame indices in increasing order, but not necessarily contiguous ones.
+using FrameGeneratorFactory = std::function<FrameGeneratorCallback()>;
+
+struct PipelineStageStats {
+    uint64_t frames = 0;
+
+    // Frames that were identical to the previous one and reused it
+    uint64_t reusedFrames = 0;
+
+    // Time spent processing frames, summed over all the threads of the stage
+    double busySeconds = 0;
+
+    // Time spent waiting for frames from the previous stage
+    double inputStallSeconds = 0;
+
+    // Time spent waiting for the next stage to accept a frame
+    double outputStallSeconds = 0;
+
+    // Average number of frames waiting for the next stage, out of capacity
+    double averageDepth = 0;
+    size_t capacity = 0;
+};
+
+struct PipelineStats {
+    PipelineStageStats render;
+    PipelineStageStats convert;
+    PipelineStageStats encode;
+};
 
 class VideoEncoder {
+public:
+    // Maximum distance between key frames
+    static const int GopSize = 12;
+
+    struct Params {
+        int renderThreads = 1;
+
+        // Maximum number of threads that may join the render stage with HelpRender()
+        int maxHelpers = 0;
+
+        // Threads of the software encoders, per video
+        int encoderThreads = 1;
+
+        // Name of the encoder backend, see GetBackends()
+        std::string backend = "x265";
+
+        // Hardware device used by hardware backends, empty for the default one
+        std::string device;
+
+        int bitrate = 400000;
+    };
+
 private:
     std::string m_filePath;
     int m_width;
@@ -83,24 +157,96 @@ private:
 
     OutputStreamPtr m_video;
 
-    FrameGeneratorCallback m_generateFrame;
+    Params m_params;
+    const EncoderBackend *m_backend;
+
+    // Format of the frames produced by the converter
+    enum AVPixelFormat m_swFormat;
 
-    VideoEncoder(const std::string &filePath, int w, int h, int fps, FrameGeneratorCallback cb);
-    OutputStreamPtr AddStream(enum AVCodecID codec_id);
+    // Set when the frames must be uploaded to a hardware device before encoding
+    AVBufferRef *m_hwDevice;
+    AVBufferRef *m_hwFrames;
+
+    FrameGeneratorFactory m_factory;
+
+    // Frames are rendered, converted to YUV and encoded by different threads,
+    // so that the encoder does not wait for rendering and the other way around.
+    //
+    // Render stage: frames rendered ahead of the converter, slot i holds frames i, i + n, i + 2n...
+    struct RenderSlot {
+        AVFrame *frame = nullptr;
+        // Index of the frame stored in the slot, -1 if none
+        int64_t index = -1;
+        bool ok = false;
+        bool unchanged = false;
+        int damageBegin = 0;
+        int damageEnd = 0;
+    };
+
+    std::vector<std::thread> m_renderers;
+    std::vector<RenderSlot> m_slots;
+
+    // Protect the render state below
+    std::mutex m_renderLock;
+    std::condition_variable m_renderCv;
+    int64_t m_nextRenderIndex;
+    int64_t m_consumedFrames;
+    int64_t m_endIndex;
+    // Set while render slots are allocated, so that helpers can join
+    bool m_pipelineRunning;
+    int m_activeHelpers;
+    PipelineStageStats m_renderStats;
+    uint64_t m_renderDepthSum;
+
+    // Convert stage: takes YUV frames from the pool and hands them to the encoder in pts order
+    std::thread m_converter;
+    std::vector<AVFrame *> m_yuvFrames;
+    // References the last converted frame, in order to encode it again
+    AVFrame *m_lastFrame;
+    std::unique_ptr<BoundedQueue<AVFrame *>> m_freeFrames;
+    std::unique_ptr<BoundedQueue<AVFrame *>> m_encodeQueue;
+    // When each frame of the encode queue was queued, indexed by pts modulo the number of YUV frames
+    std::vector<std::chrono::steady_clock::time_point> m_queuedAt;
+    PipelineStageStats m_convertStats;
+    PipelineStageStats m_encodeStats;
+
+    VideoEncoder(const std::string &filePath, int w, int h, int fps, FrameGeneratorFactory factory,
+                 const Params &params);
+    OutputStreamPtr AddStream(const EncoderBackend &backend);
+    bool CreateHardwareFrames(AVCodecContext *c);
+    int EncodeFrame(AVFrame *frame);
     bool OpenVideo(OutputStream *ost, AVDictionary *opt_arg);
-    AVFrame *GetVideoFrame();
+    void StartPipeline();
+    void StopPipeline();
+    void RenderLoop();
+    const RenderSlot *WaitForRenderedFrame(int64_t index);
+    void ReleaseRenderedFrame(int64_t index);
+    void ConvertLoop();
+    void ConvertRows(const AVFrame *rgba, AVFrame *frame, int begin, int end);
     int WriteFrame(AVCodecContext *c, AVStream *st, AVFrame *frame);
-    int WriteVideoFrame();
 
     bool Initialize();
 
 public:
     ~VideoEncoder();
 
-    static VideoEncoderPtr Create(const std::string &filePath, int w, int h, int fps, FrameGeneratorCallback cb);
-    void EncodeLoop();
+    static VideoEncoderPtr Create(const std::string &filePath, int w, int h, int fps, FrameGeneratorFactory factory,
+                                  const Params &params);
+
+    // Names of the encoder backends that can be passed in Params
+    static std::vector<std::string> GetBackends();
+    // Encodes all the frames. started is called once the pipeline runs, e.g. to let other threads
+    // join with HelpRender(), which fails before that.
+    void EncodeLoop(std::function<void()> started = nullptr);
     void Finalize();
 
+    // Renders frames of this video on the calling thread until there are none left.
+    // Returns false right away if the pipeline is not running or has enough helpers already.
+    bool HelpRender();
+
+    // Valid once EncodeLoop returns
+    PipelineStats GetPipelineStats() const;
+
     int Height() const {
         return m_height;
     }
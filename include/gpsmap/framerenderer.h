@@ -0,0 +1,118 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef FRAMERENDERER_H
+
+#define FRAMERENDERER_H
+
+#include <OpenImageIO/imagebuf.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "composedtiles.h"
+#include "compositor.h"
+#include "mapgen.h"
+#include "resources.h"
+
+namespace gpsmap {
+
+struct ZoomLevel {
+    int zoom;
+    // How long to display the map, in seconds
+    int duration;
+};
+
+using ZoomLevels = std::vector<ZoomLevel>;
+
+class FrameRenderer;
+using FrameRendererPtr = std::shared_ptr<FrameRenderer>;
+
+// Draws the frames of a segment: maps that cycle through the zoom levels, with the date and
+// stats labels over them. Each render thread has its own renderer, and the frames it draws
+// don't depend on which frames the other threads drew.
+class FrameRenderer {
+public:
+    struct Params {
+        // Track drawn on the maps
+        GPXPtr wholeTrack;
+        GeoSamplesPtr samples;
+        TileManagerPtr tiles;
+        ComposedTileCachePtr composedTiles;
+        ResourcesPtr resources;
+        // The last level is shown at the beginning and end of the segment
+        ZoomLevels zoomLevels;
+        Markers markers;
+        // Drawn over each other in this order, see LayerNames
+        std::vector<std::string> layers;
+        int width;
+        int height;
+        // Length of the segment, in seconds
+        time_t duration;
+        // First frame of the video, which is drawn whole
+        int64_t firstFrame = 0;
+    };
+
+    static const char *const LayerNames[];
+
+private:
+    Params m_params;
+    GeoTrackerPtr m_geoTracker;
+    MapSwitcherPtr m_mapSwitcher;
+    CompositorPtr m_compositor;
+
+    int64_t m_prevFrameIndex;
+    // Layers of the previous frame, if m_prevKeysValid is set
+    Compositor::LayerKeys m_prevKeys;
+    bool m_prevKeysValid;
+    bool m_failed;
+
+    FrameRenderer(const Params &params)
+        : m_params(params), m_prevFrameIndex(-1), m_prevKeysValid(false), m_failed(false) {
+    }
+
+    bool Initialize();
+    bool Update(int64_t frameIndex, int fps);
+
+public:
+    static FrameRendererPtr Create(const Params &params);
+
+    // Start and finish markers of a track
+    static Markers GetMarkers(const Resources &resources, double startLatitude, double startLongitude,
+                              double endLatitude, double endLongitude);
+
+    // Brings the canvas to the given frame. damage gets the area that differs from the previous frame,
+    // which is empty when the frames look the same. Returns false past the last frame, or when the frame
+    // could not be drawn, in which case Failed() is set.
+    bool Render(int64_t frameIndex, int fps, OIIO::ROI &damage);
+
+    bool Failed() const {
+        return m_failed;
+    }
+
+    const OIIO::ImageBuf &GetCanvas() const {
+        return m_compositor->GetCanvas();
+    }
+};
+
+} // namespace gpsmap
+
+#endif
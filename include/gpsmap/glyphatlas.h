@@ -0,0 +1,120 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GLYPHATLAS_H
+
+#define GLYPHATLAS_H
+
+#include <OpenImageIO/imagebuf.h>
+
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace gpsmap {
+
+// Text formatted into a fixed size buffer, without allocating.
+// Whatever does not fit is dropped.
+class TextBuffer {
+private:
+    char m_data[64];
+    size_t m_size = 0;
+
+public:
+    void Append(std::string_view str) {
+        auto count = std::min(str.size(), sizeof(m_data) - m_size);
+        std::copy(str.begin(), str.begin() + count, m_data + m_size);
+        m_size += count;
+    }
+
+    // Pads with zeros to minDigits
+    void Append(int64_t value, int minDigits = 0) {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), value);
+        for (auto digits = res.ptr - buf; digits < minDigits; ++digits) {
+            Append("0");
+        }
+        Append(std::string_view(buf, res.ptr - buf));
+    }
+
+    void AppendFixed(double value, int precision) {
+        char buf[32];
+        auto res = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, precision);
+        if (res.ec == std::errc()) {
+            Append(std::string_view(buf, res.ptr - buf));
+        }
+    }
+
+    std::string_view View() const {
+        return std::string_view(m_data, m_size);
+    }
+};
+
+class GlyphAtlas;
+using GlyphAtlasPtr = std::shared_ptr<GlyphAtlas>;
+
+// Black on white labels, drawn from glyphs that FreeType rasterizes only once.
+class GlyphAtlas {
+private:
+    struct Glyph {
+        bool valid = false;
+        int advance = 0;
+
+        // Position of the first column of pixels relative to the pen
+        int left = 0;
+        int width = 0;
+
+        // RGBA rows of width pixels, white where there is no ink
+        std::vector<uint8_t> pixels;
+    };
+
+    int m_height;
+    int m_baseline;
+    Glyph m_glyphs[128];
+
+    GlyphAtlas(int height, int baseline) : m_height(height), m_baseline(baseline) {
+    }
+
+    bool Load(const std::string &fontPath, int fontSize, std::string_view chars);
+
+public:
+    // Rasterizes chars for bands of the given height, with text sitting on the baseline
+    static GlyphAtlasPtr Create(const std::string &fontPath, int fontSize, int height, int baseline,
+                                std::string_view chars);
+
+    int Height() const {
+        return m_height;
+    }
+
+    // Width in pixels of the given text
+    int GetWidth(std::string_view text) const;
+
+    // Draws a white band of Height() rows from row y of dest, with text centered in it.
+    // dest must be an 8 bits RGBA image in memory. Characters missing from the atlas are skipped.
+    bool DrawLabel(OIIO::ImageBuf &dest, int y, std::string_view text) const;
+};
+
+} // namespace gpsmap
+
+#endif
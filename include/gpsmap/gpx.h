@@ -26,6 +26,7 @@
 #include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 static inline double to_rad(double deg) {
@@ -36,18 +37,32 @@ static inline double to_deg(double rad) {
     return rad * 180.0 / M_PI;
 }
 
+// Normalized Web Mercator coordinates, from (0, 0) at the top left corner of the map to (1, 1).
+// Multiplying them by the number of tiles per axis at a zoom level (1 << zoom) gives tile coordinates.
+// https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
+static inline double to_mercator_x(double lon) {
+    return (lon + 180.0) / 360.0;
+}
+
+static inline double to_mercator_y(double lat) {
+    return (1.0 - asinh(tan(to_rad(lat))) / M_PI) / 2.0;
+}
+
 namespace gpsmap {
+// Only holds the numeric data used while rendering, see GPX::GetOriginalTimestamp() for the rest
 struct TrackItem {
     time_t Timestamp;
-    std::string OriginalTimestamp;
     double Latitude;
     double Longitude;
+    // Projected coordinates, see to_mercator_x/y
+    double MercatorX;
+    double MercatorY;
     double Speed;
     double Elevation;
-    float Grade;
     double DistanceDelta;
     double TotalDistance;
     double Bearing;
+    float Grade;
     bool IsTrackStart;
 
     bool operator<(const TrackItem &item) {
@@ -65,15 +80,54 @@ using Segments = std::vector<Segment>;
 
 class GPX {
 private:
-    GPX() {
+    GPX() : m_initialDistance(0.0), m_useCache(true), m_hasCachedSegments(false) {
     }
 
     std::vector<TrackItem> m_trackItems;
+
+    // Cold data, indexed like m_trackItems
+    struct TextRef {
+        uint32_t offset;
+        uint32_t length;
+    };
+    std::string m_text;
+    std::vector<TextRef> m_originalTimestamps;
+
     Segments m_segments;
     double m_initialDistance;
 
+    bool m_useCache;
+    Segments m_cachedSegments;
+    bool m_hasCachedSegments;
+
+    // Identifies the contents of a GPX file in the track cache
+    struct SourceInfo {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t hash;
+    };
+
+    bool Parse(std::string_view doc, const std::string &path);
+    void ComputeDerivedFields();
+    void ComputeTotalDistance();
+    static Segments ComputeSegments(const std::vector<TrackItem> &items);
+
+    static bool GetSourceInfo(const std::string &path, SourceInfo &source);
+    static uint64_t HashContents(std::string_view contents);
+    bool LoadCache(const std::string &cachePath, const std::string &path, SourceInfo &source);
+    bool SaveCache(const std::string &cachePath, const SourceInfo &source) const;
+
 public:
-    void LoadFromFile(const std::string &path);
+    // Appends the track points of the given file
+    bool LoadFromFile(const std::string &path);
+
+    // The first load of a file stores the parsed track and its derived data next to it,
+    // in a binary file that later loads map instead of parsing the GPX file again.
+    void SetUseCache(bool useCache) {
+        m_useCache = useCache;
+    }
+
+    static std::string GetCachePath(const std::string &path);
 
     void CreateSegments();
 
@@ -81,9 +135,16 @@ public:
         return m_segments;
     }
 
-    bool GetClosestItem(time_t timestamp, size_t &nextItem, TrackItem &item);
+    const TrackItem *GetClosestItem(time_t timestamp, size_t &nextItem) const;
 
-    bool GetItem(size_t index, TrackItem &item);
+    // Returns nullptr if index is out of bounds
+    const TrackItem *GetItem(size_t index) const;
+
+    // Timestamp of the item as written in the GPX file
+    std::string_view GetOriginalTimestamp(size_t index) const {
+        const auto &ref = m_originalTimestamps[index];
+        return std::string_view(m_text.data() + ref.offset, ref.length);
+    }
 
     const std::vector<TrackItem> &GetItems() const {
         return m_trackItems;
@@ -102,9 +163,18 @@ public:
     }
 
     static GPXPtr Create();
+
+    // Combines the items of already loaded tracks into one track,
+    // as if all their files had been loaded into it.
+    static GPXPtr Merge(const std::vector<GPXPtr> &gpxs);
 };
 
 time_t parse_time(const std::string &iso);
+
+// Parses UTC timestamps of the form YYYY-MM-DDTHH:MM:SS[.fff](Z|+hh:mm|-hh:mm).
+// Fractions of seconds are dropped.
+bool parse_time(std::string_view iso, time_t &t);
+
 std::string time_to_str(time_t t);
 } // namespace gpsmap
 
@@ -0,0 +1,132 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef JOBQUEUE_H
+
+#define JOBQUEUE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gpsmap {
+
+// Renders frames [firstFrame, endFrame) of a segment into the video named output
+struct RenderJob {
+    // Unique, also the name of the file of the job
+    std::string name;
+    int fileSequenceId = 0;
+    int segmentSequenceId = 0;
+    int64_t firstFrame = 0;
+    int64_t endFrame = std::numeric_limits<int64_t>::max();
+    std::string output;
+
+    int attempts = 0;
+    // Nodes on which the job failed, it is retried on another node when there is one
+    std::vector<std::string> failedNodes;
+};
+
+class JobQueue;
+using JobQueuePtr = std::shared_ptr<JobQueue>;
+
+// Hands render jobs from a coordinator to the workers of several nodes, through a directory
+// that all of them share, e.g. over NFS. Each job is a file that moves between subdirectories:
+//
+//   pending/name.job            submitted by the coordinator
+//   running/name.job.node       claimed by a worker with an atomic rename
+//   done/name.job, failed/...   left by the worker for the coordinator
+//
+// Workers write their videos to videos/ and touch nodes/node while they are alive, so that the
+// coordinator can give the jobs of a node that disappeared to the others. The coordinator
+// creates the stop file once every job is over.
+class JobQueue {
+private:
+    std::string m_dir;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    bool m_terminated;
+    std::thread m_heartbeat;
+
+    JobQueue(const std::string &dir) : m_dir(dir), m_terminated(false) {
+    }
+
+    std::string GetPath(const std::string &subdir, const std::string &name) const;
+    bool WriteJob(const RenderJob &job, const std::string &subdir);
+    static bool ReadJob(const std::string &path, RenderJob &job);
+    std::vector<RenderJob> TakeJobs(const std::string &subdir);
+    std::vector<std::string> GetLiveNodes(int timeout) const;
+
+public:
+    ~JobQueue();
+
+    static JobQueuePtr Create(const std::string &dir);
+
+    // The command line of the coordinator, which workers parse to build the same segments.
+    // The coordinator writes it once the tiles are in the store, workers wait for it.
+    bool WriteArguments(const std::vector<std::string> &args);
+    bool ReadArguments(std::vector<std::string> &args) const;
+
+    // Path of the video written by a job
+    std::string GetVideoPath(const std::string &output) const;
+
+    /* Coordinator */
+
+    // Drops the arguments, jobs and videos of a previous run
+    bool Reset();
+
+    bool Submit(const RenderJob &job);
+
+    // Removes and returns the jobs that workers completed or failed since the last call
+    std::vector<RenderJob> TakeDone();
+    std::vector<RenderJob> TakeFailed();
+
+    // Moves the jobs of nodes whose last heartbeat is older than timeout seconds to failed/
+    void FailStaleJobs(int timeout);
+
+    // Ends the run, removing its arguments
+    void Stop();
+
+    /* Workers */
+
+    // Claims a pending job. Jobs that failed on this node are only claimed when every live
+    // node failed them too. Returns false if there is nothing for this node.
+    bool Claim(const std::string &node, int timeout, RenderJob &job);
+
+    // Tells the coordinator that the node is alive, every interval seconds from a thread of the queue.
+    // The interval must be shorter than the timeout of the coordinator.
+    void StartHeartbeat(const std::string &node, int interval);
+
+    // Hands a claimed job back to the coordinator. Returns false if the coordinator gave up on it,
+    // e.g. because the node missed its heartbeats.
+    bool Complete(const RenderJob &job, const std::string &node);
+    bool Fail(const RenderJob &job, const std::string &node);
+
+    bool Stopped() const;
+};
+
+} // namespace gpsmap
+
+#endif
@@ -0,0 +1,70 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef MANIFEST_H
+
+#define MANIFEST_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "contenthash.h"
+
+namespace gpsmap {
+
+class OutputManifest;
+using OutputManifestPtr = std::shared_ptr<OutputManifest>;
+
+// Remembers a hash of the inputs of each video of an output directory, so that
+// the videos whose inputs did not change don't need to be encoded again.
+// The manifest is saved after every change, so that it survives interrupted runs.
+class OutputManifest {
+private:
+    std::string m_path;
+
+    std::mutex m_lock;
+    // Hash of each video, by file name
+    std::map<std::string, uint64_t> m_entries;
+
+    OutputManifest(const std::string &path) : m_path(path) {
+    }
+
+    bool Load();
+    bool Save();
+
+public:
+    static OutputManifestPtr Create(const std::string &outputDirectory);
+
+    // Returns false if the manifest has no hash for the video
+    bool Get(const std::string &name, uint64_t &hash);
+
+    // Returns the name of a video with the given hash, or an empty string
+    std::string Find(uint64_t hash);
+
+    void Set(const std::string &name, uint64_t hash);
+    void Remove(const std::string &name);
+};
+
+} // namespace gpsmap
+
+#endif
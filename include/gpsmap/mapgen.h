@@ -26,17 +26,104 @@
 #include <OpenImageIO/imageio.h>
 #include <functional>
 #include <memory>
+#include <string>
+#include <type_traits>
 #include <vector>
 
+#include "composedtiles.h"
+#include "glyphatlas.h"
 #include "gpx.h"
+#include "metrics.h"
 #include "resources.h"
+#include "sprite.h"
 #include "tilemanager.h"
+#include "trackindex.h"
 
 namespace gpsmap {
 
+// Identifies the image that generators render for their current state
+class FrameKey {
+private:
+    std::string m_data;
+
+public:
+    template <typename T> void Add(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "Key values must be plain data");
+        m_data.append((const char *) &value, sizeof(value));
+    }
+
+    void Add(std::string_view str) {
+        Add(str.size());
+        m_data.append(str);
+    }
+
+    void Add(const std::string &str) {
+        Add(std::string_view(str));
+    }
+
+    bool operator==(const FrameKey &other) const {
+        return m_data == other.m_data;
+    }
+};
+
 class IFrameGenerator {
 public:
     virtual bool Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) = 0;
+
+    // Adds to key everything that determines what Generate() draws in the current state,
+    // so that two frames with equal keys are identical. Returns false if the generator
+    // cannot tell, in which case every frame must be rendered.
+    virtual bool GetStateKey(FrameKey &key) const {
+        return false;
+    }
+
+    // Area of a frame with the given spec that Generate() draws to
+    virtual OIIO::ROI GetBounds(const OIIO::ImageSpec &spec) const {
+        return spec.roi();
+    }
+
+    // Returns true if Generate() overwrites every pixel of its bounds,
+    // in which case what is below doesn't need to be drawn beforehand.
+    virtual bool IsOpaque(const OIIO::ImageSpec &spec) const {
+        return false;
+    }
+};
+
+using IFrameGeneratorPtr = std::shared_ptr<IFrameGenerator>;
+
+// Geo data interpolated for every frame of a track segment.
+// Computed once per segment and shared by the trackers of all render threads,
+// so that any frame can be looked up independently of the others.
+class GeoSamples;
+using GeoSamplesPtr = std::shared_ptr<GeoSamples>;
+
+class GeoSamples {
+private:
+    int m_fps;
+
+    std::vector<time_t> m_date;
+    std::vector<double> m_lon, m_lat, m_mercx, m_mercy;
+    std::vector<double> m_speed, m_dist, m_elevation, m_bearing;
+    std::vector<float> m_grade;
+
+    GeoSamples(int fps) : m_fps(fps) {
+    }
+
+    void Compute(const GPX &gpx, size_t first, size_t last);
+
+    friend class GeoTracker;
+
+public:
+    static GeoSamplesPtr Create(const GPX &gpx, size_t first, size_t last, int fps);
+
+    int GetFPS() const {
+        return m_fps;
+    }
+
+    // Number of frames of the segment
+    size_t Size() const {
+        return m_date.size();
+    }
 };
 
 // Tracks geo data associated with each frame
@@ -45,24 +132,19 @@ using GeoTrackerPtr = std::shared_ptr<GeoTracker>;
 
 class GeoTracker : public IFrameGenerator {
 private:
-    GPXPtr m_gpx;
-    size_t m_firstItemIdx;
-    size_t m_nextItemIdx;
-    size_t m_lastItemIdx;
+    GeoSamplesPtr m_samples;
 
     double m_lon, m_lat, m_speed, m_dist, m_elevation, m_grade;
+    double m_mercx, m_mercy;
     double m_bearing;
     time_t m_date;
 
-    GeoTracker(GPXPtr gpx, size_t first, size_t last) : m_gpx(gpx) {
-        m_firstItemIdx = first;
-        m_lastItemIdx = last;
-        m_nextItemIdx = first;
-    };
+    GeoTracker(GeoSamplesPtr samples) : m_samples(samples) {
+    }
 
 public:
-    static GeoTrackerPtr Create(GPXPtr gpx, size_t first, size_t last) {
-        return GeoTrackerPtr(new GeoTracker(gpx, first, last));
+    static GeoTrackerPtr Create(GeoSamplesPtr samples) {
+        return GeoTrackerPtr(new GeoTracker(samples));
     }
 
     double Longitude() const {
@@ -73,6 +155,14 @@ public:
         return m_lat;
     }
 
+    double MercatorX() const {
+        return m_mercx;
+    }
+
+    double MercatorY() const {
+        return m_mercy;
+    }
+
     double Speed() const {
         return m_speed;
     }
@@ -98,6 +188,11 @@ public:
     }
 
     virtual bool Generate(OIIO::ImageBuf &ib, int frameIndex, int fps);
+
+    // Only tracks the position, there is nothing to draw
+    bool GetStateKey(FrameKey &key) const {
+        return true;
+    }
 };
 
 class MapImageGenerator;
@@ -107,7 +202,11 @@ struct Marker {
     double Latitude;
     double Longitude;
 
-    const OIIO::ImageBuf *Image;
+    // Computed from the latitude and longitude by the map generator
+    double MercatorX;
+    double MercatorY;
+
+    const Sprite *Image;
 
     // Coordinates in Image that correspond to latitude, longitude
     int x;
@@ -125,34 +224,49 @@ public:
         ResourcesPtr resources;
         int zoom;
         Markers markers;
+        // Tiles of gpx with the track drawn over them, shared by all generators
+        ComposedTileCachePtr composedTiles;
     };
 
 private:
     GPXPtr m_gpx;
     GeoTrackerPtr m_tracker;
     ResourcesPtr m_res;
-    OIIO::ImageBuf m_grid;
     TileManagerPtr m_tiles;
+    ComposedTileCachePtr m_composedTiles;
+
+    // 3x3 grid of tiles around the one under the current position,
+    // which is m_gridTiles[1][1]. The grid is empty until the first frame.
+    ComposedTilePtr m_gridTiles[3][3];
+    bool m_gridLoaded;
     int m_centerx, m_centery;
     int m_viewportx, m_viewporty;
     int m_zoom;
 
+    // How often and how long the grid is loaded at this zoom level
+    MetricHistogram &m_gridLoads;
+
     Markers m_markers;
 
-    // TODO: clean hard-coded constants
     MapImageGenerator(Params &params)
-        : m_gpx(params.gpx), m_tracker(params.tracker), m_res(params.resources),
-          m_grid(OIIO::ImageSpec(512 * 3, 512 * 3, 4)), m_tiles(params.tiles), m_centerx(0), m_centery(0),
-          m_zoom(params.zoom), m_markers(params.markers) {
+        : m_gpx(params.gpx), m_tracker(params.tracker), m_res(params.resources), m_tiles(params.tiles),
+          m_composedTiles(params.composedTiles), m_gridLoaded(false), m_centerx(0), m_centery(0),
+          m_zoom(params.zoom),
+          m_gridLoads(Metrics::GetHistogram("map.z" + std::to_string(params.zoom) + ".grid_load_ns")),
+          m_markers(params.markers) {
+        for (auto &m : m_markers) {
+            m.MercatorX = to_mercator_x(m.Longitude);
+            m.MercatorY = to_mercator_y(m.Latitude);
+        }
     }
 
-    void ToViewPortCoordinates(double lat, double lon, int &x, int &y) const;
-    void ToGridCoordinates(double lat, double lon, int &x, int &y) const;
+    void ToViewPortCoordinates(double mx, double my, int &x, int &y) const;
+    void ToGridCoordinates(double mx, double my, int &x, int &y) const;
 
-    bool LoadGrid(TilePtr tile);
+    bool LoadGrid(int x, int y);
+    bool CopyViewport(OIIO::ImageBuf &ib, int x, int y);
     bool DrawDot(OIIO::ImageBuf &ib);
     void DrawMarkers(OIIO::ImageBuf &ib);
-    void DrawTrack(OIIO::ImageBuf &ib);
     bool DrawArrow(OIIO::ImageBuf &ib, double bearing);
 
 public:
@@ -161,29 +275,49 @@ public:
     }
 
     bool Generate(OIIO::ImageBuf &ib, int frameIndex, int fps);
+    bool IsOpaque(const OIIO::ImageSpec &spec) const;
+    bool GetStateKey(FrameKey &key) const;
 };
 
 class LabelGenerator;
 using LabelGeneratorPtr = std::shared_ptr<LabelGenerator>;
 
 class LabelGenerator : public IFrameGenerator {
+public:
+    enum Kind {
+        // Date and time, at the top of the frame
+        Date,
+        // Speed, elevation and distance, at the bottom of the frame
+        Stats
+    };
+
 private:
     GeoTrackerPtr m_geo;
-    std::string m_fontPath;
+    ResourcesPtr m_res;
+    Kind m_kind;
+
+    // The date only changes once per second
+    mutable time_t m_lastDate;
+    mutable struct tm m_lastTime;
 
-    // Cached labels
-    std::string m_lbl1, m_lbl2;
-    OIIO::ImageBuf m_buf1, m_buf2;
+    LabelGenerator(GeoTrackerPtr geo, ResourcesPtr res, Kind kind)
+        : m_geo(geo), m_res(res), m_kind(kind), m_lastDate(-1), m_lastTime() {
+    }
 
-    LabelGenerator(GeoTrackerPtr geo, const std::string &fontPath)
-        : m_geo(geo), m_fontPath(fontPath), m_buf1(OIIO::ImageSpec(512, 32, 4)), m_buf2(OIIO::ImageSpec(512, 32, 4)){};
+    void GetLabel(TextBuffer &text) const;
 
 public:
-    static LabelGeneratorPtr Create(GeoTrackerPtr geo, const std::string &fontPath) {
-        return LabelGeneratorPtr(new LabelGenerator(geo, fontPath));
+    static LabelGeneratorPtr Create(GeoTrackerPtr geo, ResourcesPtr res, Kind kind) {
+        return LabelGeneratorPtr(new LabelGenerator(geo, res, kind));
     }
 
     bool Generate(OIIO::ImageBuf &ib, int frameIndex, int fps);
+    bool GetStateKey(FrameKey &key) const;
+    OIIO::ROI GetBounds(const OIIO::ImageSpec &spec) const;
+
+    bool IsOpaque(const OIIO::ImageSpec &spec) const {
+        return true;
+    }
 };
 
 class MapSwitcher;
@@ -208,6 +342,8 @@ private:
         m_prevSecond = -1;
     };
 
+    void NextSecond();
+
 public:
     static MapSwitcherPtr Create(GeoTrackerPtr geo, MapSwitcherCb cb) {
         return MapSwitcherPtr(new MapSwitcher(geo, cb));
@@ -219,7 +355,12 @@ public:
         m_remainingDuration = m_maps[0].second;
     }
 
+    // Selects the map to display for the given frame, without drawing it
+    void Update(int frameIndex, int fps);
+
     bool Generate(OIIO::ImageBuf &ib, int frameIndex, int fps);
+    bool IsOpaque(const OIIO::ImageSpec &spec) const;
+    bool GetStateKey(FrameKey &key) const;
 };
 
 } // namespace gpsmap
@@ -0,0 +1,67 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef MAPPEDFILE_H
+
+#define MAPPEDFILE_H
+
+#include <memory>
+#include <string>
+
+namespace gpsmap {
+
+class MappedFile;
+using MappedFilePtr = std::shared_ptr<MappedFile>;
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    void *m_data;
+    size_t m_size;
+    size_t m_mappedSize;
+
+    MappedFile() : m_data(nullptr), m_size(0), m_mappedSize(0) {
+    }
+
+public:
+    ~MappedFile();
+
+    // Files that are read from start to end are read ahead more aggressively.
+    // At least reserve bytes are mapped, so that data appended to the file later can be read
+    // without mapping it again, as long as it is only read once it was written.
+    static MappedFilePtr Create(const std::string &path, bool sequential = true, size_t reserve = 0);
+
+    const char *Data() const {
+        return (const char *) m_data;
+    }
+
+    // Size of the file when it was mapped
+    size_t Size() const {
+        return m_size;
+    }
+
+    size_t MappedSize() const {
+        return m_mappedSize;
+    }
+};
+
+} // namespace gpsmap
+
+#endif
@@ -0,0 +1,249 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef METRICS_H
+
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace gpsmap {
+
+// Counters and histograms are updated from the hot paths of many threads at once.
+// Each thread updates one of a few shards, so that threads rarely share a cache line.
+static const unsigned MetricShards = 16;
+
+inline unsigned GetMetricShard() {
+    static std::atomic_uint next(0);
+    thread_local unsigned shard = next++ % MetricShards;
+    return shard;
+}
+
+class MetricCounter {
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+
+    Shard m_shards[MetricShards];
+
+public:
+    void Add(uint64_t n = 1) {
+        m_shards[GetMetricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t Value() const;
+};
+
+// Counts values in power of two buckets. That is precise enough to tell where the time goes,
+// and cheap enough to record every frame and every tile.
+class MetricHistogram {
+public:
+    static const int Buckets = 64;
+
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        uint64_t buckets[Buckets] = {};
+
+        double Mean() const {
+            return count ? (double) sum / count : 0;
+        }
+
+        // Estimated by interpolating within the bucket, p is in [0, 1]
+        double Percentile(double p) const;
+    };
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[Buckets];
+    };
+
+    Shard m_shards[MetricShards];
+
+public:
+    MetricHistogram();
+
+    // Bucket i holds the values in [2^i, 2^(i+1)), the first one also holds 0
+    static int GetBucket(uint64_t value) {
+        return value < 2 ? 0 : 63 - __builtin_clzll(value);
+    }
+
+    void Record(uint64_t value) {
+        auto &s = m_shards[GetMetricShard()];
+        s.buckets[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+        s.count.fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(value, std::memory_order_relaxed);
+
+        auto max = s.max.load(std::memory_order_relaxed);
+        while (value > max && !s.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    Snapshot GetSnapshot() const;
+};
+
+// Frames done by one video, or one chunk of it
+class Progress {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::string m_name;
+    uint64_t m_total;
+    std::atomic<uint64_t> m_done;
+    Clock::time_point m_start;
+
+public:
+    Progress(const std::string &name, uint64_t total)
+        : m_name(name), m_total(total), m_done(0), m_start(Clock::now()) {
+    }
+
+    void Add(uint64_t frames = 1) {
+        m_done.fetch_add(frames, std::memory_order_relaxed);
+    }
+
+    const std::string &Name() const {
+        return m_name;
+    }
+
+    uint64_t Total() const {
+        return m_total;
+    }
+
+    uint64_t Done() const {
+        return m_done.load(std::memory_order_relaxed);
+    }
+
+    double ElapsedSeconds() const {
+        return std::chrono::duration<double>(Clock::now() - m_start).count();
+    }
+
+    // Extrapolated from the rate so far, negative until the first frame is done
+    double EtaSeconds() const;
+};
+
+using ProgressPtr = std::shared_ptr<Progress>;
+
+// Process wide registry of the metrics. Metrics live until the process exits, so
+// callers look them up once and keep the reference, e.g. in a static variable.
+// Names of histograms end with their unit.
+class Metrics {
+public:
+    static MetricCounter &GetCounter(const std::string &name);
+    static MetricHistogram &GetHistogram(const std::string &name);
+
+    // Values computed when the metrics are written, e.g. the size of a cache.
+    // The callback must not outlive what it reads, capture weak pointers.
+    static void AddGauge(const std::string &name, std::function<double()> read);
+
+    // The progress is reported until the returned object is destroyed
+    static ProgressPtr StartProgress(const std::string &name, uint64_t total);
+    static std::vector<ProgressPtr> GetProgress();
+
+    static void WriteJson(std::ostream &os);
+
+    // Replaces the file at once, so that readers never see a partial file
+    static bool WriteJson(const std::string &path);
+};
+
+// Records spans of time in the Chrome trace event format, see chrome://tracing or ui.perfetto.dev.
+// Disabled by default, spans cost a clock read and a check of a flag until Start() is called.
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    static std::atomic_bool s_enabled;
+
+public:
+    static bool Enabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    static void Start();
+
+    static void AddSpan(const std::string &name, Clock::time_point begin, Clock::time_point end);
+
+    // Writes the spans of all threads recorded so far
+    static bool Write(const std::string &path);
+};
+
+// Adds the time spent in a scope to a histogram of nanoseconds, and to the trace if a span name is given
+class ScopedTimer {
+private:
+    MetricHistogram *m_histogram;
+    const char *m_span;
+    Tracer::Clock::time_point m_start;
+
+public:
+    ScopedTimer(MetricHistogram &histogram, const char *span = nullptr)
+        : m_histogram(&histogram), m_span(span), m_start(Tracer::Clock::now()) {
+    }
+
+    ~ScopedTimer() {
+        auto end = Tracer::Clock::now();
+        m_histogram->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count());
+        if (m_span && Tracer::Enabled()) {
+            Tracer::AddSpan(m_span, m_start, end);
+        }
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+};
+
+// A span of the trace that is not measured otherwise
+class TraceSpan {
+private:
+    const char *m_name;
+    Tracer::Clock::time_point m_start;
+    bool m_enabled;
+
+public:
+    TraceSpan(const char *name) : m_name(name), m_enabled(Tracer::Enabled()) {
+        if (m_enabled) {
+            m_start = Tracer::Clock::now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (m_enabled) {
+            Tracer::AddSpan(m_name, m_start, Tracer::Clock::now());
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+} // namespace gpsmap
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PREFETCHER_H
+
+#define PREFETCHER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "gpx.h"
+#include "tilemanager.h"
+
+namespace gpsmap {
+
+using TileDescs = std::vector<TileDesc>;
+
+class TilePrefetcher;
+using TilePrefetcherPtr = std::shared_ptr<TilePrefetcher>;
+
+// Fetches the tiles that a track will need on a pool of I/O threads,
+// so that map generators find them already loaded.
+class TilePrefetcher {
+private:
+    TileManagerPtr m_tiles;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<TileDesc> m_queue;
+    std::unordered_set<TileDesc> m_queued;
+    bool m_terminated;
+
+    // Workers that are fetching a batch, signaled by m_idle when all of them are done
+    int m_busy;
+    std::condition_variable m_idle;
+
+    std::vector<std::thread> m_workers;
+
+    std::atomic_uint m_fetched;
+    std::atomic_uint m_failed;
+
+    TilePrefetcher(TileManagerPtr tiles) : m_tiles(tiles), m_terminated(false), m_busy(0), m_fetched(0), m_failed(0) {
+    }
+
+    void Start(int threads);
+    void WorkerLoop();
+
+public:
+    ~TilePrefetcher();
+
+    static TilePrefetcherPtr Create(TileManagerPtr tiles, int threads);
+
+    // Returns the tiles needed to render items [first, last] of the given track
+    // at the given zoom levels, including the tiles within margin tiles of each tile.
+    // Maps use the 3x3 neighborhood, which is a margin of 1.
+    // Tiles are returned in the order in which the track will need them.
+    static TileDescs GetTrackTiles(const TileManager &tiles, const GPX &gpx, size_t first, size_t last,
+                                   const std::vector<int> &zooms, int margin = 1);
+
+    // Queues the given tiles for download. Tiles that were already queued are skipped.
+    void Enqueue(const TileDescs &tiles);
+
+    // Waits until every queued tile was fetched or failed. Returns false if the timeout expired first.
+    bool WaitUntilIdle(std::chrono::milliseconds timeout);
+
+    // Stops the worker threads, dropping tiles that are still in the queue.
+    void Stop();
+
+    unsigned Fetched() const {
+        return m_fetched;
+    }
+
+    unsigned Failed() const {
+        return m_failed;
+    }
+};
+
+} // namespace gpsmap
+
+#endif
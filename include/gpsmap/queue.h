@@ -0,0 +1,136 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef QUEUE_H
+
+#define QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace gpsmap {
+
+// Blocking FIFO with a fixed capacity, used to pass items between pipeline stages.
+// Keeps track of how long producers and consumers wait, in order to find bottlenecks.
+template <typename T> class BoundedQueue {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+
+    double m_pushStallSeconds;
+    double m_popStallSeconds;
+    uint64_t m_depthSum;
+    uint64_t m_depthSamples;
+
+    static double SecondsSince(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+public:
+    BoundedQueue(size_t capacity)
+        : m_capacity(capacity), m_closed(false), m_pushStallSeconds(0), m_popStallSeconds(0), m_depthSum(0),
+          m_depthSamples(0) {
+    }
+
+    // Waits until there is room for the item. Returns false if the queue was closed.
+    bool Push(T item) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (m_items.size() >= m_capacity && !m_closed) {
+            auto start = Clock::now();
+            m_notFull.wait(lock, [&] { return m_items.size() < m_capacity || m_closed; });
+            m_pushStallSeconds += SecondsSince(start);
+        }
+
+        if (m_closed) {
+            return false;
+        }
+
+        m_items.push_back(std::move(item));
+        m_depthSum += m_items.size();
+        ++m_depthSamples;
+        lock.unlock();
+
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Waits for an item. Returns false once the queue is closed and empty.
+    bool Pop(T &item) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (m_items.empty() && !m_closed) {
+            auto start = Clock::now();
+            m_notEmpty.wait(lock, [&] { return !m_items.empty() || m_closed; });
+            m_popStallSeconds += SecondsSince(start);
+        }
+
+        if (m_items.empty()) {
+            return false;
+        }
+
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        lock.unlock();
+
+        m_notFull.notify_one();
+        return true;
+    }
+
+    // Wakes up all waiters. Items already queued can still be popped.
+    void Close() {
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_closed = true;
+        }
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+    size_t Capacity() const {
+        return m_capacity;
+    }
+
+    double PushStallSeconds() const {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_pushStallSeconds;
+    }
+
+    double PopStallSeconds() const {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_popStallSeconds;
+    }
+
+    // Average number of queued items, sampled on every push
+    double AverageDepth() const {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_depthSamples ? (double) m_depthSum / m_depthSamples : 0;
+    }
+};
+
+} // namespace gpsmap
+
+#endif
@@ -26,8 +26,11 @@
 
 #include <boost/filesystem.hpp>
 #include <memory>
-#include <mutex>
 #include <string>
+#include <vector>
+
+#include "glyphatlas.h"
+#include "sprite.h"
 
 namespace gpsmap {
 
@@ -37,36 +40,39 @@ using ResourcesPtr = std::shared_ptr<Resources>;
 class Resources {
 private:
     const boost::filesystem::path m_dir;
-    OIIO::ImageBuf m_dot, m_startPin, m_finishPin, m_arrow;
+    Sprite m_dot, m_startPin, m_finishPin;
     boost::filesystem::path m_map;
     boost::filesystem::path m_font;
-    std::mutex m_lock;
+    GlyphAtlasPtr m_labelFont;
 
-    std::unordered_map<int, OIIO::ImageBuf> m_arrows;
+    // The arrow rotated by 360 / size degrees steps, read-only once loaded
+    std::vector<Sprite> m_arrows;
 
     Resources(const boost::filesystem::path &dir) : m_dir(dir) {
     }
 
-    bool Load();
+    bool Load(int arrowAngles);
+    bool LoadArrows(const OIIO::ImageBuf &arrow, int count);
 
 public:
-    static ResourcesPtr Create(const boost::filesystem::path &dir) {
+    // arrowAngles is the number of rotations of the arrow, which are all computed upfront
+    static ResourcesPtr Create(const boost::filesystem::path &dir, int arrowAngles = 360) {
         auto ret = ResourcesPtr(new Resources(dir));
-        if (ret->Load()) {
+        if (ret->Load(arrowAngles)) {
             return ret;
         }
         return nullptr;
     }
 
-    const OIIO::ImageBuf &Dot() const {
+    const Sprite &Dot() const {
         return m_dot;
     }
 
-    const OIIO::ImageBuf &Start() const {
+    const Sprite &Start() const {
         return m_startPin;
     }
 
-    const OIIO::ImageBuf &Finish() const {
+    const Sprite &Finish() const {
         return m_finishPin;
     }
 
@@ -78,7 +84,13 @@ public:
         return m_font;
     }
 
-    const OIIO::ImageBuf &GetArrow(int angle);
+    // Glyphs for the labels drawn over the map
+    const GlyphAtlas &GetLabelFont() const {
+        return *m_labelFont;
+    }
+
+    // Angle in degrees, may be negative
+    const Sprite &GetArrow(int angle) const;
 };
 
 } // namespace gpsmap
@@ -0,0 +1,92 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SCHEDULER_H
+
+#define SCHEDULER_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "encoder.h"
+
+namespace gpsmap {
+
+class SegmentScheduler;
+using SegmentSchedulerPtr = std::shared_ptr<SegmentScheduler>;
+
+// Encodes segments on a fixed number of workers, longest segments first, so that
+// a long segment does not start last and keep a single core busy at the end.
+// Workers that run out of segments help render the frames of the segments that
+// are still being encoded.
+class SegmentScheduler {
+public:
+    using JobFunction = std::function<void()>;
+
+private:
+    struct Job {
+        // Estimated cost, e.g., the duration of the segment
+        double cost;
+        JobFunction run;
+    };
+
+    struct Running {
+        VideoEncoderPtr encoder;
+        // Set once a worker tried to help, there is nothing left to do for the others
+        bool exhausted = false;
+    };
+
+    int m_workers;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::vector<Job> m_jobs;
+    std::vector<Running> m_running;
+    int m_activeJobs;
+
+    SegmentScheduler(int workers) : m_workers(workers), m_activeJobs(0) {
+    }
+
+    void WorkerLoop();
+
+public:
+    static SegmentSchedulerPtr Create(int workers) {
+        return SegmentSchedulerPtr(new SegmentScheduler(std::max(1, workers)));
+    }
+
+    // Queues a job. Must be called before Run().
+    void Submit(double cost, JobFunction job);
+
+    // Runs the jobs and returns when all of them are done
+    void Run();
+
+    // Lets idle workers render frames of the given encoder, until RemoveEncoder() is called.
+    // The encoder must be created with Params::maxHelpers > 0.
+    void AddEncoder(VideoEncoderPtr encoder);
+    void RemoveEncoder(VideoEncoderPtr encoder);
+};
+
+} // namespace gpsmap
+
+#endif
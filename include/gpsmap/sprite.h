@@ -0,0 +1,61 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SPRITE_H
+
+#define SPRITE_H
+
+#include <OpenImageIO/imagebuf.h>
+
+#include <stdint.h>
+#include <vector>
+
+namespace gpsmap {
+
+// A small image drawn over frames, stored as 8 bits RGBA with premultiplied alpha.
+// Blitting composites it directly into the frame, without the temporary
+// buffers that ImageBufAlgo::over needs.
+class Sprite {
+private:
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<uint8_t> m_pixels;
+
+public:
+    // Converts img, whose alpha must be premultiplied, as OIIO does when reading files.
+    // Images without alpha become opaque.
+    bool Load(const OIIO::ImageBuf &img);
+
+    int Width() const {
+        return m_width;
+    }
+
+    int Height() const {
+        return m_height;
+    }
+
+    // Composites the sprite over dest with its top left corner at (x, y), clipped to dest.
+    // dest must be an 8 bits RGBA image held in memory, such as the frames of the encoder.
+    bool Blit(OIIO::ImageBuf &dest, int x, int y) const;
+};
+
+} // namespace gpsmap
+
+#endif
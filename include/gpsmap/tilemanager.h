@@ -22,6 +22,9 @@
 
 #define TILEMANAGER_H
 
+#include <atomic>
+#include <condition_variable>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -31,6 +34,9 @@
 #include <OpenImageIO/imagebufalgo.h>
 #include <OpenImageIO/imageio.h>
 
+#include "downloader.h"
+#include "tilestore.h"
+
 namespace gpsmap {
 
 class TileManager;
@@ -39,42 +45,14 @@ using TileManagerPtr = std::shared_ptr<TileManager>;
 class Tile;
 using TilePtr = std::shared_ptr<Tile>;
 
-struct TileDesc {
-    int x, y, z;
-    TileDesc() : x(0), y(0), z(0) {
-    }
-    TileDesc(int _x, int _y, int _z) : x(_x), y(_y), z(_z) {
-    }
-
-    bool operator==(const TileDesc &o) const {
-        return x == o.x && y == o.y && z == o.z;
-    }
-};
-
-} // namespace gpsmap
-
-namespace std {
-
-template <> struct hash<gpsmap::TileDesc> {
-    std::size_t operator()(const gpsmap::TileDesc &k) const {
-        using std::hash;
-        using std::size_t;
-        using std::string;
-
-        return ((hash<int>()(k.x) ^ (hash<int>()(k.y) << 1)) >> 1) ^ (hash<int>()(k.z) << 1);
-    }
-};
-
-} // namespace std
-
-namespace gpsmap {
-
 class Tile {
 public:
-    enum State { LOADING, LOADED, FAILED };
+    // DOWNLOADED means that the file is available but not decoded yet.
+    // The first thread that needs the image decodes it.
+    enum State { LOADING, DOWNLOADED, LOADED, FAILED };
 
 private:
-    std::string m_filePath;
+    TileData m_data;
     TileDesc m_desc;
 
     OIIO::ImageBuf m_image;
@@ -83,9 +61,11 @@ private:
     std::condition_variable m_cv;
     State m_state;
 
-    Tile(const std::string &filePath, const TileDesc &desc);
+    Tile(const TileData &data, const TileDesc &desc);
     Tile(const TileDesc &desc);
 
+    void Decode();
+
 public:
     OIIO::ImageBuf &GetImage() {
         return m_image;
@@ -95,16 +75,27 @@ public:
         return m_desc;
     }
 
-    static TilePtr Create(const std::string &filePath, const TileDesc &desc);
+    static TilePtr Create(const TileData &data, const TileDesc &desc);
     static TilePtr Create(const TileDesc &desc);
-    void Load(const std::string &filePath);
+    void SetDownloaded(const TileData &data);
     void Fail();
     bool Failed() {
         return m_state == FAILED;
     }
 
-    const std::string &FilePath() const {
-        return m_filePath;
+    bool Loaded() {
+        return m_state == LOADED;
+    }
+
+    bool Loading() {
+        return m_state == LOADING;
+    }
+
+    // Frees the decoded image. The tile is decoded again from its data the next time it is needed.
+    void Unload();
+
+    const TileData &Data() const {
+        return m_data;
     }
 
     bool WaitUntilDownloaded();
@@ -112,19 +103,46 @@ public:
 
 using Tiles = std::unordered_map<TileDesc, TilePtr>;
 
+struct TileCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t residentTiles;
+    size_t residentBytes;
+};
+
 class TileManager {
 private:
-    std::mutex m_lock;
-    std::string m_tilesRootPath;
+    mutable std::mutex m_lock;
+    ITileStorePtr m_store;
     std::string m_mapUrl;
     Tiles m_tiles;
+    DownloaderPtr m_downloader;
+
+    // Decoded tiles, most recently used first. Protected by m_lock.
+    using LRUList = std::list<TileDesc>;
+    LRUList m_lru;
+    std::unordered_map<TileDesc, std::pair<LRUList::iterator, size_t>> m_resident;
+    size_t m_residentBytes = 0;
+    size_t m_cacheBudget = 0;
+
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+    std::atomic<uint64_t> m_evictions{0};
 
     int m_tileWidth;
     int m_tileHeight;
 
-    TileManager(const std::string &tilesRootPath, const std::string &mapUrl) {
-        m_tilesRootPath = tilesRootPath;
+    // How many zoom levels below a missing tile to look for tiles to build it from
+    int m_synthesisLevels = 0;
+
+    // Tiles that could not be built, with the most levels that were tried. Protected by m_lock.
+    mutable std::unordered_map<TileDesc, int> m_unbuildable;
+
+    TileManager(ITileStorePtr store, const std::string &mapUrl, DownloaderPtr downloader) {
+        m_store = store;
         m_mapUrl = mapUrl;
+        m_downloader = downloader;
 
         // TODO: auto-detect sizes
         m_tileWidth = 512;
@@ -133,13 +151,57 @@ private:
 
     bool DownloadTile(TilePtr &tile) const;
 
+    bool IsLoading(const TileDesc &desc) const;
+    bool CanSynthesize(const TileDesc &desc, int levels) const;
+    bool SynthesizeTile(const TileDesc &desc, int levels, TileData &data) const;
+
     TilePtr GetTileFast(int x, int y, int zoom);
 
+    void Touch(const TilePtr &tile);
+    void Evict();
+
 public:
+    // Starts loading the given tile if needed and returns without waiting for it
+    TilePtr RequestTile(int x, int y, int zoom);
+
+    // Waits until a tile returned by RequestTile is decoded
+    bool WaitForTile(const TilePtr &tile);
+
     TilePtr GetTile(int x, int y, int zoom);
     TilePtr GetTile(double lat, double lon, int &xt, int &yt, int zoom);
     void GetTileCoords(double lat, double lon, int zoom, int &xt, int &yt, int &px, int &py) const;
-    static TileManagerPtr Create(const std::string &tilesRootPath, const std::string &mapDescPath);
+
+    // Same as above, from projected coordinates (see to_mercator_x/y)
+    TilePtr GetTileMercator(double mx, double my, int &xt, int &yt, int zoom);
+    void GetTileCoordsMercator(double mx, double my, int zoom, int &xt, int &yt, int &px, int &py) const;
+
+    int TileWidth() const {
+        return m_tileWidth;
+    }
+
+    int TileHeight() const {
+        return m_tileHeight;
+    }
+
+    // Limits the memory used by decoded tiles. Least recently used tiles are
+    // unloaded when the budget is exceeded, except those that are still referenced
+    // outside of the tile manager. A budget of 0 means no limit.
+    void SetCacheBudget(size_t bytes) {
+        m_cacheBudget = bytes;
+    }
+
+    TileCacheStats GetCacheStats();
+
+    // Lets tiles that the store does not have be built from the four tiles of the next zoom
+    // level, which may themselves be built from the next level, up to the given number of levels.
+    // Tiles are only downloaded when some of the tiles they would be built from are missing.
+    // Built tiles are added to the store. 0 disables building tiles.
+    void SetSynthesisLevels(int levels) {
+        m_synthesisLevels = levels;
+    }
+
+    // Only the tiles of the store are available when downloader is null
+    static TileManagerPtr Create(ITileStorePtr store, const std::string &mapDescPath, DownloaderPtr downloader);
 };
 
 } // namespace gpsmap
@@ -0,0 +1,176 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TILESTORE_H
+
+#define TILESTORE_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "mappedfile.h"
+
+namespace gpsmap {
+
+struct TileDesc {
+    int x, y, z;
+    TileDesc() : x(0), y(0), z(0) {
+    }
+    TileDesc(int _x, int _y, int _z) : x(_x), y(_y), z(_z) {
+    }
+
+    bool operator==(const TileDesc &o) const {
+        return x == o.x && y == o.y && z == o.z;
+    }
+};
+
+} // namespace gpsmap
+
+namespace std {
+
+template <> struct hash<gpsmap::TileDesc> {
+    std::size_t operator()(const gpsmap::TileDesc &k) const {
+        using std::hash;
+        using std::size_t;
+        using std::string;
+
+        return ((hash<int>()(k.x) ^ (hash<int>()(k.y) << 1)) >> 1) ^ (hash<int>()(k.z) << 1);
+    }
+};
+
+} // namespace std
+
+namespace gpsmap {
+
+// Encoded image of a tile. Either a file, or a slice of a mapped file when mapping is set.
+// The name tells the decoder the format of the image in both cases.
+struct TileData {
+    std::string path;
+
+    MappedFilePtr mapping;
+    const char *data = nullptr;
+    size_t size = 0;
+};
+
+class ITileStore;
+using ITileStorePtr = std::shared_ptr<ITileStore>;
+
+// Keeps the downloaded tiles between runs. Must be thread-safe.
+class ITileStore {
+public:
+    virtual ~ITileStore() {
+    }
+
+    // Returns false if the store does not have the tile
+    virtual bool Find(const TileDesc &desc, TileData &data) = 0;
+
+    // Where to download the tile before adding it to the store
+    virtual std::string GetDownloadPath(const TileDesc &desc) = 0;
+
+    // Adds the tile that was downloaded to GetDownloadPath(desc)
+    virtual bool Add(const TileDesc &desc, TileData &data) = 0;
+
+    // Adds a copy of the image in the given file, or replaces the tile if the store already has it
+    virtual bool Import(const TileDesc &desc, const std::string &path) = 0;
+
+    // Imports the tiles of a directory tree laid out as z/x/y.png that the store does not have yet.
+    // Returns the number of imported tiles, or -1 on error.
+    static int ImportDirectory(ITileStore &store, const std::string &rootPath);
+
+    // Names of the stores that Create() accepts
+    static const char *const Types[];
+
+    // Read-only stores never write to rootPath, adding tiles to them fails
+    static ITileStorePtr Create(const std::string &type, const std::string &rootPath, bool readOnly = false);
+};
+
+// One file per tile, in rootPath/z/x/y.png. This is the layout of most tile caches.
+class DirTileStore : public ITileStore {
+private:
+    std::string m_rootPath;
+    bool m_readOnly;
+
+    DirTileStore(const std::string &rootPath, bool readOnly) : m_rootPath(rootPath), m_readOnly(readOnly) {
+    }
+
+    std::string GetPath(const TileDesc &desc) const;
+
+public:
+    static ITileStorePtr Create(const std::string &rootPath, bool readOnly = false);
+
+    bool Find(const TileDesc &desc, TileData &data);
+    std::string GetDownloadPath(const TileDesc &desc);
+    bool Add(const TileDesc &desc, TileData &data);
+    bool Import(const TileDesc &desc, const std::string &path);
+};
+
+// All the tiles in one file that is only appended to, plus an index of where each tile is.
+// The index is loaded in memory and the pack is mapped, so finding a tile does no I/O and
+// tiles are decoded straight from the mapping. Tiles that other processes appended are
+// picked up from the index when a tile is not found.
+class PackTileStore : public ITileStore {
+private:
+    std::string m_packPath;
+    std::string m_indexPath;
+    std::string m_incomingPath;
+    bool m_readOnly;
+
+    // Protects everything below
+    std::mutex m_lock;
+    int m_packFd;
+    int m_indexFd;
+
+    struct Location {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    std::unordered_map<TileDesc, Location> m_index;
+    // Bytes of the index file that were loaded in m_index
+    uint64_t m_indexEnd;
+
+    // Reserves room for the tiles that are added later, so that the pack is only mapped again
+    // when it grew past the reservation. Tiles that are in use keep previous mappings alive.
+    MappedFilePtr m_mapping;
+
+    PackTileStore(const std::string &rootPath, bool readOnly);
+
+    bool Open();
+    bool LoadIndex();
+    bool ReadNewEntries(bool locked);
+    bool Append(const TileDesc &desc, const std::string &path);
+    bool GetData(const TileDesc &desc, const Location &location, TileData &data);
+
+public:
+    ~PackTileStore();
+
+    static ITileStorePtr Create(const std::string &rootPath, bool readOnly = false);
+
+    bool Find(const TileDesc &desc, TileData &data);
+    std::string GetDownloadPath(const TileDesc &desc);
+    bool Add(const TileDesc &desc, TileData &data);
+    bool Import(const TileDesc &desc, const std::string &path);
+};
+
+} // namespace gpsmap
+
+#endif
@@ -0,0 +1,82 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRACKINDEX_H
+
+#define TRACKINDEX_H
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "gpx.h"
+#include "tilemanager.h"
+
+namespace gpsmap {
+
+class TrackIndex;
+using TrackIndexPtr = std::shared_ptr<TrackIndex>;
+
+// Buckets the segments of a track by the map tiles they cross, so that drawing the track
+// on a group of tiles only touches the segments that are visible there.
+// Segment i goes from track item i - 1 to track item i.
+class TrackIndex {
+public:
+    struct Point {
+        // Pixel coordinates on the whole map at the level's zoom
+        int x, y;
+    };
+
+    struct Level {
+        int zoom;
+        std::vector<Point> points;
+        std::unordered_map<TileDesc, std::vector<uint32_t>> tiles;
+    };
+
+    using LevelPtr = std::shared_ptr<const Level>;
+
+private:
+    GPXPtr m_gpx;
+    TileManagerPtr m_tiles;
+
+    std::mutex m_lock;
+    std::unordered_map<int, LevelPtr> m_levels;
+
+    TrackIndex(GPXPtr gpx, TileManagerPtr tiles) : m_gpx(gpx), m_tiles(tiles) {
+    }
+
+    LevelPtr Build(int zoom) const;
+
+public:
+    static TrackIndexPtr Create(GPXPtr gpx, TileManagerPtr tiles) {
+        return TrackIndexPtr(new TrackIndex(gpx, tiles));
+    }
+
+    // Returns the index for the given zoom level, building it on first use
+    LevelPtr GetLevel(int zoom);
+
+    // Returns the sorted list of segments that cross the tiles [x0, x1] x [y0, y1]
+    static std::vector<uint32_t> GetSegments(const Level &level, int x0, int y0, int x1, int y1);
+};
+
+} // namespace gpsmap
+
+#endif
@@ -0,0 +1,46 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRACKMATH_H
+
+#define TRACKMATH_H
+
+#include <stddef.h>
+
+namespace gpsmap {
+
+// Batched track derivation over arrays of coordinates (in degrees).
+// The loops are written so that the compiler vectorizes them: trigonometry goes
+// through inline polynomial approximations instead of libm calls, which would
+// keep every iteration scalar. Results agree with libm to within a few ulp.
+
+// distances[i] is the distance in meters between points i - 1 and i. distances[0] is 0.
+void ComputeDistances(const double *lat, const double *lon, size_t count, double *distances);
+
+// bearings[i] is the bearing in degrees from point i to point i + 1, for i < count - 1.
+void ComputeBearings(const double *lat, const double *lon, size_t count, double *bearings);
+
+// grades[i] is the slope in percent around point i, measured over about 50 meters on each side.
+// distanceDeltas[i] is the distance between points i - 1 and i.
+void ComputeGrades(const double *distanceDeltas, const double *elevations, size_t count, double *grades);
+
+} // namespace gpsmap
+
+#endif
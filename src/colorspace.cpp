@@ -0,0 +1,141 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define COLORSPACE_HAVE_AVX2
+#endif
+
+#include <gpsmap/colorspace.h>
+
+// The loops are inlined into the kernel of each instruction set, which vectorizes them for it
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+namespace gpsmap {
+
+// Coefficients scaled by 2^16
+static const int32_t s_yr = 16829, s_yg = 33039, s_yb = 6416;
+static const int32_t s_ur = -9713, s_ug = -19071, s_ub = 28784;
+static const int32_t s_vr = 28784, s_vg = -24103, s_vb = -4681;
+
+KERNEL_INLINE void ConvertLumaRow(const uint8_t *__restrict rgba, uint8_t *__restrict y, int width) {
+    for (int x = 0; x < width; ++x) {
+        int32_t r = rgba[x * 4 + 0];
+        int32_t g = rgba[x * 4 + 1];
+        int32_t b = rgba[x * 4 + 2];
+        y[x] = (uint8_t) ((s_yr * r + s_yg * g + s_yb * b + (16 << 16) + (1 << 15)) >> 16);
+    }
+}
+
+// Converts the 2x2 blocks of rows rgba0 and rgba1. UVStep is 1 for planar chroma and 2 for interleaved chroma.
+template <int UVStep>
+KERNEL_INLINE void ConvertChromaRow(const uint8_t *__restrict rgba0, const uint8_t *__restrict rgba1,
+                                   uint8_t *__restrict u, uint8_t *__restrict v, int width) {
+    auto pairs = width / 2;
+    for (int x = 0; x < pairs; ++x) {
+        auto p0 = rgba0 + x * 8;
+        auto p1 = rgba1 + x * 8;
+
+        // Sums of 4 pixels, so the results are scaled by 2^18
+        int32_t r = p0[0] + p0[4] + p1[0] + p1[4];
+        int32_t g = p0[1] + p0[5] + p1[1] + p1[5];
+        int32_t b = p0[2] + p0[6] + p1[2] + p1[6];
+        u[x * UVStep] = (uint8_t) ((s_ur * r + s_ug * g + s_ub * b + (128 << 18) + (1 << 17)) >> 18);
+        v[x * UVStep] = (uint8_t) ((s_vr * r + s_vg * g + s_vb * b + (128 << 18) + (1 << 17)) >> 18);
+    }
+
+    if (width & 1) {
+        // Last column of an odd width, averaged over 2 pixels
+        auto p0 = rgba0 + pairs * 8;
+        auto p1 = rgba1 + pairs * 8;
+        int32_t r = p0[0] + p1[0];
+        int32_t g = p0[1] + p1[1];
+        int32_t b = p0[2] + p1[2];
+        u[pairs * UVStep] = (uint8_t) ((s_ur * r + s_ug * g + s_ub * b + (128 << 17) + (1 << 16)) >> 17);
+        v[pairs * UVStep] = (uint8_t) ((s_vr * r + s_vg * g + s_vb * b + (128 << 17) + (1 << 16)) >> 17);
+    }
+}
+
+// Converts a pair of rows. For the last row of an odd height, src1 is src0 and y1 is null.
+template <int UVStep>
+KERNEL_INLINE void ConvertRowPairInline(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                       uint8_t *u, uint8_t *v, int width) {
+    ConvertLumaRow(src0, y0, width);
+    if (y1) {
+        ConvertLumaRow(src1, y1, width);
+    }
+    ConvertChromaRow<UVStep>(src0, src1, u, v, width);
+}
+
+using ConvertRowPairFn = void (*)(const uint8_t *, const uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *, int);
+
+// The same loops for the baseline instruction set and for AVX2
+template <int UVStep>
+static void ConvertRowPair(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                           int width) {
+    ConvertRowPairInline<UVStep>(src0, src1, y0, y1, u, v, width);
+}
+
+#if defined(COLORSPACE_HAVE_AVX2)
+template <int UVStep>
+__attribute__((target("avx2"))) static void ConvertRowPairAVX2(const uint8_t *src0, const uint8_t *src1,
+                                                                uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                                                                int width) {
+    ConvertRowPairInline<UVStep>(src0, src1, y0, y1, u, v, width);
+}
+#endif
+
+template <int UVStep> static ConvertRowPairFn SelectConvertRowPair() {
+#if defined(COLORSPACE_HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return ConvertRowPairAVX2<UVStep>;
+    }
+#endif
+    return ConvertRowPair<UVStep>;
+}
+
+static const ConvertRowPairFn s_convertPlanar = SelectConvertRowPair<1>();
+static const ConvertRowPairFn s_convertInterleaved = SelectConvertRowPair<2>();
+
+static void Convert(ConvertRowPairFn convert, const uint8_t *rgba, int rgbaStride, uint8_t *y, int yStride,
+                    uint8_t *u, int uStride, uint8_t *v, int vStride, int width, int height) {
+    for (int row = 0; row < height; row += 2) {
+        auto src0 = rgba + row * rgbaStride;
+
+        // The last row of an odd height is its own pair
+        bool pair = row + 1 < height;
+        auto src1 = pair ? src0 + rgbaStride : src0;
+        auto y1 = pair ? y + (row + 1) * yStride : nullptr;
+
+        auto chromaRow = row / 2;
+        convert(src0, src1, y + row * yStride, y1, u + chromaRow * uStride, v + chromaRow * vStride, width);
+    }
+}
+
+void ConvertRGBAToI420(const uint8_t *rgba, int rgbaStride, uint8_t *y, int yStride, uint8_t *u, int uStride,
+                       uint8_t *v, int vStride, int width, int height) {
+    Convert(s_convertPlanar, rgba, rgbaStride, y, yStride, u, uStride, v, vStride, width, height);
+}
+
+void ConvertRGBAToNV12(const uint8_t *rgba, int rgbaStride, uint8_t *y, int yStride, uint8_t *uv, int uvStride,
+                       int width, int height) {
+    Convert(s_convertInterleaved, rgba, rgbaStride, y, yStride, uv, uvStride, uv + 1, uvStride, width, height);
+}
+
+} // namespace gpsmap
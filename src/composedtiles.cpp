@@ -0,0 +1,162 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <iostream>
+
+#include <OpenImageIO/imagebufalgo.h>
+
+#include <gpsmap/composedtiles.h>
+#include <gpsmap/metrics.h>
+
+OIIO_NAMESPACE_USING
+
+namespace gpsmap {
+
+ComposedTilePtr ComposedTileCache::GetTile(int x, int y, int zoom) {
+    auto desc = TileDesc(x, y, zoom);
+    EntryPtr entry;
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        auto &e = m_entries[desc];
+        if (!e) {
+            e = std::make_shared<Entry>();
+        }
+        entry = e;
+
+        auto it = m_resident.find(desc);
+        if (it != m_resident.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            ++m_hits;
+            return entry->tile;
+        }
+    }
+
+    ++m_misses;
+
+    ComposedTilePtr ret;
+    {
+        std::unique_lock<std::mutex> lock(entry->lock);
+        if (!entry->tile && !entry->failed) {
+            entry->tile = Compose(desc);
+            entry->failed = !entry->tile;
+        }
+        ret = entry->tile;
+    }
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_entries.find(desc);
+    if (it == m_entries.end() || it->second != entry) {
+        // Another thread already dropped the entry
+        return ret;
+    }
+
+    if (!ret) {
+        // Try again next time, the tile may become available later
+        m_entries.erase(it);
+        return nullptr;
+    }
+
+    if (m_resident.find(desc) == m_resident.end()) {
+        m_lru.push_front(desc);
+        m_resident[desc] = m_lru.begin();
+        m_residentBytes += ret->GetImage().spec().image_bytes();
+        Evict();
+    }
+
+    return ret;
+}
+
+ComposedTilePtr ComposedTileCache::Compose(const TileDesc &desc) {
+    static auto &composeTime = Metrics::GetHistogram("map.compose_tile_ns");
+    ScopedTimer timer(composeTime, "compose tile");
+
+    auto tile = m_tiles->GetTile(desc.x, desc.y, desc.z);
+    if (!tile) {
+        std::cerr << "Could not get tile x=" << desc.x << " y=" << desc.y << "\n";
+        return nullptr;
+    }
+
+    const auto &img = tile->GetImage();
+    auto tw = m_tiles->TileWidth();
+    auto th = m_tiles->TileHeight();
+    auto ret = std::shared_ptr<ComposedTile>(new ComposedTile(desc, tw, th));
+
+    if (!ImageBufAlgo::paste(ret->m_image, 0, 0, 0, 0, img, {}, 1)) {
+        std::cerr << "Could not copy image" << std::endl;
+        return nullptr;
+    }
+
+    // Lines are clipped to the tile, so segments that cross several tiles
+    // are drawn on each of them with the same pixels as on the whole map
+    auto level = m_trackIndex->GetLevel(desc.z);
+    auto ox = desc.x * tw;
+    auto oy = desc.y * th;
+
+    for (auto i : TrackIndex::GetSegments(*level, desc.x, desc.y, desc.x, desc.y)) {
+        const auto &p0 = level->points[i - 1];
+        const auto &p1 = level->points[i];
+        auto prevx = p0.x - ox;
+        auto prevy = p0.y - oy;
+        auto x = p1.x - ox;
+        auto y = p1.y - oy;
+        ImageBufAlgo::render_line(ret->m_image, prevx, prevy, x, y, {0.0f, 0.0f, 1.0f}, false, {}, 1);
+        ImageBufAlgo::render_line(ret->m_image, prevx, prevy, x + 1, y, {0.0f, 0.0f, 1.0f}, false, {}, 1);
+    }
+
+    return ret;
+}
+
+// Must be called with m_lock held
+void ComposedTileCache::Evict() {
+    if (!m_cacheBudget) {
+        return;
+    }
+
+    auto it = m_lru.end();
+    while (m_residentBytes > m_cacheBudget && it != m_lru.begin()) {
+        --it;
+
+        // Composed tiles are only handed out while m_lock is held, so a tile
+        // that only its entry references is not used by any generator.
+        auto eit = m_entries.find(*it);
+        if (eit->second->tile.use_count() > 1) {
+            continue;
+        }
+
+        m_residentBytes -= eit->second->tile->GetImage().spec().image_bytes();
+        m_entries.erase(eit);
+        m_resident.erase(*it);
+        it = m_lru.erase(it);
+        ++m_evictions;
+    }
+}
+
+TileCacheStats ComposedTileCache::GetCacheStats() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    TileCacheStats ret;
+    ret.hits = m_hits;
+    ret.misses = m_misses;
+    ret.evictions = m_evictions;
+    ret.residentTiles = m_resident.size();
+    ret.residentBytes = m_residentBytes;
+    return ret;
+}
+
+} // namespace gpsmap
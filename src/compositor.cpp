@@ -0,0 +1,192 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#include <gpsmap/compositor.h>
+
+OIIO_NAMESPACE_USING
+
+namespace gpsmap {
+
+static bool IsEmpty(const ROI &r) {
+    return r.xbegin >= r.xend || r.ybegin >= r.yend;
+}
+
+static ROI Empty() {
+    return ROI(0, 0, 0, 0);
+}
+
+static ROI Union(const ROI &a, const ROI &b) {
+    if (IsEmpty(a)) {
+        return b;
+    }
+    if (IsEmpty(b)) {
+        return a;
+    }
+    return ROI(std::min(a.xbegin, b.xbegin), std::max(a.xend, b.xend), std::min(a.ybegin, b.ybegin),
+               std::max(a.yend, b.yend));
+}
+
+static bool Intersects(const ROI &a, const ROI &b) {
+    return !IsEmpty(a) && !IsEmpty(b) && a.xbegin < b.xend && b.xbegin < a.xend && a.ybegin < b.yend &&
+           b.ybegin < a.yend;
+}
+
+static bool Contains(const ROI &outer, const ROI &inner) {
+    return outer.xbegin <= inner.xbegin && inner.xend <= outer.xend && outer.ybegin <= inner.ybegin &&
+           inner.yend <= outer.yend;
+}
+
+static ROI Intersection(const ROI &a, const ROI &b) {
+    return ROI(std::max(a.xbegin, b.xbegin), std::min(a.xend, b.xend), std::max(a.ybegin, b.ybegin),
+               std::min(a.yend, b.yend));
+}
+
+// Both images have the spec of the canvas
+static void CopyArea(const ImageBuf &src, ImageBuf &dst, const ROI &area) {
+    auto r = Intersection(area, dst.roi());
+    if (IsEmpty(r)) {
+        return;
+    }
+
+    auto rowBytes = (r.xend - r.xbegin) * 4;
+    for (auto y = r.ybegin; y < r.yend; ++y) {
+        memcpy(dst.pixeladdr(r.xbegin, y), src.pixeladdr(r.xbegin, y), rowBytes);
+    }
+}
+
+void Compositor::GetKeys(LayerKeys &keys) const {
+    keys.resize(m_layers.size());
+    for (size_t i = 0; i < m_layers.size(); ++i) {
+        keys[i].key = FrameKey();
+        keys[i].valid = m_layers[i].generator->GetStateKey(keys[i].key);
+    }
+}
+
+ROI Compositor::GetDamage(const LayerKeys &a, const LayerKeys &b) const {
+    const auto &spec = m_canvas.spec();
+    if (a.size() != m_layers.size() || b.size() != m_layers.size()) {
+        return spec.roi();
+    }
+
+    // A layer can only change pixels within its own bounds
+    auto damage = Empty();
+    for (size_t i = 0; i < m_layers.size(); ++i) {
+        if (!a[i].valid || !b[i].valid || !(a[i].key == b[i].key)) {
+            damage = Union(damage, m_layers[i].generator->GetBounds(spec));
+        }
+    }
+
+    return damage;
+}
+
+// Draws the given area of a layer whose other pixels are already on the canvas
+bool Compositor::DrawPart(Layer &layer, const LayerKey &key, const ROI &bounds, const ROI &area, int frameIndex,
+                          int fps) {
+    const auto &spec = m_canvas.spec();
+    if (layer.buffer.spec().width != spec.width || layer.buffer.spec().height != spec.height) {
+        layer.buffer.reset(spec);
+        layer.bufferKey = LayerKey();
+    }
+
+    if (layer.generator->IsOpaque(spec)) {
+        // What is below does not show through, the last drawing is still valid if the state is the same
+        if (!key.valid || !layer.bufferKey.valid || !(key.key == layer.bufferKey.key)) {
+            layer.bufferKey = LayerKey();
+            if (!layer.generator->Generate(layer.buffer, frameIndex, fps)) {
+                return false;
+            }
+            layer.bufferKey = key;
+        }
+    } else {
+        // The layer blends with what is below, which is only up to date inside the area
+        CopyArea(m_canvas, layer.buffer, bounds);
+        if (!layer.generator->Generate(layer.buffer, frameIndex, fps)) {
+            return false;
+        }
+    }
+
+    CopyArea(layer.buffer, m_canvas, area);
+    return true;
+}
+
+bool Compositor::Compose(int frameIndex, int fps, const LayerKeys &keys) {
+    const auto &spec = m_canvas.spec();
+    auto damage = m_canvasValid ? GetDamage(m_canvasKeys, keys) : spec.roi();
+    if (IsEmpty(damage)) {
+        return true;
+    }
+
+    std::vector<ROI> bounds;
+    for (const auto &layer : m_layers) {
+        bounds.push_back(layer.generator->GetBounds(spec));
+    }
+
+    // Nothing below the topmost opaque layer that covers the damage needs to be drawn
+    size_t first = 0;
+    bool clear = true;
+    for (size_t i = m_layers.size(); i-- > 0;) {
+        if (m_layers[i].generator->IsOpaque(spec) && Contains(bounds[i], damage)) {
+            first = i;
+            clear = false;
+            break;
+        }
+    }
+
+    m_canvasValid = false;
+
+    if (clear) {
+        auto x0 = std::max(damage.xbegin, 0);
+        auto x1 = std::min(damage.xend, spec.width);
+        for (auto y = std::max(damage.ybegin, 0); y < std::min(damage.yend, spec.height); ++y) {
+            auto *row = (uint32_t *) m_canvas.pixeladdr(x0, y);
+            std::fill(row, row + (x1 - x0), 0xff000000);
+        }
+    }
+
+    for (size_t i = first; i < m_layers.size(); ++i) {
+        if (!Intersects(bounds[i], damage)) {
+            continue;
+        }
+
+        ScopedTimer timer(*m_layers[i].drawTime, m_layers[i].name.c_str());
+        bool ok;
+        if (Contains(damage, bounds[i])) {
+            ok = m_layers[i].generator->Generate(m_canvas, frameIndex, fps);
+        } else {
+            auto key = i < keys.size() ? keys[i] : LayerKey();
+            ok = DrawPart(m_layers[i], key, bounds[i], Intersection(bounds[i], damage), frameIndex, fps);
+        }
+
+        if (!ok) {
+            std::cerr << "Could not draw layer " << m_layers[i].name << std::endl;
+            return false;
+        }
+    }
+
+    m_canvasKeys = keys;
+    m_canvasValid = true;
+    return true;
+}
+
+} // namespace gpsmap
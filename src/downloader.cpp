@@ -0,0 +1,306 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <future>
+#include <iostream>
+
+#include <gpsmap/downloader.h>
+#include <gpsmap/metrics.h>
+
+namespace gpsmap {
+
+static std::once_flag s_curlInit;
+
+Downloader::Downloader(const Params &params)
+    : m_params(params), m_multi(nullptr), m_share(nullptr), m_terminated(false) {
+}
+
+DownloaderPtr Downloader::Create(const Params &params) {
+    std::call_once(s_curlInit, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    auto ret = DownloaderPtr(new Downloader(params));
+    if (!ret->Initialize()) {
+        return nullptr;
+    }
+    return ret;
+}
+
+bool Downloader::Initialize() {
+    m_multi = curl_multi_init();
+    if (!m_multi) {
+        std::cerr << "Could not init curl multi handle" << std::endl;
+        return false;
+    }
+
+    // Multiplex transfers to the same host over one connection when the server supports HTTP/2,
+    // and keep enough connections in the cache to avoid handshakes otherwise.
+    curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) m_params.maxTransfers);
+    curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, (long) m_params.maxTransfers);
+
+    // Share DNS and TLS sessions between handles. Handles are only used
+    // from the downloader thread, so the share doesn't need locking.
+    m_share = curl_share_init();
+    if (!m_share) {
+        std::cerr << "Could not init curl share handle" << std::endl;
+        return false;
+    }
+    curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    m_thread = std::thread(&Downloader::Loop, this);
+    return true;
+}
+
+Downloader::~Downloader() {
+    m_terminated = true;
+    if (m_multi) {
+        curl_multi_wakeup(m_multi);
+    }
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+
+    for (auto curl : m_idleHandles) {
+        curl_easy_cleanup(curl);
+    }
+
+    if (m_multi) {
+        curl_multi_cleanup(m_multi);
+    }
+
+    if (m_share) {
+        curl_share_cleanup(m_share);
+    }
+}
+
+void Downloader::Submit(const std::string &url, const std::string &filePath, DownloadCallback cb) {
+    auto req = std::make_shared<Request>();
+    req->url = url;
+    req->filePath = filePath;
+    req->cb = cb;
+    req->notBefore = Clock::now();
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (!m_terminated) {
+            m_submitted.push_back(req);
+            req = nullptr;
+        }
+    }
+
+    if (req) {
+        req->cb(false);
+        return;
+    }
+
+    curl_multi_wakeup(m_multi);
+}
+
+bool Downloader::Download(const std::string &url, const std::string &filePath) {
+    auto result = std::make_shared<std::promise<bool>>();
+    auto ret = result->get_future();
+    Submit(url, filePath, [result](bool success) { result->set_value(success); });
+    return ret.get();
+}
+
+bool Downloader::StartTransfer(RequestPtr &req) {
+    req->fp = fopen(req->filePath.c_str(), "wb");
+    if (!req->fp) {
+        std::cerr << "Could not open " << req->filePath << std::endl;
+        return false;
+    }
+
+    CURL *curl = nullptr;
+    if (!m_idleHandles.empty()) {
+        curl = m_idleHandles.back();
+        m_idleHandles.pop_back();
+    } else {
+        curl = curl_easy_init();
+        if (!curl) {
+            std::cerr << "Could not init curl" << std::endl;
+            fclose(req->fp);
+            req->fp = nullptr;
+            return false;
+        }
+
+        curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+        // Prefer waiting for a connection that can multiplex over opening a new one
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "gpsmap");
+    }
+
+    std::cout << "Downloading " << req->url << std::endl;
+
+    curl_easy_setopt(curl, CURLOPT_URL, req->url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req->fp);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, req.get());
+
+    req->curl = curl;
+    curl_multi_add_handle(m_multi, curl);
+    m_active.push_back(req);
+    return true;
+}
+
+void Downloader::StartTransfers() {
+    auto now = Clock::now();
+    auto it = m_pending.begin();
+    while (it != m_pending.end() && (int) m_active.size() < m_params.maxTransfers) {
+        auto req = *it;
+        if (req->notBefore > now) {
+            ++it;
+            continue;
+        }
+
+        it = m_pending.erase(it);
+        if (!StartTransfer(req)) {
+            req->cb(false);
+        }
+    }
+}
+
+void Downloader::CompleteTransfer(CURL *curl, CURLcode result) {
+    static auto &completed = Metrics::GetCounter("downloads.completed");
+    static auto &failed = Metrics::GetCounter("downloads.failed");
+    static auto &retried = Metrics::GetCounter("downloads.retried");
+    static auto &bytes = Metrics::GetCounter("downloads.bytes");
+    static auto &latency = Metrics::GetHistogram("downloads.latency_ns");
+
+    auto it = std::find_if(m_active.begin(), m_active.end(), [&](const RequestPtr &r) { return r->curl == curl; });
+    if (it == m_active.end()) {
+        return;
+    }
+
+    auto req = *it;
+    m_active.erase(it);
+
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+    // Includes name resolution and connection setup, when the connection is not reused
+    curl_off_t size = 0, micros = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &micros);
+    bytes.Add(std::max<curl_off_t>(0, size));
+    latency.Record(std::max<curl_off_t>(0, micros) * 1000);
+
+    curl_multi_remove_handle(m_multi, curl);
+    m_idleHandles.push_back(curl);
+    req->curl = nullptr;
+
+    fclose(req->fp);
+    req->fp = nullptr;
+
+    // Non-HTTP protocols don't have a response code
+    auto success = result == CURLE_OK && (code == 200 || code == 0);
+    if (!success) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(req->filePath, ec);
+
+        // Network errors, server errors and rate limiting are worth retrying
+        auto transient = result != CURLE_OK || code == 429 || code >= 500;
+        if (transient && req->attempts < m_params.maxRetries) {
+            auto delay = std::chrono::milliseconds(m_params.retryDelayMs) * (1 << req->attempts);
+            ++req->attempts;
+            retried.Add();
+            req->notBefore = Clock::now() + delay;
+            std::cerr << "Retrying " << req->url << " in " << delay.count() << " ms" << std::endl;
+            m_pending.push_back(req);
+            return;
+        }
+
+        std::cerr << "Could not download " << req->url << ": ";
+        if (result != CURLE_OK) {
+            std::cerr << curl_easy_strerror(result) << std::endl;
+        } else {
+            std::cerr << "HTTP status " << code << std::endl;
+        }
+        failed.Add();
+    } else {
+        completed.Add();
+    }
+
+    req->cb(success);
+}
+
+void Downloader::Loop() {
+    while (!m_terminated) {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_pending.insert(m_pending.end(), m_submitted.begin(), m_submitted.end());
+            m_submitted.clear();
+        }
+
+        StartTransfers();
+
+        int running = 0;
+        curl_multi_perform(m_multi, &running);
+
+        int msgs = 0;
+        CURLMsg *msg = nullptr;
+        while ((msg = curl_multi_info_read(m_multi, &msgs))) {
+            if (msg->msg == CURLMSG_DONE) {
+                CompleteTransfer(msg->easy_handle, msg->data.result);
+            }
+        }
+
+        // Sleep until there is network activity, a new submission,
+        // or until the next retry is due.
+        auto timeout = std::chrono::milliseconds(1000);
+        auto now = Clock::now();
+        for (const auto &req : m_pending) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(req->notBefore - now);
+            timeout = std::max(std::chrono::milliseconds(0), std::min(timeout, wait));
+        }
+
+        curl_multi_poll(m_multi, nullptr, 0, timeout.count(), nullptr);
+    }
+
+    // Fail whatever is left so that no client waits forever
+    for (auto &req : m_active) {
+        curl_multi_remove_handle(m_multi, req->curl);
+        m_idleHandles.push_back(req->curl);
+        fclose(req->fp);
+        boost::system::error_code ec;
+        boost::filesystem::remove(req->filePath, ec);
+        req->cb(false);
+    }
+    m_active.clear();
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_pending.insert(m_pending.end(), m_submitted.begin(), m_submitted.end());
+        m_submitted.clear();
+    }
+
+    for (auto &req : m_pending) {
+        req->cb(false);
+    }
+    m_pending.clear();
+}
+
+} // namespace gpsmap
@@ -19,6 +19,9 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include <sstream>
 
 extern "C" {
@@ -26,21 +29,85 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/timestamp.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 }
 
+#include <gpsmap/colorspace.h>
 #include <gpsmap/encoder.h>
 
 using namespace gpsmap;
 
 bool g_logpacket = false;
 
-#define STREAM_PIX_FMT AV_PIX_FMT_YUV420P
-#define SCALE_FLAGS SWS_BICUBIC
+// Frames are not scaled, the filter would only apply to chroma
+#define SCALE_FLAGS SWS_POINT
+
+namespace gpsmap {
+
+struct EncoderBackend {
+    // Name given on the command line
+    const char *name;
+
+    // Name of the libavcodec encoder
+    const char *codec;
+
+    // Device that encodes the frames, AV_HWDEVICE_TYPE_NONE for software encoders
+    enum AVHWDeviceType hwDevice;
+    enum AVPixelFormat hwFormat;
+
+    // Format of the frames given to the encoder, or uploaded to the device
+    enum AVPixelFormat swFormat;
+
+    void (*configure)(AVCodecContext *c, const VideoEncoder::Params &params);
+};
+
+} // namespace gpsmap
+
+static void ConfigureX265(AVCodecContext *c, const VideoEncoder::Params &params) {
+    // Doesn't work with x265
+    // c->thread_count = 1;
+    // c->thread_type = FF_THREAD_FRAME;
+    // x265 sizes its frame threads after its pool, which bounds the cores it uses
+    auto x265Params = "pools=" + std::to_string(params.encoderThreads) + ":numa-pools=1:log-level=1";
+    av_opt_set(c->priv_data, "x265-params", x265Params.c_str(), 0);
+}
+
+static void ConfigureX264(AVCodecContext *c, const VideoEncoder::Params &params) {
+    c->thread_count = params.encoderThreads;
+
+    // Maps are flat areas with sharp edges, which is closer to animation than to camera footage
+    av_opt_set(c->priv_data, "preset", "veryfast", 0);
+    av_opt_set(c->priv_data, "tune", "animation", 0);
+}
+
+static void ConfigureNvenc(AVCodecContext *c, const VideoEncoder::Params &params) {
+    av_opt_set(c->priv_data, "preset", "p4", 0);
+}
+
+static void ConfigureHardware(AVCodecContext *c, const VideoEncoder::Params &params) {
+}
+
+static const EncoderBackend s_backends[] = {
+    {"x265", "libx265", AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_YUV420P, ConfigureX265},
+    {"x264", "libx264", AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_YUV420P, ConfigureX264},
+    {"hevc_vaapi", "hevc_vaapi", AV_HWDEVICE_TYPE_VAAPI, AV_PIX_FMT_VAAPI, AV_PIX_FMT_NV12, ConfigureHardware},
+    {"hevc_nvenc", "hevc_nvenc", AV_HWDEVICE_TYPE_CUDA, AV_PIX_FMT_CUDA, AV_PIX_FMT_NV12, ConfigureNvenc},
+    {"hevc_qsv", "hevc_qsv", AV_HWDEVICE_TYPE_QSV, AV_PIX_FMT_QSV, AV_PIX_FMT_NV12, ConfigureHardware},
+};
+
+std::vector<std::string> VideoEncoder::GetBackends() {
+    std::vector<std::string> ret;
+    for (const auto &b : s_backends) {
+        ret.push_back(b.name);
+    }
+    return ret;
+}
 
 static inline std::string cpp_av_err2str(int errnum) {
     char errbuf[AV_ERROR_MAX_STRING_SIZE];
@@ -79,12 +146,27 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
            pts_tb.c_str(), dts.c_str(), dts_tb.c_str(), duration.c_str(), duration_tb.c_str(), pkt->stream_index);
 }
 
-VideoEncoder::VideoEncoder(const std::string &filePath, int w, int h, int fps, FrameGeneratorCallback cb) {
+VideoEncoder::VideoEncoder(const std::string &filePath, int w, int h, int fps, FrameGeneratorFactory factory,
+                           const Params &params) {
     m_filePath = filePath;
     m_width = w;
     m_height = h;
     m_fps = fps;
-    m_generateFrame = cb;
+    m_factory = factory;
+    m_params = params;
+
+    m_backend = nullptr;
+    m_swFormat = AV_PIX_FMT_NONE;
+    m_hwDevice = nullptr;
+    m_hwFrames = nullptr;
+
+    m_nextRenderIndex = 0;
+    m_consumedFrames = 0;
+    m_endIndex = std::numeric_limits<int64_t>::max();
+    m_pipelineRunning = false;
+    m_activeHelpers = 0;
+    m_renderDepthSum = 0;
+    m_lastFrame = nullptr;
 
     m_oc = nullptr;
     m_fmt = nullptr;
@@ -93,6 +175,8 @@ VideoEncoder::VideoEncoder(const std::string &filePath, int w, int h, int fps, F
 
 VideoEncoder::~VideoEncoder() {
     Finalize();
+    av_buffer_unref(&m_hwFrames);
+    av_buffer_unref(&m_hwDevice);
 }
 
 int VideoEncoder::WriteFrame(AVCodecContext *c, AVStream *st, AVFrame *frame) {
@@ -138,16 +222,51 @@ int VideoEncoder::WriteFrame(AVCodecContext *c, AVStream *st, AVFrame *frame) {
     return ret == AVERROR_EOF ? 1 : 0;
 }
 
+// Frames are converted in system memory and uploaded to the device by the encoder thread
+bool VideoEncoder::CreateHardwareFrames(AVCodecContext *c) {
+    auto device = m_params.device.empty() ? nullptr : m_params.device.c_str();
+    auto ret = av_hwdevice_ctx_create(&m_hwDevice, m_backend->hwDevice, device, nullptr, 0);
+    if (ret < 0) {
+        auto err = cpp_av_err2str(ret);
+        fprintf(stderr, "Could not open device for %s: %s\n", m_backend->name, err.c_str());
+        return false;
+    }
+
+    m_hwFrames = av_hwframe_ctx_alloc(m_hwDevice);
+    if (!m_hwFrames) {
+        fprintf(stderr, "Could not allocate hardware frames\n");
+        return false;
+    }
+
+    auto frames = (AVHWFramesContext *) m_hwFrames->data;
+    frames->format = m_backend->hwFormat;
+    frames->sw_format = m_backend->swFormat;
+    frames->width = m_width;
+    frames->height = m_height;
+    frames->initial_pool_size = 20;
+
+    ret = av_hwframe_ctx_init(m_hwFrames);
+    if (ret < 0) {
+        auto err = cpp_av_err2str(ret);
+        fprintf(stderr, "Could not initialize hardware frames: %s\n", err.c_str());
+        return false;
+    }
+
+    c->pix_fmt = m_backend->hwFormat;
+    c->hw_frames_ctx = av_buffer_ref(m_hwFrames);
+    return c->hw_frames_ctx != nullptr;
+}
+
 /* Add an output stream. */
-OutputStreamPtr VideoEncoder::AddStream(enum AVCodecID codec_id) {
+OutputStreamPtr VideoEncoder::AddStream(const EncoderBackend &backend) {
     OutputStreamPtr ret = OutputStreamPtr(new OutputStream);
 
     AVCodecContext *c;
 
-    ret->codec = avcodec_find_encoder(codec_id);
+    ret->codec = avcodec_find_encoder_by_name(backend.codec);
     if (!ret->codec) {
-        fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
-        exit(1);
+        fprintf(stderr, "Could not find encoder '%s'\n", backend.codec);
+        return nullptr;
     }
 
     ret->st = avformat_new_stream(m_oc, NULL);
@@ -163,15 +282,11 @@ OutputStreamPtr VideoEncoder::AddStream(enum AVCodecID codec_id) {
     }
     ret->enc = c;
 
-    std::stringstream codecParams;
-    codecParams << "pools=1:numa-pools=1:log-level=1";
-    auto cp = codecParams.str();
-
     switch (ret->codec->type) {
         case AVMEDIA_TYPE_VIDEO:
-            c->codec_id = codec_id;
+            c->codec_id = ret->codec->id;
 
-            c->bit_rate = 400000;
+            c->bit_rate = m_params.bitrate;
             /* Resolution must be a multiple of two. */
             c->width = m_width;
             c->height = m_height;
@@ -181,14 +296,15 @@ OutputStreamPtr VideoEncoder::AddStream(enum AVCodecID codec_id) {
              * identical to 1. */
             ret->st->time_base = (AVRational){1, m_fps};
             c->time_base = ret->st->time_base;
+            c->framerate = (AVRational){m_fps, 1};
 
-            // Doesn't work with x265
-            // c->thread_count = 1;
-            // c->thread_type = FF_THREAD_FRAME;
-            av_opt_set(c->priv_data, "x265-params", cp.c_str(), 0);
+            backend.configure(c, m_params);
 
-            c->gop_size = 12; /* emit one intra frame every twelve frames at most */
-            c->pix_fmt = STREAM_PIX_FMT;
+            c->gop_size = GopSize; /* emit one intra frame every twelve frames at most */
+            c->pix_fmt = backend.swFormat;
+            if (backend.hwDevice != AV_HWDEVICE_TYPE_NONE && !CreateHardwareFrames(c)) {
+                return nullptr;
+            }
             if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
                 /* just for testing, we also add B-frames */
                 c->max_b_frames = 2;
@@ -254,22 +370,6 @@ bool VideoEncoder::OpenVideo(OutputStream *ost, AVDictionary *opt_arg) {
         return false;
     }
 
-    /* allocate and init a re-usable frame */
-    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!ost->frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        return false;
-    }
-
-    /* If the output format is not YUV420P, then a temporary YUV420P
-     * picture is needed too. It is then converted to the required
-     * output format. */
-    ost->tmp_frame = alloc_picture(AV_PIX_FMT_RGBA, c->width, c->height);
-    if (!ost->tmp_frame) {
-        fprintf(stderr, "Could not allocate temporary picture\n");
-        return false;
-    }
-
     /* copy the stream parameters to the muxer */
     ret = avcodec_parameters_from_context(ost->st->codecpar, c);
     if (ret < 0) {
@@ -280,63 +380,319 @@ bool VideoEncoder::OpenVideo(OutputStream *ost, AVDictionary *opt_arg) {
     return true;
 }
 
-AVFrame *VideoEncoder::GetVideoFrame() {
-    AVCodecContext *c = m_video->enc;
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
-    /* when we pass a frame to the encoder, it may keep a reference to it
-     * internally; make sure we do not overwrite it here */
-    if (av_frame_make_writable(m_video->frame) < 0) {
-        exit(1);
+void VideoEncoder::StartPipeline() {
+    // Two slots per thread let a thread render its next frame while the previous one waits for the converter.
+    // Helpers only join at the end of a run, one slot each keeps the memory of idle segments down.
+    m_slots.resize(std::max(2, m_params.renderThreads * 2 + m_params.maxHelpers));
+    for (auto &slot : m_slots) {
+        slot.frame = alloc_picture(AV_PIX_FMT_RGBA, m_width, m_height);
     }
 
-    // We work with RGBA source, so we must convert it to YUV
-    if (!m_video->sws_ctx) {
-        m_video->sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_RGBA, c->width, c->height, c->pix_fmt,
-                                          SCALE_FLAGS, NULL, NULL, NULL);
-        if (!m_video->sws_ctx) {
-            fprintf(stderr, "Could not initialize the conversion context\n");
-            exit(1);
+    // Enough YUV frames for the converter to run ahead of the encoder, plus the one being encoded
+    const size_t encodeQueueDepth = 4;
+    m_freeFrames.reset(new BoundedQueue<AVFrame *>(encodeQueueDepth + 1));
+    m_encodeQueue.reset(new BoundedQueue<AVFrame *>(encodeQueueDepth));
+    for (size_t i = 0; i < encodeQueueDepth + 1; ++i) {
+        auto frame = alloc_picture(m_swFormat, m_width, m_height);
+        m_yuvFrames.push_back(frame);
+        m_freeFrames->Push(frame);
+    }
+    m_lastFrame = av_frame_alloc();
+    m_queuedAt.resize(m_yuvFrames.size());
+
+    for (int i = 0; i < m_params.renderThreads; ++i) {
+        m_renderers.emplace_back(&VideoEncoder::RenderLoop, this);
+    }
+
+    m_converter = std::thread(&VideoEncoder::ConvertLoop, this);
+
+    std::unique_lock<std::mutex> lock(m_renderLock);
+    m_pipelineRunning = true;
+}
+
+void VideoEncoder::StopPipeline() {
+    m_converter.join();
+
+    {
+        std::unique_lock<std::mutex> lock(m_renderLock);
+        m_endIndex = std::min(m_endIndex, m_consumedFrames);
+        m_pipelineRunning = false;
+    }
+    m_renderCv.notify_all();
+
+    for (auto &t : m_renderers) {
+        t.join();
+    }
+    m_renderers.clear();
+
+    {
+        // Helpers use the slots too
+        std::unique_lock<std::mutex> lock(m_renderLock);
+        m_renderCv.wait(lock, [&] { return m_activeHelpers == 0; });
+    }
+
+    for (auto &slot : m_slots) {
+        av_frame_free(&slot.frame);
+    }
+
+    m_renderStats.capacity = m_slots.size();
+    m_renderStats.averageDepth = m_consumedFrames ? (double) m_renderDepthSum / m_consumedFrames : 0;
+    m_slots.clear();
+
+    m_convertStats.outputStallSeconds = m_freeFrames->PopStallSeconds();
+    m_convertStats.averageDepth = m_encodeQueue->AverageDepth();
+    m_convertStats.capacity = m_encodeQueue->Capacity();
+    m_encodeStats.inputStallSeconds = m_encodeQueue->PopStallSeconds();
+
+    for (auto &frame : m_yuvFrames) {
+        av_frame_free(&frame);
+    }
+    m_yuvFrames.clear();
+    av_frame_free(&m_lastFrame);
+}
+
+void VideoEncoder::RenderLoop() {
+    static auto &frameTime = Metrics::GetHistogram("render.frame_ns");
+
+    auto generate = m_factory();
+    int64_t slotCount = m_slots.size();
+
+    while (true) {
+        FrameInfo info;
+        RenderSlot *slot;
+
+        {
+            std::unique_lock<std::mutex> lock(m_renderLock);
+            info.index = m_nextRenderIndex++;
+
+            // The slot is free once the converter consumed the frame that was rendered slotCount frames ago
+            auto start = std::chrono::steady_clock::now();
+            m_renderCv.wait(lock,
+                            [&] { return info.index < m_consumedFrames + slotCount || info.index >= m_endIndex; });
+            m_renderStats.outputStallSeconds += SecondsSince(start);
+
+            if (info.index >= m_endIndex) {
+                return;
+            }
+
+            slot = &m_slots[info.index % slotCount];
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok;
+        {
+            ScopedTimer timer(frameTime, "render frame");
+            ok = generate(*this, slot->frame, info);
+        }
+        auto busy = SecondsSince(start);
+
+        {
+            std::unique_lock<std::mutex> lock(m_renderLock);
+            slot->index = info.index;
+            slot->ok = ok;
+            slot->unchanged = info.unchanged;
+            slot->damageBegin = std::max(0, info.damageBegin);
+            slot->damageEnd = std::min(m_height, info.damageEnd);
+            if (ok) {
+                ++m_renderStats.frames;
+                m_renderStats.reusedFrames += info.unchanged;
+                m_renderStats.busySeconds += busy;
+            } else {
+                m_endIndex = std::min(m_endIndex, info.index);
+            }
+        }
+        m_renderCv.notify_all();
+    }
+}
+
+bool VideoEncoder::HelpRender() {
+    {
+        std::unique_lock<std::mutex> lock(m_renderLock);
+        if (!m_pipelineRunning || m_activeHelpers >= m_params.maxHelpers || m_nextRenderIndex >= m_endIndex) {
+            return false;
         }
+        ++m_activeHelpers;
     }
 
-    if (!m_generateFrame(*this, *m_video)) {
+    RenderLoop();
+
+    {
+        std::unique_lock<std::mutex> lock(m_renderLock);
+        --m_activeHelpers;
+    }
+    m_renderCv.notify_all();
+    return true;
+}
+
+const VideoEncoder::RenderSlot *VideoEncoder::WaitForRenderedFrame(int64_t index) {
+    auto &slot = m_slots[index % m_slots.size()];
+
+    std::unique_lock<std::mutex> lock(m_renderLock);
+    m_renderCv.wait(lock, [&] { return slot.index == index || index >= m_endIndex; });
+    if (index >= m_endIndex || !slot.ok) {
         return nullptr;
     }
 
-    sws_scale(m_video->sws_ctx, (const uint8_t *const *) m_video->tmp_frame->data, m_video->tmp_frame->linesize, 0,
-              c->height, m_video->frame->data, m_video->frame->linesize);
+    for (const auto &s : m_slots) {
+        m_renderDepthSum += s.index >= 0;
+    }
 
-    m_video->frame->pts = m_video->next_pts++;
+    return &slot;
+}
 
-    return m_video->frame;
+void VideoEncoder::ReleaseRenderedFrame(int64_t index) {
+    {
+        std::unique_lock<std::mutex> lock(m_renderLock);
+        m_slots[index % m_slots.size()].index = -1;
+        m_consumedFrames = index + 1;
+    }
+    m_renderCv.notify_all();
 }
 
-/*
- * encode one video frame and send it to the muxer
- * return 1 when encoding is finished, 0 otherwise
- */
-int VideoEncoder::WriteVideoFrame() {
-    auto frame = GetVideoFrame();
-    return WriteFrame(m_video->enc, m_video->st, frame);
+void VideoEncoder::ConvertLoop() {
+    AVCodecContext *c = m_video->enc;
+
+    // We work with RGBA source, so we must convert it to YUV
+    m_video->sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_RGBA, c->width, c->height, m_swFormat,
+                                      SCALE_FLAGS, NULL, NULL, NULL);
+    if (!m_video->sws_ctx) {
+        fprintf(stderr, "Could not initialize the conversion context\n");
+        exit(1);
+    }
+
+    while (true) {
+        auto index = m_video->next_pts;
+
+        // Frames may be rendered out of order, but they must be encoded in pts order
+        auto start = std::chrono::steady_clock::now();
+        auto slot = WaitForRenderedFrame(index);
+        m_convertStats.inputStallSeconds += SecondsSince(start);
+        if (!slot) {
+            break;
+        }
+
+        AVFrame *frame;
+        if (!m_freeFrames->Pop(frame)) {
+            break;
+        }
+
+        ++m_convertStats.frames;
+
+        if (slot->unchanged && m_lastFrame->buf[0]) {
+            // Share the pixels of the previous frame instead of converting the same image again
+            av_frame_unref(frame);
+            if (av_frame_ref(frame, m_lastFrame) < 0) {
+                exit(1);
+            }
+            ++m_convertStats.reusedFrames;
+        } else {
+            // Chroma is filtered over a few rows, so convert some margin around the damage.
+            // Bands are aligned to macroblocks.
+            auto begin = std::max(0, slot->damageBegin - 8) & ~15;
+            auto end = std::min(c->height, (slot->damageEnd + 8 + 15) & ~15);
+            bool partial = m_lastFrame->buf[0] && (begin > 0 || end < c->height);
+
+            /* when we pass a frame to the encoder, it may keep a reference to it
+             * internally; make sure we do not overwrite it here */
+            if (partial) {
+                // The rest of the frame is the same as the previous one
+                if (av_frame_make_writable(frame) < 0 || av_frame_copy(frame, m_lastFrame) < 0) {
+                    exit(1);
+                }
+                av_frame_unref(m_lastFrame);
+            } else {
+                av_frame_unref(m_lastFrame);
+                if (av_frame_make_writable(frame) < 0) {
+                    exit(1);
+                }
+                begin = 0;
+                end = c->height;
+            }
+
+            start = std::chrono::steady_clock::now();
+            ConvertRows(slot->frame, frame, begin, end);
+            m_convertStats.busySeconds += SecondsSince(start);
+
+            if (av_frame_ref(m_lastFrame, frame) < 0) {
+                exit(1);
+            }
+        }
+
+        ReleaseRenderedFrame(index);
+
+        frame->pts = m_video->next_pts++;
+        m_queuedAt[frame->pts % m_queuedAt.size()] = std::chrono::steady_clock::now();
+        m_encodeQueue->Push(frame);
+    }
+
+    m_encodeQueue->Close();
 }
 
-OutputStream::~OutputStream() {
-    if (enc) {
-        avcodec_free_context(&enc);
+void VideoEncoder::ConvertRows(const AVFrame *rgba, AVFrame *frame, int begin, int end) {
+    static auto &convertTime = Metrics::GetHistogram("encoder.convert_ns");
+    ScopedTimer timer(convertTime, "convert");
+
+    AVCodecContext *c = m_video->enc;
+
+    // The formats of the encoders have a direct converter. Bands start on an even row.
+    auto rows = rgba->data[0] + begin * rgba->linesize[0];
+    auto planes = frame->data;
+    auto strides = frame->linesize;
+    if (m_swFormat == AV_PIX_FMT_YUV420P) {
+        ConvertRGBAToI420(rows, rgba->linesize[0], planes[0] + begin * strides[0], strides[0],
+                          planes[1] + begin / 2 * strides[1], strides[1], planes[2] + begin / 2 * strides[2],
+                          strides[2], c->width, end - begin);
+        return;
     }
 
-    if (frame) {
-        av_frame_free(&frame);
+    if (m_swFormat == AV_PIX_FMT_NV12) {
+        ConvertRGBAToNV12(rows, rgba->linesize[0], planes[0] + begin * strides[0], strides[0],
+                          planes[1] + begin / 2 * strides[1], strides[1], c->width, end - begin);
+        return;
+    }
+
+    if (begin == 0 && end == c->height) {
+        sws_scale(m_video->sws_ctx, (const uint8_t *const *) rgba->data, rgba->linesize, 0, c->height, frame->data,
+                  frame->linesize);
+        return;
+    }
+
+    // Convert the band as an image of its own, starting at its first row
+    m_video->band_sws_ctx = sws_getCachedContext(m_video->band_sws_ctx, c->width, end - begin, AV_PIX_FMT_RGBA,
+                                                 c->width, end - begin, m_swFormat, SCALE_FLAGS, NULL, NULL, NULL);
+    if (!m_video->band_sws_ctx) {
+        fprintf(stderr, "Could not initialize the conversion context\n");
+        exit(1);
+    }
+
+    auto desc = av_pix_fmt_desc_get(m_swFormat);
+    const uint8_t *src[4] = {rgba->data[0] + begin * rgba->linesize[0]};
+    uint8_t *dst[4] = {};
+    for (int i = 0; i < av_pix_fmt_count_planes(m_swFormat); ++i) {
+        auto row = (i == 1 || i == 2) ? begin >> desc->log2_chroma_h : begin;
+        dst[i] = frame->data[i] + row * frame->linesize[i];
     }
 
-    if (tmp_frame) {
-        av_frame_free(&tmp_frame);
+    sws_scale(m_video->band_sws_ctx, src, rgba->linesize, 0, end - begin, dst, frame->linesize);
+}
+
+OutputStream::~OutputStream() {
+    if (enc) {
+        avcodec_free_context(&enc);
     }
 
     if (sws_ctx) {
         sws_freeContext(sws_ctx);
     }
 
+    if (band_sws_ctx) {
+        sws_freeContext(band_sws_ctx);
+    }
+
     if (swr_ctx) {
         swr_free(&swr_ctx);
     }
@@ -372,7 +728,20 @@ bool VideoEncoder::Initialize() {
 
     m_fmt = m_oc->oformat;
 
-    m_video = AddStream(AV_CODEC_ID_HEVC);
+    for (const auto &b : s_backends) {
+        if (m_params.backend == b.name) {
+            m_backend = &b;
+        }
+    }
+
+    if (!m_backend) {
+        fprintf(stderr, "Unknown encoder backend '%s'\n", m_params.backend.c_str());
+        return false;
+    }
+
+    m_swFormat = m_backend->swFormat;
+
+    m_video = AddStream(*m_backend);
     if (!m_video) {
         return false;
     }
@@ -404,16 +773,77 @@ bool VideoEncoder::Initialize() {
     return true;
 }
 
-void VideoEncoder::EncodeLoop() {
-    bool encode_video = true;
-    while (encode_video) {
-        encode_video = !WriteVideoFrame();
+int VideoEncoder::EncodeFrame(AVFrame *frame) {
+    if (!frame || !m_hwFrames) {
+        return WriteFrame(m_video->enc, m_video->st, frame);
+    }
+
+    auto hwFrame = av_frame_alloc();
+    if (!hwFrame) {
+        exit(1);
     }
+
+    auto ret = av_hwframe_get_buffer(m_hwFrames, hwFrame, 0);
+    if (ret >= 0) {
+        ret = av_hwframe_transfer_data(hwFrame, frame, 0);
+    }
+
+    if (ret < 0) {
+        auto err = cpp_av_err2str(ret);
+        fprintf(stderr, "Could not upload frame: %s\n", err.c_str());
+        exit(1);
+    }
+
+    hwFrame->pts = frame->pts;
+    ret = WriteFrame(m_video->enc, m_video->st, hwFrame);
+    av_frame_free(&hwFrame);
+    return ret;
+}
+
+void VideoEncoder::EncodeLoop(std::function<void()> started) {
+    static auto &queueTime = Metrics::GetHistogram("encoder.queue_ns");
+    static auto &encodeTime = Metrics::GetHistogram("encoder.encode_ns");
+
+    StartPipeline();
+    if (started) {
+        started();
+    }
+
+    AVFrame *frame;
+    while (m_encodeQueue->Pop(frame)) {
+        // Frames in the queue and the one being encoded have consecutive pts, so their entries are distinct
+        auto start = std::chrono::steady_clock::now();
+        queueTime.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             start - m_queuedAt[frame->pts % m_queuedAt.size()])
+                             .count());
+        {
+            ScopedTimer timer(encodeTime, "encode");
+            EncodeFrame(frame);
+        }
+        m_encodeStats.busySeconds += SecondsSince(start);
+        ++m_encodeStats.frames;
+
+        m_freeFrames->Push(frame);
+    }
+
+    // Flush the encoder
+    EncodeFrame(nullptr);
+
+    StopPipeline();
+}
+
+PipelineStats VideoEncoder::GetPipelineStats() const {
+    PipelineStats ret;
+    ret.render = m_renderStats;
+    ret.convert = m_convertStats;
+    ret.encode = m_encodeStats;
+    return ret;
 }
 
-VideoEncoderPtr VideoEncoder::Create(const std::string &filePath, int w, int h, int fps, FrameGeneratorCallback cb) {
+VideoEncoderPtr VideoEncoder::Create(const std::string &filePath, int w, int h, int fps, FrameGeneratorFactory factory,
+                                     const Params &params) {
     av_log_set_level(AV_LOG_QUIET);
-    auto ret = VideoEncoderPtr(new VideoEncoder(filePath, w, h, fps, cb));
+    auto ret = VideoEncoderPtr(new VideoEncoder(filePath, w, h, fps, factory, params));
     if (!ret->Initialize()) {
         return nullptr;
     }
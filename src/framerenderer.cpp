@@ -0,0 +1,171 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <iostream>
+
+#include <gpsmap/framerenderer.h>
+
+OIIO_NAMESPACE_USING
+
+namespace gpsmap {
+
+const char *const FrameRenderer::LayerNames[] = {"map", "date", "stats", nullptr};
+
+Markers FrameRenderer::GetMarkers(const Resources &resources, double startLatitude, double startLongitude,
+                                  double endLatitude, double endLongitude) {
+    Markers markers;
+
+    // Start marker
+    {
+        Marker m;
+        m.Image = &resources.Start();
+        m.Latitude = startLatitude;
+        m.Longitude = startLongitude;
+
+        auto mw = m.Image->Width();
+        auto mh = m.Image->Height();
+
+        m.x = mw / 2;
+        m.y = mh;
+        markers.push_back(m);
+    }
+
+    // End marker
+    {
+        Marker m;
+        m.Image = &resources.Finish();
+        m.Latitude = endLatitude;
+        m.Longitude = endLongitude;
+
+        auto mw = m.Image->Width();
+
+        m.x = mw / 2;
+        m.y = 0;
+        markers.push_back(m);
+    }
+
+    return markers;
+}
+
+FrameRendererPtr FrameRenderer::Create(const Params &params) {
+    auto ret = FrameRendererPtr(new FrameRenderer(params));
+    if (!ret->Initialize()) {
+        return nullptr;
+    }
+    return ret;
+}
+
+bool FrameRenderer::Initialize() {
+    const auto &p = m_params;
+    if (p.zoomLevels.empty()) {
+        std::cerr << "No zoom levels to render" << std::endl;
+        return false;
+    }
+
+    m_geoTracker = GeoTracker::Create(p.samples);
+
+    std::vector<std::pair<MapImageGeneratorPtr, int>> zoomedMaps;
+    for (const auto &level : p.zoomLevels) {
+        MapImageGenerator::Params mp = {p.wholeTrack, m_geoTracker, p.tiles, p.resources, level.zoom, p.markers};
+        mp.composedTiles = p.composedTiles;
+        zoomedMaps.push_back(std::make_pair(MapImageGenerator::Create(mp), level.duration));
+    }
+    int largestZoomLevelIndex = zoomedMaps.size() - 1;
+
+    auto duration = p.duration;
+    auto overrideCb = [=](int second, int &index) {
+        // show largest zoom level at the beginning or end of a segment, to simplify synchronization
+        if ((second > duration - 40) || (second < 20)) {
+            index = largestZoomLevelIndex;
+            return true;
+        }
+        return false;
+    };
+
+    m_mapSwitcher = MapSwitcher::Create(m_geoTracker, overrideCb);
+    for (auto m : zoomedMaps) {
+        m_mapSwitcher->AddMapGenerator(m.first, m.second);
+    }
+
+    m_compositor = Compositor::Create(p.width, p.height);
+    for (const auto &name : p.layers) {
+        if (name == "map") {
+            m_compositor->AddLayer(name, m_mapSwitcher);
+        } else if (name == "date") {
+            m_compositor->AddLayer(name, LabelGenerator::Create(m_geoTracker, p.resources, LabelGenerator::Date));
+        } else if (name == "stats") {
+            m_compositor->AddLayer(name, LabelGenerator::Create(m_geoTracker, p.resources, LabelGenerator::Stats));
+        } else {
+            std::cerr << "Unknown layer " << name << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Updates the generators for the given frame without drawing anything
+bool FrameRenderer::Update(int64_t frameIndex, int fps) {
+    // The tracker does not draw anything
+    ImageBuf none;
+    if (!m_geoTracker->Generate(none, frameIndex, fps)) {
+        return false;
+    }
+
+    m_mapSwitcher->Update(frameIndex, fps);
+    return true;
+}
+
+bool FrameRenderer::Render(int64_t frameIndex, int fps, ROI &damage) {
+    // When the previous frame was rendered by another thread, get the state of its layers first,
+    // so that the output does not depend on the number of render threads.
+    if (frameIndex != m_prevFrameIndex + 1) {
+        m_prevKeysValid = false;
+        if (frameIndex > m_params.firstFrame && Update(frameIndex - 1, fps)) {
+            m_compositor->GetKeys(m_prevKeys);
+            m_prevKeysValid = true;
+        }
+    }
+    m_prevFrameIndex = frameIndex;
+
+    if (!Update(frameIndex, fps)) {
+        return false;
+    }
+
+    Compositor::LayerKeys keys;
+    m_compositor->GetKeys(keys);
+    damage = m_prevKeysValid ? m_compositor->GetDamage(m_prevKeys, keys) : GetCanvas().roi();
+    m_prevKeys = keys;
+    m_prevKeysValid = true;
+
+    // When stopped, the frame often looks exactly like the previous one
+    if (damage.ybegin >= damage.yend || damage.xbegin >= damage.xend) {
+        return true;
+    }
+
+    if (!m_compositor->Compose(frameIndex, fps, keys)) {
+        m_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace gpsmap
@@ -0,0 +1,169 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <OpenImageIO/imagebufalgo.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#include <gpsmap/glyphatlas.h>
+
+OIIO_NAMESPACE_USING
+
+namespace gpsmap {
+
+GlyphAtlasPtr GlyphAtlas::Create(const std::string &fontPath, int fontSize, int height, int baseline,
+                                 std::string_view chars) {
+    auto ret = GlyphAtlasPtr(new GlyphAtlas(height, baseline));
+    if (!ret->Load(fontPath, fontSize, chars)) {
+        return nullptr;
+    }
+    return ret;
+}
+
+bool GlyphAtlas::Load(const std::string &fontPath, int fontSize, std::string_view chars) {
+    // Advances are integers, so the extra width that a character adds between
+    // two others is its advance, even for characters without ink like spaces.
+    auto pair = ImageBufAlgo::text_size("00", fontSize, fontPath);
+    if (!pair.defined()) {
+        std::cerr << "Could not measure text with " << fontPath << std::endl;
+        return false;
+    }
+
+    // Room for glyphs that extend past their advance
+    auto pad = fontSize / 2;
+
+    for (auto c : chars) {
+        if ((unsigned char) c >= sizeof(m_glyphs) / sizeof(m_glyphs[0])) {
+            std::cerr << "Glyph atlases only support ASCII characters" << std::endl;
+            return false;
+        }
+
+        auto &glyph = m_glyphs[(int) c];
+        std::string text = std::string("0") + c + "0";
+        auto triple = ImageBufAlgo::text_size(text, fontSize, fontPath);
+        if (!triple.defined()) {
+            std::cerr << "Could not measure " << text << " with " << fontPath << std::endl;
+            return false;
+        }
+        glyph.advance = triple.width() - pair.width();
+
+        auto width = glyph.advance + 2 * pad;
+        ImageBuf buf(ImageSpec(width, m_height, 4));
+        if (!ImageBufAlgo::render_box(buf, 0, 0, width, m_height, 1.0f, true, {}, 1)) {
+            std::cerr << "Could not render box" << std::endl;
+            return false;
+        }
+
+        if (!ImageBufAlgo::render_text(buf, pad, m_baseline, std::string(1, c), fontSize, fontPath,
+                                       {0.0f, 0.0f, 0.0f, 1.0f}, ImageBufAlgo::TextAlignX::Left,
+                                       ImageBufAlgo::TextAlignY::Baseline, 0, {}, 1)) {
+            std::cerr << "Could not render text" << std::endl;
+            return false;
+        }
+
+        std::vector<uint8_t> pixels(width * m_height * 4);
+        if (!buf.get_pixels(buf.roi(), TypeUInt8, pixels.data())) {
+            std::cerr << "Could not read glyph pixels: " << buf.geterror() << std::endl;
+            return false;
+        }
+
+        // Only keep the columns that have ink
+        int first = width, last = -1;
+        for (int y = 0; y < m_height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                if (pixels[(y * width + x) * 4] != 255) {
+                    first = std::min(first, x);
+                    last = std::max(last, x);
+                }
+            }
+        }
+
+        glyph.valid = true;
+        if (last < first) {
+            continue;
+        }
+
+        glyph.left = first - pad;
+        glyph.width = last - first + 1;
+        glyph.pixels.resize(glyph.width * m_height * 4);
+        for (int y = 0; y < m_height; ++y) {
+            memcpy(&glyph.pixels[y * glyph.width * 4], &pixels[(y * width + first) * 4], glyph.width * 4);
+        }
+    }
+
+    return true;
+}
+
+int GlyphAtlas::GetWidth(std::string_view text) const {
+    int ret = 0;
+    for (auto c : text) {
+        if ((unsigned char) c < sizeof(m_glyphs) / sizeof(m_glyphs[0])) {
+            ret += m_glyphs[(int) c].advance;
+        }
+    }
+    return ret;
+}
+
+bool GlyphAtlas::DrawLabel(ImageBuf &dest, int y, std::string_view text) const {
+    const auto &spec = dest.spec();
+    if (spec.format != TypeUInt8 || spec.nchannels != 4 || !dest.localpixels()) {
+        std::cerr << "Labels can only be drawn on 8 bits RGBA images in memory" << std::endl;
+        return false;
+    }
+
+    auto roi = dest.roi();
+    if (y < roi.ybegin || y + m_height > roi.yend) {
+        std::cerr << "Label does not fit in the image" << std::endl;
+        return false;
+    }
+
+    auto width = roi.width();
+    for (int row = 0; row < m_height; ++row) {
+        memset(dest.pixeladdr(roi.xbegin, y + row), 255, width * 4);
+    }
+
+    // Glyphs may overlap their neighbors. The background is white and the ink
+    // black, so that keeping the darkest pixel composites them correctly.
+    auto pen = roi.xbegin + width / 2 - GetWidth(text) / 2;
+    for (auto c : text) {
+        if ((unsigned char) c >= sizeof(m_glyphs) / sizeof(m_glyphs[0]) || !m_glyphs[(int) c].valid) {
+            continue;
+        }
+
+        const auto &glyph = m_glyphs[(int) c];
+        auto x0 = std::max(pen + glyph.left, roi.xbegin);
+        auto x1 = std::min(pen + glyph.left + glyph.width, roi.xend);
+        for (int row = 0; row < m_height && x0 < x1; ++row) {
+            auto *dst = (uint8_t *) dest.pixeladdr(x0, y + row);
+            const auto *src = &glyph.pixels[(row * glyph.width + x0 - pen - glyph.left) * 4];
+            for (int i = 0; i < (x1 - x0) * 4; ++i) {
+                dst[i] = std::min(dst[i], src[i]);
+            }
+        }
+
+        pen += glyph.advance;
+    }
+
+    return true;
+}
+
+} // namespace gpsmap
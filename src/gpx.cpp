@@ -18,30 +18,98 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <boost/foreach.hpp>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/xml_parser.hpp>
-#include <iomanip>
+#include <algorithm>
+#include <assert.h>
 #include <iostream>
 #include <math.h>
+#include <numeric>
+#include <string.h>
 
 #include <gpsmap/gpx.h>
-
-namespace pt = boost::property_tree;
+#include <gpsmap/mappedfile.h>
+#include <gpsmap/trackmath.h>
 
 namespace gpsmap {
 
 std::ostream &operator<<(std::ostream &os, TrackItem const &m) {
-    os << "TrackItem " << m.OriginalTimestamp << " lat=" << m.Latitude << " lon=" << m.Longitude << " speed=" << m.Speed
-       << " alt=" << m.Elevation;
+    os << "TrackItem " << time_to_str(m.Timestamp) << " lat=" << m.Latitude << " lon=" << m.Longitude
+       << " speed=" << m.Speed << " alt=" << m.Elevation;
     return os;
 }
 
+// Number of days between 1970-01-01 and the given date of the proleptic Gregorian calendar.
+// http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned) (y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t) doe - 719468;
+}
+
+// Parses count digits at pos
+static bool parse_digits(std::string_view str, size_t pos, size_t count, int &value) {
+    if (pos + count > str.size()) {
+        return false;
+    }
+
+    value = 0;
+    for (size_t i = pos; i < pos + count; ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (str[i] - '0');
+    }
+    return true;
+}
+
+bool parse_time(std::string_view iso, time_t &t) {
+    int year, month, day, hour, minute, second;
+
+    if (!parse_digits(iso, 0, 4, year) || !parse_digits(iso, 5, 2, month) || !parse_digits(iso, 8, 2, day) ||
+        !parse_digits(iso, 11, 2, hour) || !parse_digits(iso, 14, 2, minute) || !parse_digits(iso, 17, 2, second)) {
+        return false;
+    }
+
+    if (iso[4] != '-' || iso[7] != '-' || iso[10] != 'T' || iso[13] != ':' || iso[16] != ':') {
+        return false;
+    }
+
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return false;
+    }
+
+    size_t pos = 19;
+    if (pos < iso.size() && iso[pos] == '.') {
+        ++pos;
+        while (pos < iso.size() && iso[pos] >= '0' && iso[pos] <= '9') {
+            ++pos;
+        }
+    }
+
+    int offset = 0;
+    if (pos + 1 == iso.size() && iso[pos] == 'Z') {
+        offset = 0;
+    } else if (pos + 6 == iso.size() && (iso[pos] == '+' || iso[pos] == '-') && iso[pos + 3] == ':') {
+        int oh, om;
+        if (!parse_digits(iso, pos + 1, 2, oh) || !parse_digits(iso, pos + 4, 2, om)) {
+            return false;
+        }
+        offset = (oh * 3600 + om * 60) * (iso[pos] == '-' ? -1 : 1);
+    } else {
+        return false;
+    }
+
+    auto days = days_from_civil(year, month, day);
+    t = (time_t)(days * 86400 + hour * 3600 + minute * 60 + second - offset);
+    return true;
+}
+
 time_t parse_time(const std::string &iso) {
-    std::stringstream ss(iso);
-    std::tm t = {};
-    if (ss >> std::get_time(&t, "%Y-%m-%dT%H:%M:%SZ")) {
-        return std::mktime(&t) - timezone;
+    time_t t;
+    if (parse_time(std::string_view(iso), t)) {
+        return t;
     }
     return 0;
 }
@@ -54,112 +122,238 @@ std::string time_to_str(time_t t) {
     return buff;
 }
 
-// Returns the distance in meters between the given coordinates (in degrees)
-static double distance(double lat1, double lon1, double lat2, double lon2) {
-    // Radius of Earth in meters, R = 6371 * 1000
-    long double R = 6371 * 1000;
+std::shared_ptr<GPX> GPX::Create() {
+    return std::shared_ptr<GPX>(new GPX());
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-    lat1 = to_rad(lat1);
-    lon1 = to_rad(lon1);
-    lat2 = to_rad(lat2);
-    lon2 = to_rad(lon2);
+static std::string_view trim(std::string_view str) {
+    while (!str.empty() && is_space(str.front())) {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && is_space(str.back())) {
+        str.remove_suffix(1);
+    }
+    return str;
+}
 
-    // Haversine Formula
-    long double dlon = lon2 - lon1;
-    long double dlat = lat2 - lat1;
+// Returns the value of the given attribute in the attribute list of a tag
+static bool get_attribute(std::string_view attrs, std::string_view name, std::string_view &value) {
+    for (size_t pos = attrs.find(name); pos != std::string_view::npos; pos = attrs.find(name, pos + 1)) {
+        if (pos > 0 && !is_space(attrs[pos - 1])) {
+            continue;
+        }
 
-    long double ans = pow(sin(dlat / 2), 2) + cos(lat1) * cos(lat2) * pow(sin(dlon / 2), 2);
+        auto p = pos + name.size();
+        while (p < attrs.size() && is_space(attrs[p])) {
+            ++p;
+        }
+        if (p >= attrs.size() || attrs[p] != '=') {
+            continue;
+        }
+        ++p;
+        while (p < attrs.size() && is_space(attrs[p])) {
+            ++p;
+        }
+        if (p >= attrs.size() || (attrs[p] != '"' && attrs[p] != '\'')) {
+            continue;
+        }
+
+        auto end = attrs.find(attrs[p], p + 1);
+        if (end == std::string_view::npos) {
+            return false;
+        }
+
+        value = attrs.substr(p + 1, end - p - 1);
+        return true;
+    }
 
-    return R * 2 * asin(sqrt(ans));
+    return false;
 }
 
-static double bearing(double lat1, double lon1, double lat2, double lon2) {
-    lat1 = to_rad(lat1);
-    lon1 = to_rad(lon1);
-    lat2 = to_rad(lat2);
-    lon2 = to_rad(lon2);
+// Returns the text of the first <name> element in body
+static bool get_element(std::string_view body, std::string_view name, std::string_view &value) {
+    for (size_t pos = body.find('<'); pos != std::string_view::npos; pos = body.find('<', pos + 1)) {
+        if (body.compare(pos + 1, name.size(), name) != 0) {
+            continue;
+        }
+
+        auto p = pos + 1 + name.size();
+        if (p >= body.size() || (body[p] != '>' && !is_space(body[p]))) {
+            continue;
+        }
+
+        auto start = body.find('>', p);
+        if (start == std::string_view::npos) {
+            return false;
+        }
+
+        auto end = body.find('<', start + 1);
+        if (end == std::string_view::npos) {
+            return false;
+        }
 
-    auto x = cos(lat2) * sin(lon2 - lon1);
-    auto y = cos(lat1) * sin(lat2) - sin(lat1) * cos(lat2) * cos(lon2 - lon1);
-    auto bearing = atan2(x, y);
-    return to_deg(bearing);
+        value = trim(body.substr(start + 1, end - start - 1));
+        return true;
+    }
+
+    return false;
 }
 
-static double bearing(const TrackItem &i1, const TrackItem &i2) {
-    return bearing(i1.Latitude, i1.Longitude, i2.Latitude, i2.Longitude);
+static double to_double(std::string_view str) {
+    char buf[64];
+    auto len = std::min(str.size(), sizeof(buf) - 1);
+    memcpy(buf, str.data(), len);
+    buf[len] = 0;
+    return strtod(buf, nullptr);
 }
 
-static double GetGrade(const std::vector<TrackItem> &items, int i) {
-    const double maxDist = 50.0;
+// Extracts the track points of a GPX document in a single pass over the text, without building a tree.
+// Only the lat/lon attributes of trkpt elements and their ele, time and speed children are used.
+bool GPX::Parse(std::string_view doc, const std::string &path) {
+    bool first = true;
+    size_t skipped = 0;
+
+    size_t pos = 0;
+    while ((pos = doc.find('<', pos)) != std::string_view::npos) {
+        if (doc.compare(pos, 4, "<!--") == 0) {
+            pos = doc.find("-->", pos + 4);
+            if (pos == std::string_view::npos) {
+                break;
+            }
+            pos += 3;
+            continue;
+        }
 
-    // Get altitude and cumulative distance on the left
-    double ldist = 0.0;
-    double lelev = 0.0;
-    for (auto l = i; l >= 0; --l) {
-        ldist += items[l].DistanceDelta;
-        lelev = items[l].Elevation;
-        if (ldist >= maxDist) {
-            break;
+        const std::string_view tag = "<trkpt";
+        if (doc.compare(pos, tag.size(), tag) != 0 || pos + tag.size() >= doc.size() ||
+            (!is_space(doc[pos + tag.size()]) && doc[pos + tag.size()] != '>' && doc[pos + tag.size()] != '/')) {
+            ++pos;
+            continue;
         }
-    }
 
-    // Get altitude and cumulative distance on the right
-    double rdist = 0.0;
-    double relev = 0.0;
-    for (size_t l = i; l < items.size(); ++l) {
-        rdist += items[l].DistanceDelta;
-        relev = items[l].Elevation;
-        if (rdist >= maxDist) {
-            break;
+        auto attrsEnd = doc.find('>', pos);
+        if (attrsEnd == std::string_view::npos) {
+            std::cerr << path << ": unterminated trkpt tag" << std::endl;
+            return false;
+        }
+
+        auto attrs = doc.substr(pos + tag.size(), attrsEnd - pos - tag.size());
+        std::string_view body;
+
+        if (!attrs.empty() && attrs.back() == '/') {
+            pos = attrsEnd + 1;
+        } else {
+            auto end = doc.find("</trkpt>", attrsEnd);
+            if (end == std::string_view::npos) {
+                std::cerr << path << ": missing </trkpt>" << std::endl;
+                return false;
+            }
+            body = doc.substr(attrsEnd + 1, end - attrsEnd - 1);
+            pos = end;
+        }
+
+        std::string_view lat, lon, time, speed, elevation;
+        TrackItem item;
+
+        if (!get_attribute(attrs, "lat", lat) || !get_attribute(attrs, "lon", lon) ||
+            !get_element(body, "time", time) || !parse_time(time, item.Timestamp)) {
+            ++skipped;
+            continue;
         }
+
+        get_element(body, "speed", speed);
+        get_element(body, "ele", elevation);
+
+        item.Speed = to_double(speed);
+        item.Latitude = to_double(lat);
+        item.Longitude = to_double(lon);
+        item.MercatorX = to_mercator_x(item.Longitude);
+        item.MercatorY = to_mercator_y(item.Latitude);
+        item.Elevation = to_double(elevation);
+        m_originalTimestamps.push_back({(uint32_t) m_text.size(), (uint32_t) time.size()});
+        m_text.append(time);
+        item.Grade = 0.0;
+        item.DistanceDelta = 0.0;
+        item.TotalDistance = 0.0;
+        item.Bearing = 0.0;
+        item.IsTrackStart = first;
+        first = false;
+
+        m_trackItems.push_back(item);
     }
 
-    auto td = ldist + rdist;
-    if (td < 0.01) {
-        return 0.0;
+    if (skipped) {
+        std::cerr << path << ": skipped " << skipped << " track points without position or time" << std::endl;
     }
 
-    return (relev - lelev) / td * 100;
+    return true;
 }
 
-std::shared_ptr<GPX> GPX::Create() {
-    return std::shared_ptr<GPX>(new GPX());
-}
+void GPX::ComputeDerivedFields() {
+    if (m_trackItems.empty()) {
+        return;
+    }
 
-void GPX::LoadFromFile(const std::string &path) {
-    pt::ptree tree;
-    pt::read_xml(path, tree);
+    // Sort the hot and cold arrays together
+    std::vector<uint32_t> order(m_trackItems.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [&](uint32_t a, uint32_t b) { return m_trackItems[a].Timestamp < m_trackItems[b].Timestamp; });
+
+    std::vector<TrackItem> items;
+    std::vector<TextRef> timestamps;
+    items.reserve(order.size());
+    timestamps.reserve(order.size());
+    for (auto i : order) {
+        items.push_back(m_trackItems[i]);
+        timestamps.push_back(m_originalTimestamps[i]);
+    }
+    m_trackItems.swap(items);
+    m_originalTimestamps.swap(timestamps);
+
+    // The math runs in batches over plain arrays, so that it vectorizes
+    auto count = m_trackItems.size();
+    std::vector<double> lat(count), lon(count), values(count);
+    for (size_t i = 0; i < count; ++i) {
+        lat[i] = m_trackItems[i].Latitude;
+        lon[i] = m_trackItems[i].Longitude;
+    }
 
-    bool first = true;
+    ComputeDistances(lat.data(), lon.data(), count, values.data());
+    for (size_t i = 1; i < count; ++i) {
+        m_trackItems[i].DistanceDelta = values[i];
+    }
+
+    ComputeTotalDistance();
 
-    BOOST_FOREACH (pt::ptree::value_type &trkseg, tree.get_child("gpx.trk")) {
-        BOOST_FOREACH (pt::ptree::value_type &trkpt, trkseg.second) {
-            TrackItem item;
-            auto lat = trkpt.second.get_child("<xmlattr>.lat").get_value("");
-            auto lon = trkpt.second.get_child("<xmlattr>.lon").get_value("");
-            auto speed = trkpt.second.get_child("speed").get_value("");
-            auto elevation = trkpt.second.get_child("ele").get_value("");
-            auto time = trkpt.second.get_child("time").get_value("");
+    std::vector<double> deltas(count), elevations(count), bearings(count);
+    for (size_t i = 0; i < count; ++i) {
+        deltas[i] = m_trackItems[i].DistanceDelta;
+        elevations[i] = m_trackItems[i].Elevation;
+    }
 
-            item.Speed = strtod(speed.c_str(), nullptr);
-            item.Latitude = strtod(lat.c_str(), nullptr);
-            item.Longitude = strtod(lon.c_str(), nullptr);
-            item.Elevation = strtod(elevation.c_str(), nullptr);
-            item.OriginalTimestamp = time;
-            item.Timestamp = parse_time(time);
-            item.Grade = 0.0;
-            item.DistanceDelta = 0.0;
-            item.TotalDistance = 0.0;
-            item.Bearing = 0.0;
-            item.IsTrackStart = first;
-            first = false;
+    ComputeGrades(deltas.data(), elevations.data(), count, values.data());
+    ComputeBearings(lat.data(), lon.data(), count, bearings.data());
 
-            m_trackItems.push_back(item);
+    for (size_t i = 0; i < count - 1; ++i) {
+        m_trackItems[i].Grade = values[i];
+        auto b = bearings[i];
+        if (b == 0) {
+            if (i > 1) {
+                m_trackItems[i].Bearing = m_trackItems[i - 1].Bearing;
+            }
+        } else {
+            m_trackItems[i].Bearing = b;
         }
     }
+}
 
-    std::sort(m_trackItems.begin(), m_trackItems.end());
-
+// The total distance depends on the initial distance, so it is not cached
+void GPX::ComputeTotalDistance() {
     for (size_t i = 1; i < m_trackItems.size(); ++i) {
         auto &ti0 = m_trackItems[i - 1];
         if (i == 1) {
@@ -167,35 +361,83 @@ void GPX::LoadFromFile(const std::string &path) {
         }
 
         auto &ti1 = m_trackItems[i];
-        ti1.DistanceDelta = distance(ti0.Latitude, ti0.Longitude, ti1.Latitude, ti1.Longitude);
         ti1.TotalDistance = ti0.TotalDistance + ti1.DistanceDelta;
     }
+}
 
-    for (size_t i = 0; i < m_trackItems.size() - 1; ++i) {
-        m_trackItems[i].Grade = GetGrade(m_trackItems, i);
-        auto b = bearing(m_trackItems[i], m_trackItems[i + 1]);
-        if (b == 0) {
-            if (i > 1) {
-                m_trackItems[i].Bearing = m_trackItems[i - 1].Bearing;
-            }
-        } else {
-            m_trackItems[i].Bearing = b;
+bool GPX::LoadFromFile(const std::string &path) {
+    // The cache only holds the items of one file
+    bool useCache = m_useCache && m_trackItems.empty();
+    auto cachePath = GetCachePath(path);
+
+    SourceInfo source = {};
+    useCache = useCache && GetSourceInfo(path, source);
+    if (useCache && LoadCache(cachePath, path, source)) {
+        return true;
+    }
+
+    auto file = MappedFile::Create(path);
+    if (!file) {
+        return false;
+    }
+
+    if (!Parse(std::string_view(file->Data(), file->Size()), path)) {
+        return false;
+    }
+
+    if (m_trackItems.empty()) {
+        std::cerr << path << " has no track points" << std::endl;
+        return false;
+    }
+
+    ComputeDerivedFields();
+
+    if (useCache) {
+        source.hash = HashContents(std::string_view(file->Data(), file->Size()));
+        SaveCache(cachePath, source);
+    }
+
+    return true;
+}
+
+GPXPtr GPX::Merge(const std::vector<GPXPtr> &gpxs) {
+    auto ret = Create();
+
+    size_t count = 0;
+    for (const auto &gpx : gpxs) {
+        count += gpx->m_trackItems.size();
+    }
+
+    ret->m_trackItems.reserve(count);
+    ret->m_originalTimestamps.reserve(count);
+    for (const auto &gpx : gpxs) {
+        ret->m_trackItems.insert(ret->m_trackItems.end(), gpx->m_trackItems.begin(), gpx->m_trackItems.end());
+
+        auto base = (uint32_t) ret->m_text.size();
+        for (auto ref : gpx->m_originalTimestamps) {
+            ref.offset += base;
+            ret->m_originalTimestamps.push_back(ref);
         }
+        ret->m_text += gpx->m_text;
     }
+
+    ret->ComputeDerivedFields();
+    return ret;
 }
 
-void GPX::CreateSegments() {
+Segments GPX::ComputeSegments(const std::vector<TrackItem> &items) {
+    Segments segments;
     std::vector<int> boundaries;
 
-    if (m_trackItems.size() == 0) {
-        return;
+    if (items.size() == 0) {
+        return segments;
     }
 
     boundaries.push_back(0);
 
-    for (size_t i = 1; i < m_trackItems.size(); ++i) {
-        const auto &prevItem = m_trackItems[i - 1];
-        const auto &item = m_trackItems[i];
+    for (size_t i = 1; i < items.size(); ++i) {
+        const auto &prevItem = items[i - 1];
+        const auto &item = items[i];
 
         if (item.Latitude == prevItem.Latitude && item.Longitude == prevItem.Longitude) {
             boundaries.push_back(i);
@@ -205,49 +447,56 @@ void GPX::CreateSegments() {
     auto bs = boundaries.size();
     for (size_t i = 0; i < bs; ++i) {
         int start = boundaries[i];
-        int end = i == bs - 1 ? m_trackItems.size() - 1 : boundaries[i + 1];
+        int end = i == bs - 1 ? items.size() - 1 : boundaries[i + 1];
 
         if (i == bs - 1) {
             if (start < end) {
-                m_segments.push_back(Segment(start, end));
+                segments.push_back(Segment(start, end));
             }
         } else {
             assert(start < end);
-            m_segments.push_back(Segment(start, end));
+            segments.push_back(Segment(start, end));
         }
     }
+
+    return segments;
 }
 
-bool GPX::GetItem(size_t index, TrackItem &item) {
-    if (index >= m_trackItems.size() || index < 0) {
-        return false;
+void GPX::CreateSegments() {
+    if (m_hasCachedSegments) {
+        m_segments = m_cachedSegments;
+    } else {
+        m_segments = ComputeSegments(m_trackItems);
     }
+}
 
-    item = m_trackItems[index];
-    return true;
+const TrackItem *GPX::GetItem(size_t index) const {
+    if (index >= m_trackItems.size()) {
+        return nullptr;
+    }
+
+    return &m_trackItems[index];
 }
 
 // Return the first element i such that i.timestamp <= timestamp < (i+1).timestamp
-bool GPX::GetClosestItem(time_t timestamp, size_t &nextItem, TrackItem &item) {
-    if (nextItem >= m_trackItems.size() || nextItem < 0) {
-        return false;
+const TrackItem *GPX::GetClosestItem(time_t timestamp, size_t &nextItem) const {
+    if (nextItem >= m_trackItems.size()) {
+        return nullptr;
     }
 
     if (timestamp < m_trackItems[nextItem].Timestamp) {
-        return false;
+        return nullptr;
     }
 
-    for (auto i = nextItem; i + 1 < m_trackItems.size(); ++i) {
-        const auto &i1 = m_trackItems[i];
-        const auto &i2 = m_trackItems[i + 1];
-        if (i1.Timestamp <= timestamp && timestamp < i2.Timestamp) {
-            item = i1;
-            nextItem = i;
-            return true;
-        }
+    // Items are sorted by time, so the first item past the timestamp is right after the one we want
+    auto it = std::upper_bound(m_trackItems.begin() + nextItem, m_trackItems.end(), timestamp,
+                               [](time_t ts, const TrackItem &item) { return ts < item.Timestamp; });
+    if (it == m_trackItems.end()) {
+        return nullptr;
     }
 
-    return false;
+    nextItem = (it - m_trackItems.begin()) - 1;
+    return &m_trackItems[nextItem];
 }
 
 } // namespace gpsmap
@@ -0,0 +1,257 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gpsmap/contenthash.h>
+#include <gpsmap/gpx.h>
+#include <gpsmap/mappedfile.h>
+
+// Binary track cache.
+//
+// The file starts with a header, followed by the track items, the segments and
+// the original timestamps, each stored as a packed array. Items are stored after
+// sorting and with all their derived data, except for the total distance, which
+// depends on the files loaded before.
+
+namespace gpsmap {
+
+static const char s_cacheMagic[8] = {'G', 'P', 'S', 'M', 'T', 'R', 'K', 0};
+static const uint32_t s_cacheVersion = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t itemSize;
+
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+
+    uint64_t itemCount;
+    uint64_t segmentCount;
+    uint64_t timestampBytes;
+};
+
+struct CachedTrackItem {
+    int64_t Timestamp;
+    double Latitude;
+    double Longitude;
+    double MercatorX;
+    double MercatorY;
+    double Speed;
+    double Elevation;
+    double DistanceDelta;
+    double Bearing;
+    float Grade;
+    uint32_t IsTrackStart;
+
+    // Location of OriginalTimestamp in the timestamp array
+    uint32_t TimestampOffset;
+    uint32_t TimestampLength;
+};
+
+struct CachedSegment {
+    int32_t first;
+    int32_t second;
+};
+
+std::string GPX::GetCachePath(const std::string &path) {
+    return path + ".gpsmap-cache";
+}
+
+bool GPX::GetSourceInfo(const std::string &path, SourceInfo &source) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        return false;
+    }
+
+    source.size = st.st_size;
+    source.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    source.hash = 0;
+    return true;
+}
+
+uint64_t GPX::HashContents(std::string_view contents) {
+    ContentHash hash;
+    hash.AddBytes(contents.data(), contents.size());
+    return hash.Value();
+}
+
+bool GPX::LoadCache(const std::string &cachePath, const std::string &path, SourceInfo &source) {
+    if (access(cachePath.c_str(), R_OK) < 0) {
+        return false;
+    }
+
+    auto cache = MappedFile::Create(cachePath);
+    if (!cache || cache->Size() < sizeof(CacheHeader)) {
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, cache->Data(), sizeof(header));
+
+    if (memcmp(header.magic, s_cacheMagic, sizeof(s_cacheMagic)) || header.version != s_cacheVersion ||
+        header.itemSize != sizeof(CachedTrackItem) || header.sourceSize != source.size) {
+        return false;
+    }
+
+    auto itemsOffset = sizeof(CacheHeader);
+    auto segmentsOffset = itemsOffset + header.itemCount * sizeof(CachedTrackItem);
+    auto timestampsOffset = segmentsOffset + header.segmentCount * sizeof(CachedSegment);
+    if (header.itemCount == 0 || timestampsOffset + header.timestampBytes != cache->Size()) {
+        std::cerr << "Ignoring corrupted track cache " << cachePath << std::endl;
+        return false;
+    }
+
+    // Files that were copied or touched get a new mtime, check whether their contents changed
+    bool refresh = false;
+    if (header.sourceMtime != source.mtime) {
+        auto file = MappedFile::Create(path);
+        if (!file) {
+            return false;
+        }
+
+        source.hash = HashContents(std::string_view(file->Data(), file->Size()));
+        if (source.hash != header.sourceHash) {
+            return false;
+        }
+        refresh = true;
+    } else {
+        source.hash = header.sourceHash;
+    }
+
+    auto items = (const CachedTrackItem *) (cache->Data() + itemsOffset);
+    auto segments = (const CachedSegment *) (cache->Data() + segmentsOffset);
+    auto timestamps = cache->Data() + timestampsOffset;
+
+    m_trackItems.resize(header.itemCount);
+    m_originalTimestamps.resize(header.itemCount);
+    for (size_t i = 0; i < header.itemCount; ++i) {
+        const auto &ci = items[i];
+        auto &item = m_trackItems[i];
+
+        if ((uint64_t) ci.TimestampOffset + ci.TimestampLength > header.timestampBytes) {
+            std::cerr << "Ignoring corrupted track cache " << cachePath << std::endl;
+            m_trackItems.clear();
+            m_originalTimestamps.clear();
+            return false;
+        }
+
+        item.Timestamp = ci.Timestamp;
+        m_originalTimestamps[i] = {ci.TimestampOffset, ci.TimestampLength};
+        item.Latitude = ci.Latitude;
+        item.Longitude = ci.Longitude;
+        item.MercatorX = ci.MercatorX;
+        item.MercatorY = ci.MercatorY;
+        item.Speed = ci.Speed;
+        item.Elevation = ci.Elevation;
+        item.Grade = ci.Grade;
+        item.DistanceDelta = ci.DistanceDelta;
+        item.TotalDistance = 0.0;
+        item.Bearing = ci.Bearing;
+        item.IsTrackStart = ci.IsTrackStart;
+    }
+
+    m_text.assign(timestamps, header.timestampBytes);
+
+    m_cachedSegments.clear();
+    for (size_t i = 0; i < header.segmentCount; ++i) {
+        m_cachedSegments.push_back(Segment(segments[i].first, segments[i].second));
+    }
+    m_hasCachedSegments = true;
+
+    ComputeTotalDistance();
+
+    if (refresh) {
+        SaveCache(cachePath, source);
+    }
+
+    return true;
+}
+
+bool GPX::SaveCache(const std::string &cachePath, const SourceInfo &source) const {
+    std::vector<CachedTrackItem> items(m_trackItems.size());
+
+    for (size_t i = 0; i < m_trackItems.size(); ++i) {
+        const auto &item = m_trackItems[i];
+        auto &ci = items[i];
+
+        memset(&ci, 0, sizeof(ci));
+        ci.Timestamp = item.Timestamp;
+        ci.Latitude = item.Latitude;
+        ci.Longitude = item.Longitude;
+        ci.MercatorX = item.MercatorX;
+        ci.MercatorY = item.MercatorY;
+        ci.Speed = item.Speed;
+        ci.Elevation = item.Elevation;
+        ci.DistanceDelta = item.DistanceDelta;
+        ci.Bearing = item.Bearing;
+        ci.Grade = item.Grade;
+        ci.IsTrackStart = item.IsTrackStart;
+        ci.TimestampOffset = m_originalTimestamps[i].offset;
+        ci.TimestampLength = m_originalTimestamps[i].length;
+    }
+
+    std::vector<CachedSegment> segments;
+    for (const auto &seg : ComputeSegments(m_trackItems)) {
+        segments.push_back({seg.first, seg.second});
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_cacheMagic, sizeof(s_cacheMagic));
+    header.version = s_cacheVersion;
+    header.itemSize = sizeof(CachedTrackItem);
+    header.sourceSize = source.size;
+    header.sourceMtime = source.mtime;
+    header.sourceHash = source.hash;
+    header.itemCount = items.size();
+    header.segmentCount = segments.size();
+    header.timestampBytes = m_text.size();
+
+    // Write to a temporary file first, so that concurrent runs never see a partial cache
+    auto tmpPath = cachePath + "." + std::to_string(getpid()) + ".tmp";
+    auto fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp) {
+        // The directory may be read-only, the cache is optional
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(items.data(), sizeof(CachedTrackItem), items.size(), fp) == items.size();
+    ok = ok && fwrite(segments.data(), sizeof(CachedSegment), segments.size(), fp) == segments.size();
+    ok = ok && fwrite(m_text.data(), 1, m_text.size(), fp) == m_text.size();
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || rename(tmpPath.c_str(), cachePath.c_str()) < 0) {
+        std::cerr << "Could not write track cache " << cachePath << std::endl;
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace gpsmap
@@ -0,0 +1,372 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include <gpsmap/jobqueue.h>
+
+// Job files are made of "key value" lines. Files are always written under a temporary name,
+// then renamed, so that other nodes never see a partial one.
+
+namespace fs = boost::filesystem;
+
+namespace gpsmap {
+
+static const char *s_subdirs[] = {"pending", "running", "done", "failed", "videos", "nodes"};
+static const char *s_jobSuffix = ".job";
+
+JobQueue::~JobQueue() {
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_terminated = true;
+    }
+    m_cv.notify_all();
+    if (m_heartbeat.joinable()) {
+        m_heartbeat.join();
+    }
+}
+
+JobQueuePtr JobQueue::Create(const std::string &dir) {
+    for (auto subdir : s_subdirs) {
+        boost::system::error_code ec;
+        fs::create_directories(fs::path(dir) / subdir, ec);
+        if (ec) {
+            std::cerr << "Could not create " << fs::path(dir) / subdir << ": " << ec.message() << std::endl;
+            return nullptr;
+        }
+    }
+    return JobQueuePtr(new JobQueue(dir));
+}
+
+std::string JobQueue::GetPath(const std::string &subdir, const std::string &name) const {
+    return (fs::path(m_dir) / subdir / name).string();
+}
+
+static bool WriteFile(const std::string &path, const std::string &contents) {
+    auto tmpPath = path + ".tmp";
+    {
+        std::ofstream ofs(tmpPath, std::ios::trunc);
+        ofs << contents;
+        if (!ofs) {
+            std::cerr << "Could not write " << tmpPath << std::endl;
+            return false;
+        }
+    }
+
+    if (std::rename(tmpPath.c_str(), path.c_str())) {
+        std::cerr << "Could not rename " << tmpPath << " to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool JobQueue::WriteArguments(const std::vector<std::string> &args) {
+    std::stringstream ss;
+    for (const auto &a : args) {
+        ss << a << "\n";
+    }
+    return WriteFile((fs::path(m_dir) / "args").string(), ss.str());
+}
+
+bool JobQueue::ReadArguments(std::vector<std::string> &args) const {
+    auto path = fs::path(m_dir) / "args";
+    boost::system::error_code ec;
+    if (!fs::exists(path, ec)) {
+        std::cout << "Waiting for the coordinator to write " << path << std::endl;
+        while (!fs::exists(path, ec)) {
+            sleep(1);
+        }
+    }
+
+    std::ifstream ifs(path.string());
+    if (!ifs) {
+        std::cerr << "Could not read " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+        args.push_back(line);
+    }
+    return true;
+}
+
+std::string JobQueue::GetVideoPath(const std::string &output) const {
+    return GetPath("videos", output);
+}
+
+bool JobQueue::WriteJob(const RenderJob &job, const std::string &subdir) {
+    std::stringstream ss;
+    ss << "name " << job.name << "\n";
+    ss << "file " << job.fileSequenceId << "\n";
+    ss << "segment " << job.segmentSequenceId << "\n";
+    ss << "first " << job.firstFrame << "\n";
+    ss << "end " << job.endFrame << "\n";
+    ss << "output " << job.output << "\n";
+    ss << "attempts " << job.attempts << "\n";
+    for (const auto &n : job.failedNodes) {
+        ss << "failed " << n << "\n";
+    }
+    return WriteFile(GetPath(subdir, job.name + s_jobSuffix), ss.str());
+}
+
+bool JobQueue::ReadJob(const std::string &path, RenderJob &job) {
+    std::ifstream ifs(path);
+    if (!ifs) {
+        // Another node moved it away
+        return false;
+    }
+
+    job = RenderJob();
+    std::string line;
+    while (std::getline(ifs, line)) {
+        auto space = line.find(' ');
+        if (space == std::string::npos) {
+            continue;
+        }
+        auto key = line.substr(0, space);
+        auto value = line.substr(space + 1);
+        if (key == "name") {
+            job.name = value;
+        } else if (key == "file") {
+            job.fileSequenceId = atoi(value.c_str());
+        } else if (key == "segment") {
+            job.segmentSequenceId = atoi(value.c_str());
+        } else if (key == "first") {
+            job.firstFrame = atoll(value.c_str());
+        } else if (key == "end") {
+            job.endFrame = atoll(value.c_str());
+        } else if (key == "output") {
+            job.output = value;
+        } else if (key == "attempts") {
+            job.attempts = atoi(value.c_str());
+        } else if (key == "failed") {
+            job.failedNodes.push_back(value);
+        }
+    }
+
+    if (job.name.empty() || job.output.empty()) {
+        std::cerr << "Invalid job file " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Returns the sorted names of the files of dir that end with suffix, without their temporary files
+static std::vector<std::string> ListFiles(const fs::path &dir, const std::string &suffix) {
+    std::vector<std::string> ret;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        auto name = it->path().filename().string();
+        auto pos = name.find(suffix);
+        auto tmp = name.size() >= 4 && !name.compare(name.size() - 4, 4, ".tmp");
+        if (pos != std::string::npos && !tmp) {
+            ret.push_back(name);
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool JobQueue::Reset() {
+    boost::system::error_code ec;
+    fs::remove(fs::path(m_dir) / "stop", ec);
+    fs::remove(fs::path(m_dir) / "args", ec);
+    for (auto subdir : {"pending", "running", "done", "failed", "videos"}) {
+        // Including the temporary files of interrupted writes
+        std::vector<fs::path> files;
+        for (fs::directory_iterator it(fs::path(m_dir) / subdir, ec), end; !ec && it != end; it.increment(ec)) {
+            files.push_back(it->path());
+        }
+        for (const auto &f : files) {
+            fs::remove(f, ec);
+            if (ec) {
+                std::cerr << "Could not remove " << f << ": " << ec.message() << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool JobQueue::Submit(const RenderJob &job) {
+    return WriteJob(job, "pending");
+}
+
+std::vector<RenderJob> JobQueue::TakeJobs(const std::string &subdir) {
+    std::vector<RenderJob> ret;
+    for (const auto &name : ListFiles(fs::path(m_dir) / subdir, s_jobSuffix)) {
+        auto path = GetPath(subdir, name);
+        RenderJob job;
+        if (ReadJob(path, job)) {
+            ret.push_back(job);
+        }
+        boost::system::error_code ec;
+        fs::remove(path, ec);
+    }
+    return ret;
+}
+
+std::vector<RenderJob> JobQueue::TakeDone() {
+    return TakeJobs("done");
+}
+
+std::vector<RenderJob> JobQueue::TakeFailed() {
+    return TakeJobs("failed");
+}
+
+std::vector<std::string> JobQueue::GetLiveNodes(int timeout) const {
+    std::vector<std::string> ret;
+    auto now = time(nullptr);
+    for (const auto &node : ListFiles(fs::path(m_dir) / "nodes", "")) {
+        boost::system::error_code ec;
+        auto t = fs::last_write_time(GetPath("nodes", node), ec);
+        if (!ec && now - t <= timeout) {
+            ret.push_back(node);
+        }
+    }
+    return ret;
+}
+
+void JobQueue::FailStaleJobs(int timeout) {
+    auto live = GetLiveNodes(timeout);
+    for (const auto &name : ListFiles(fs::path(m_dir) / "running", s_jobSuffix)) {
+        // name.job.node
+        auto pos = name.find(std::string(s_jobSuffix) + ".");
+        if (pos == std::string::npos) {
+            continue;
+        }
+        auto node = name.substr(pos + strlen(s_jobSuffix) + 1);
+        if (std::find(live.begin(), live.end(), node) != live.end()) {
+            continue;
+        }
+
+        RenderJob job;
+        auto path = GetPath("running", name);
+        if (ReadJob(path, job)) {
+            std::cerr << "Node " << node << " stopped responding, giving up on its job " << job.name << std::endl;
+            Fail(job, node);
+        }
+    }
+}
+
+void JobQueue::Stop() {
+    // Workers that start later wait for the next run instead of building the segments of this one
+    boost::system::error_code ec;
+    fs::remove(fs::path(m_dir) / "args", ec);
+    if (ec) {
+        std::cerr << "Could not remove " << fs::path(m_dir) / "args" << ": " << ec.message() << std::endl;
+    }
+    WriteFile((fs::path(m_dir) / "stop").string(), "");
+}
+
+bool JobQueue::Claim(const std::string &node, int timeout, RenderJob &job) {
+    std::vector<std::string> live;
+    bool liveNodesRead = false;
+
+    for (const auto &name : ListFiles(fs::path(m_dir) / "pending", s_jobSuffix)) {
+        auto path = GetPath("pending", name);
+        if (!ReadJob(path, job)) {
+            continue;
+        }
+
+        const auto &failed = job.failedNodes;
+        if (std::find(failed.begin(), failed.end(), node) != failed.end()) {
+            if (!liveNodesRead) {
+                live = GetLiveNodes(timeout);
+                liveNodesRead = true;
+            }
+            auto other = std::find_if(live.begin(), live.end(), [&](const std::string &n) {
+                return std::find(failed.begin(), failed.end(), n) == failed.end();
+            });
+            if (other != live.end()) {
+                continue;
+            }
+        }
+
+        // Only one node wins the rename
+        auto claimed = GetPath("running", name + "." + node);
+        if (!std::rename(path.c_str(), claimed.c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobQueue::StartHeartbeat(const std::string &node, int interval) {
+    auto path = GetPath("nodes", node);
+    auto beat = [path] {
+        boost::system::error_code ec;
+        if (!fs::exists(path, ec)) {
+            std::ofstream ofs(path);
+        }
+        fs::last_write_time(path, time(nullptr), ec);
+    };
+
+    // The node must look alive before it claims its first job
+    beat();
+
+    m_heartbeat = std::thread([this, beat, interval] {
+        std::unique_lock<std::mutex> lock(m_lock);
+        while (!m_cv.wait_for(lock, std::chrono::seconds(interval), [this] { return m_terminated; })) {
+            beat();
+        }
+    });
+}
+
+bool JobQueue::Complete(const RenderJob &job, const std::string &node) {
+    auto claimed = GetPath("running", job.name + s_jobSuffix + "." + node);
+    auto done = GetPath("done", job.name + s_jobSuffix);
+    return !std::rename(claimed.c_str(), done.c_str());
+}
+
+bool JobQueue::Fail(const RenderJob &job, const std::string &node) {
+    auto claimed = GetPath("running", job.name + s_jobSuffix + "." + node);
+    if (!fs::exists(claimed)) {
+        return false;
+    }
+
+    auto failed = job;
+    if (std::find(failed.failedNodes.begin(), failed.failedNodes.end(), node) == failed.failedNodes.end()) {
+        failed.failedNodes.push_back(node);
+    }
+    if (!WriteJob(failed, "failed")) {
+        return false;
+    }
+
+    boost::system::error_code ec;
+    fs::remove(claimed, ec);
+    return true;
+}
+
+bool JobQueue::Stopped() const {
+    boost::system::error_code ec;
+    return fs::exists(fs::path(m_dir) / "stop", ec);
+}
+
+} // namespace gpsmap
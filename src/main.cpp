@@ -19,20 +19,37 @@
 // SOFTWARE.
 
 #include <atomic>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <unordered_set>
 #include <vector>
 
+#include <unistd.h>
+
 #include <boost/filesystem.hpp>
 
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
 #include <OpenImageIO/imageio.h>
 
+#include <gpsmap/downloader.h>
 #include <gpsmap/encoder.h>
+#include <gpsmap/framerenderer.h>
 #include <gpsmap/gpx.h>
+#include <gpsmap/jobqueue.h>
+#include <gpsmap/manifest.h>
 #include <gpsmap/mapgen.h>
+#include <gpsmap/metrics.h>
+#include <gpsmap/prefetcher.h>
+#include <gpsmap/remux.h>
 #include <gpsmap/resources.h>
+#include <gpsmap/scheduler.h>
 #include <gpsmap/tilemanager.h>
+#include <gpsmap/tilestore.h>
+#include <gpsmap/trackindex.h>
 
 OIIO_NAMESPACE_USING
 
@@ -41,11 +58,87 @@ using namespace gpsmap;
 struct Arguments {
     boost::filesystem::path ResourceDir;
     std::string TilesRootPath;
+    // See ITileStore::Types
+    std::string TileStore = "dir";
+    // Directory of tiles laid out as z/x/y.png to add to the store first
+    std::string ImportTilesPath;
     std::string InputVideoPath;
     boost::filesystem::path OutputDirectory;
     std::vector<std::string> InputGPXPaths;
+    int PrefetchThreads = 4;
+    // Zoom levels of the maps, the last one is the most detailed, see GetZoomLevels()
+    std::vector<int> Zooms = {5, 7, 11, 16};
+    // Only download the tiles of the tracks, within SeedMargin tiles of them
+    bool SeedOnly = false;
+    int SeedMargin = 1;
+    int TileCacheMB = 1024;
+    // Zoom levels below a missing tile that it may be built from, see TileManager::SetSynthesisLevels()
+    int SynthesizeLevels = 0;
+    int MapCacheMB = 256;
+    // Segments encoded concurrently, 0 to fit the cores
+    int Jobs = 0;
+    // Segments longer than this are encoded in chunks, 0 to encode each segment at once
+    int ChunkSeconds = 0;
+    // Skip the videos whose inputs did not change since they were encoded, see OutputManifest
+    bool Incremental = true;
+    // Job directory shared with the workers of other nodes, see JobQueue
+    std::string CoordinatorDir;
+    std::string WorkerDir;
+    // Name of this worker, defaults to the host name and the process id
+    std::string Node;
+    // Jobs that failed this many times are given up
+    int MaxAttempts = 3;
+    // Workers that did not send a heartbeat for this many seconds are considered gone
+    int NodeTimeout = 60;
+    bool TrackCache = true;
+    // Written every MetricsInterval seconds when set
+    std::string MetricsPath;
+    int MetricsInterval = 10;
+    // Written at the end when set
+    std::string TracePath;
+    // Drawn over each other in this order
+    std::vector<std::string> Layers = {"map", "date", "stats"};
+    Downloader::Params Download;
+    VideoEncoder::Params Encoder;
 };
 
+static bool ParseLayers(const std::string &str, std::vector<std::string> &layers) {
+    layers.clear();
+    std::stringstream ss(str);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        auto names = FrameRenderer::LayerNames;
+        for (; *names && name != *names; ++names) {
+        }
+        if (!*names) {
+            std::cerr << "Unknown layer " << name << ", available layers:";
+            for (names = FrameRenderer::LayerNames; *names; ++names) {
+                std::cerr << " " << *names;
+            }
+            std::cerr << "\n";
+            return false;
+        }
+        layers.push_back(name);
+    }
+    return true;
+}
+
+static bool ParseZooms(const std::string &str, std::vector<int> &zooms) {
+    zooms.clear();
+    std::stringstream ss(str);
+    std::string zoom;
+    while (std::getline(ss, zoom, ',')) {
+        char *end;
+        auto z = strtol(zoom.c_str(), &end, 10);
+        if (zoom.empty() || *end || z < 0 || z > 24) {
+            std::cerr << "Invalid zoom level " << zoom << ", zoom levels are between 0 and 24\n";
+            return false;
+        }
+        zooms.push_back(z);
+    }
+    return !zooms.empty();
+}
+
 static bool ParseCommandLine(int argc, char **argv, Arguments &args) {
     for (auto i = 1; i + 1 < argc; i += 2) {
         if (!strcmp(argv[i], "-gpx")) {
@@ -64,34 +157,112 @@ static bool ParseCommandLine(int argc, char **argv, Arguments &args) {
             }
         } else if (!strcmp(argv[i], "-tiles")) {
             args.TilesRootPath = argv[i + 1];
+        } else if (!strcmp(argv[i], "-tile-store")) {
+            auto types = ITileStore::Types;
+            for (; *types && strcmp(*types, argv[i + 1]); ++types) {
+            }
+            if (!*types) {
+                std::cerr << "Unknown tile store " << argv[i + 1] << ", available stores:";
+                for (types = ITileStore::Types; *types; ++types) {
+                    std::cerr << " " << *types;
+                }
+                std::cerr << "\n";
+                return false;
+            }
+            args.TileStore = argv[i + 1];
+        } else if (!strcmp(argv[i], "-import-tiles")) {
+            args.ImportTilesPath = argv[i + 1];
+        } else if (!strcmp(argv[i], "-zooms")) {
+            if (!ParseZooms(argv[i + 1], args.Zooms)) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-seed-only")) {
+            args.SeedOnly = atoi(argv[i + 1]) != 0;
+        } else if (!strcmp(argv[i], "-seed-margin")) {
+            args.SeedMargin = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-prefetch-threads")) {
+            args.PrefetchThreads = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-synthesize-tiles")) {
+            args.SynthesizeLevels = std::max(0, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-tile-cache-mb")) {
+            args.TileCacheMB = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-map-cache-mb")) {
+            args.MapCacheMB = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-track-cache")) {
+            args.TrackCache = atoi(argv[i + 1]) != 0;
+        } else if (!strcmp(argv[i], "-jobs")) {
+            args.Jobs = std::max(0, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-chunk-seconds")) {
+            args.ChunkSeconds = std::max(0, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-incremental")) {
+            args.Incremental = atoi(argv[i + 1]) != 0;
+        } else if (!strcmp(argv[i], "-coordinator")) {
+            args.CoordinatorDir = argv[i + 1];
+        } else if (!strcmp(argv[i], "-worker")) {
+            args.WorkerDir = argv[i + 1];
+        } else if (!strcmp(argv[i], "-node")) {
+            args.Node = argv[i + 1];
+        } else if (!strcmp(argv[i], "-max-attempts")) {
+            args.MaxAttempts = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-node-timeout")) {
+            args.NodeTimeout = std::max(10, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-encoder-threads")) {
+            args.Encoder.encoderThreads = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-render-threads")) {
+            args.Encoder.renderThreads = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-encoder")) {
+            auto backends = VideoEncoder::GetBackends();
+            if (std::find(backends.begin(), backends.end(), argv[i + 1]) == backends.end()) {
+                std::cerr << "Unknown encoder " << argv[i + 1] << ", available encoders:";
+                for (const auto &b : backends) {
+                    std::cerr << " " << b;
+                }
+                std::cerr << "\n";
+                return false;
+            }
+            args.Encoder.backend = argv[i + 1];
+        } else if (!strcmp(argv[i], "-hwdevice")) {
+            args.Encoder.device = argv[i + 1];
+        } else if (!strcmp(argv[i], "-bitrate")) {
+            args.Encoder.bitrate = std::max(1, atoi(argv[i + 1])) * 1000;
+        } else if (!strcmp(argv[i], "-layers")) {
+            if (!ParseLayers(argv[i + 1], args.Layers)) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-metrics")) {
+            args.MetricsPath = argv[i + 1];
+        } else if (!strcmp(argv[i], "-metrics-interval")) {
+            args.MetricsInterval = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-trace")) {
+            args.TracePath = argv[i + 1];
+        } else if (!strcmp(argv[i], "-max-downloads")) {
+            args.Download.maxTransfers = std::max(1, atoi(argv[i + 1]));
+        } else if (!strcmp(argv[i], "-download-retries")) {
+            args.Download.maxRetries = atoi(argv[i + 1]);
         } else {
             std::cerr << "Invalid argument " << i << ": " << argv[i] << "\n";
             return false;
         }
     }
 
-    return args.InputGPXPaths.size() > 0 && args.OutputDirectory.size() > 0 && args.InputGPXPaths.size() > 0 &&
-           args.ResourceDir.size() > 0;
-}
-
-static inline uint32_t rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
-    return (a << 24) | (r << 16) | (g << 8) | b;
-}
-
-// TODO: use imagebuf for that
-void ClearFrame(VideoEncoder &encoder, OutputStream &os) {
-    int width = encoder.Width();
-    int height = encoder.Height();
+    // Workers get their videos from the coordinator
+    if (args.WorkerDir.size() > 0) {
+        return args.CoordinatorDir.empty() && args.InputGPXPaths.size() > 0 && args.ResourceDir.size() > 0 &&
+               args.TilesRootPath.size() > 0;
+    }
 
-    auto pict = os.tmp_frame;
-    int ls = pict->linesize[0] / sizeof(uint32_t);
-    uint32_t *pixels = (uint32_t *) pict->data[0];
+    // Importing tiles does not need anything else
+    if (args.InputGPXPaths.empty() && args.ImportTilesPath.size() > 0) {
+        return args.TilesRootPath.size() > 0;
+    }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            pixels[y * ls + x] = rgba(0, 0, 0, 0xff);
-        }
+    // Nor does seeding need videos
+    if (args.SeedOnly) {
+        return args.InputGPXPaths.size() > 0 && args.ResourceDir.size() > 0 && args.TilesRootPath.size() > 0;
     }
+
+    return args.InputGPXPaths.size() > 0 && args.OutputDirectory.size() > 0 && args.InputGPXPaths.size() > 0 &&
+           args.ResourceDir.size() > 0;
 }
 
 struct GeoCoords {
@@ -99,60 +270,111 @@ struct GeoCoords {
     double Longitude;
 };
 
+static const int s_videoWidth = 512;
+static const int s_videoHeight = 512;
+static const int s_fps = 25;
+
+// Chunks of a segment that are encoded separately, then joined into the video of the segment
+struct SegmentChunks {
+    boost::filesystem::path videoPath;
+    std::vector<std::string> parts;
+
+    std::mutex lock;
+    int remaining;
+    bool failed = false;
+};
+
+using SegmentChunksPtr = std::shared_ptr<SegmentChunks>;
+
 struct EncodingParams {
     TileManagerPtr tiles;
     ResourcesPtr resources;
     gpsmap::GPXPtr gpx;
     gpsmap::Segment seg;
     gpsmap::GPXPtr wholeTrack;
+    ComposedTileCachePtr composedTiles;
+    SegmentSchedulerPtr scheduler;
     int segmentSequenceId;
     int fileSequenceId;
     GeoCoords startMarker;
     GeoCoords endMarker;
     boost::filesystem::path OutputDirectory;
+    VideoEncoder::Params encoder;
+    std::vector<std::string> layers;
+    std::vector<int> zooms;
+
+    // Frames [firstFrame, endFrame) of the segment are rendered, from samples if set
+    GeoSamplesPtr samples;
+    int64_t firstFrame = 0;
+    int64_t endFrame = std::numeric_limits<int64_t>::max();
+
+    // Set when encoding one chunk of the segment
+    SegmentChunksPtr chunks;
+    int chunkIndex = 0;
+
+    // The video is recorded in the manifest with this hash once it is encoded
+    OutputManifestPtr manifest;
+    uint64_t inputHash = 0;
 };
 
+// Generator state of one render thread
 struct FrameState {
-    LabelGeneratorPtr labelGen;
-    GeoTrackerPtr geoTracker;
-    MapSwitcherPtr mapSwitcher;
-    bool failed;
-    const EncodingParams *params;
+    FrameRendererPtr renderer;
+    // Shared by all render threads of the segment
+    std::atomic_bool *failed;
+    // Frame of the segment that is encoded first, and the end of the range
+    int64_t firstFrame;
+    int64_t endFrame;
+    // Shared by all render threads of the video
+    ProgressPtr progress;
 };
 
-std::atomic_uint g_processedFrames(0);
+using FrameStatePtr = std::shared_ptr<FrameState>;
+
+static auto &s_renderedFrames = Metrics::GetCounter("frames.rendered");
+static auto &s_unchangedFrames = Metrics::GetCounter("frames.unchanged");
 
-bool GenerateFrame(VideoEncoder &encoder, OutputStream &os, FrameState &state) {
-    auto frame_index = os.next_pts;
+bool GenerateFrame(VideoEncoder &encoder, AVFrame *frame, FrameInfo &info, FrameState &state) {
+    auto frame_index = state.firstFrame + info.index;
+    auto fps = encoder.GetFPS();
 
-    ++g_processedFrames;
+    if (frame_index >= state.endFrame) {
+        return false;
+    }
 
-    ClearFrame(encoder, os);
+    s_renderedFrames.Add();
+    state.progress->Add();
 
     int width = encoder.Width();
     int height = encoder.Height();
-    auto pixels = os.GetPixels();
-
-    ImageBuf ib(ImageSpec(width, height, 4), pixels);
 
-    if (!state.geoTracker->Generate(ib, frame_index, encoder.GetFPS())) {
+    ROI damage;
+    if (!state.renderer->Render(frame_index, fps, damage)) {
+        if (state.renderer->Failed()) {
+            *state.failed = true;
+        }
         return false;
     }
 
-    if (!state.mapSwitcher->Generate(ib, frame_index, encoder.GetFPS())) {
-        state.failed = true;
-        return false;
+    // When stopped, the frame often looks exactly like the previous one
+    if (damage.ybegin >= damage.yend || damage.xbegin >= damage.xend) {
+        info.unchanged = true;
+        s_unchangedFrames.Add();
+        return true;
     }
 
-    if (!state.labelGen->Generate(ib, frame_index, encoder.GetFPS())) {
-        state.failed = true;
-        return false;
+    // The render slot holds an older frame, make all of it current
+    const auto &canvas = state.renderer->GetCanvas();
+    for (int y = 0; y < height; ++y) {
+        memcpy(frame->data[0] + y * frame->linesize[0], canvas.pixeladdr(0, y), width * 4);
     }
 
+    info.damageBegin = std::max(0, damage.ybegin);
+    info.damageEnd = std::min(height, damage.yend);
     return true;
 }
 
-static std::string StripSpecialCharacters(const std::string &str) {
+static std::string StripSpecialCharacters(std::string_view str) {
     std::stringstream ss;
     for (auto c : str) {
         if (c == ':') {
@@ -163,190 +385,974 @@ static std::string StripSpecialCharacters(const std::string &str) {
     return ss.str();
 }
 
-using ZoomedMaps = std::vector<std::pair<MapImageGeneratorPtr, int>>;
+// The maps of long segments cycle through the zoom levels, the last one is shown longer
+static ZoomLevels GetZoomLevels(time_t segmentDuration, const std::vector<int> &zooms) {
+    ZoomLevels ret;
 
-static std::vector<std::string> s_filesWithErrors;
+    // Round robin zoom
+    if (segmentDuration > 120) {
+        // Don't cycle through short segments.
+        // It's easier to do video synchronization with a precise map at all times.
+        for (size_t i = 0; i + 1 < zooms.size(); ++i) {
+            ret.push_back({zooms[i], 5});
+        }
+    }
 
-static Markers GetMarkers(EncodingParams &p) {
-    Markers markers;
+    ret.push_back({zooms.back(), 60});
+    return ret;
+}
 
-    // Start marker
-    {
-        Marker m;
-        m.Image = &p.resources->Start();
-        m.Latitude = p.startMarker.Latitude;
-        m.Longitude = p.startMarker.Longitude;
+static std::vector<int> GetZooms(const ZoomLevels &levels) {
+    std::vector<int> ret;
+    for (const auto &l : levels) {
+        ret.push_back(l.zoom);
+    }
+    return ret;
+}
 
-        auto mw = m.Image->spec().width;
-        auto mh = m.Image->spec().height;
+// Videos that could not be encoded, reported at the end of the run
+class FailedVideos {
+private:
+    std::mutex m_lock;
+    std::vector<std::string> m_files;
 
-        m.x = mw / 2;
-        m.y = mh;
-        markers.push_back(m);
+public:
+    void Add(const std::string &file) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_files.push_back(file);
     }
 
-    // End marker
-    {
-        Marker m;
-        m.Image = &p.resources->Finish();
-        m.Latitude = p.endMarker.Latitude;
-        m.Longitude = p.endMarker.Longitude;
+    std::vector<std::string> Get() {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_files;
+    }
+};
 
-        auto mw = m.Image->spec().width;
+static FailedVideos s_failedVideos;
+
+static FrameStatePtr CreateFrameState(const EncodingParams &p, GeoSamplesPtr samples, int width, int height,
+                                      std::atomic_bool *failed, ProgressPtr progress) {
+    FrameRenderer::Params rp;
+    rp.wholeTrack = p.wholeTrack;
+    rp.samples = samples;
+    rp.tiles = p.tiles;
+    rp.composedTiles = p.composedTiles;
+    rp.resources = p.resources;
+    rp.duration = p.gpx->GetItems()[p.seg.second].Timestamp - p.gpx->GetItems()[p.seg.first].Timestamp;
+    rp.zoomLevels = GetZoomLevels(rp.duration, p.zooms);
+    rp.markers = FrameRenderer::GetMarkers(*p.resources, p.startMarker.Latitude, p.startMarker.Longitude,
+                                           p.endMarker.Latitude, p.endMarker.Longitude);
+    rp.layers = p.layers;
+    rp.width = width;
+    rp.height = height;
+    rp.firstFrame = p.firstFrame;
+
+    auto fs = std::make_shared<FrameState>();
+    fs->renderer = FrameRenderer::Create(rp);
+    fs->failed = failed;
+    fs->progress = progress;
+    fs->firstFrame = p.firstFrame;
+    fs->endFrame = p.endFrame;
+    return fs->renderer ? fs : nullptr;
+}
 
-        m.x = mw / 2;
-        m.y = 0;
-        markers.push_back(m);
+static void PrintStageStats(std::ostream &os, const char *name, const PipelineStageStats &s) {
+    os << "  " << std::setw(8) << std::setfill(' ') << std::left << name << std::right << s.frames << " frames";
+    if (s.reusedFrames) {
+        os << " (" << s.reusedFrames << " reused)";
     }
+    os << ", busy " << std::fixed << std::setprecision(1) << s.busySeconds << "s, input stall " << s.inputStallSeconds
+       << "s, output stall " << s.outputStallSeconds << "s";
+    if (s.capacity) {
+        os << ", queue " << s.averageDepth << "/" << s.capacity;
+    }
+    os << "\n";
+}
+
+static boost::filesystem::path GetVideoPath(const EncodingParams &p) {
+    std::stringstream videoFileName;
+    boost::filesystem::path videoPath(p.OutputDirectory);
 
-    return markers;
+    auto startTime = p.gpx->GetOriginalTimestamp(p.seg.first);
+    videoFileName << std::setw(3) << std::setfill('0') << p.fileSequenceId << "-" << std::setw(3) << std::setfill('0')
+                  << p.segmentSequenceId << " - " << StripSpecialCharacters(startTime) << ".mp4";
+
+    videoPath.append(videoFileName.str());
+    return videoPath;
 }
 
-static void EncodeOneSegment(int unused, EncodingParams &p) {
+// Renders the frames of p into videoPath
+static bool EncodeFrames(EncodingParams &p, GeoSamplesPtr samples, const boost::filesystem::path &videoPath) {
+    std::cout << "Encoding to " << videoPath << std::endl;
+
+    auto name = videoPath.filename().string();
+    TraceSpan span(name.c_str());
 
-    ZoomedMaps zoomedMaps;
+    auto frames = std::min<int64_t>(p.endFrame, samples->Size()) - p.firstFrame;
+    auto progress = Metrics::StartProgress(name, std::max<int64_t>(0, frames));
+
+    std::atomic_bool failed(false);
+
+    // Each render thread gets its own generators, they are cheap compared to the frames they render
+    auto factory = [&]() -> FrameGeneratorCallback {
+        auto fs = CreateFrameState(p, samples, s_videoWidth, s_videoHeight, &failed, progress);
+        if (!fs) {
+            failed = true;
+            return [](VideoEncoder &, AVFrame *, FrameInfo &) { return false; };
+        }
+        return [fs](VideoEncoder &encoder, AVFrame *frame, FrameInfo &info) {
+            return GenerateFrame(encoder, frame, info, *fs);
+        };
+    };
 
-    gpsmap::TrackItem start, end;
-    p.gpx->GetItem(p.seg.first, start);
-    p.gpx->GetItem(p.seg.second, end);
-    std::cout << "Segment start=" << p.seg.first << " end=" << p.seg.second << std::endl;
+    auto encoder = VideoEncoder::Create(videoPath.string(), s_videoWidth, s_videoHeight, s_fps, factory, p.encoder);
+    if (!encoder) {
+        std::cerr << "Could not create encoder for " << videoPath << "\n";
+        return false;
+    }
+
+    // Idle workers render frames of this segment once there are no segments left to start.
+    // They can only join a running pipeline, so the encoder is registered once it started.
+    encoder->EncodeLoop([&] { p.scheduler->AddEncoder(encoder); });
+    p.scheduler->RemoveEncoder(encoder);
+    encoder->Finalize();
+
+    // A stage that is busy while the others stall on it is the bottleneck
+    auto stats = encoder->GetPipelineStats();
+    std::stringstream ss;
+    ss << "Pipeline stats for " << videoPath.filename() << "\n";
+    PrintStageStats(ss, "render", stats.render);
+    PrintStageStats(ss, "convert", stats.convert);
+    PrintStageStats(ss, "encode", stats.encode);
+    std::cout << ss.str();
+
+    if (failed) {
+        std::cerr << "Error while generating map\n";
+        return false;
+    }
+
+    return true;
+}
+
+// Records a video that was encoded successfully
+static void AddToManifest(const EncodingParams &p, const boost::filesystem::path &videoPath) {
+    if (p.manifest) {
+        p.manifest->Set(videoPath.filename().string(), p.inputHash);
+    }
+}
+
+// Called when a chunk is done. The last chunk joins all of them into the video of the segment.
+static void FinishChunk(const EncodingParams &p, bool ok) {
+    auto &chunks = *p.chunks;
+    {
+        std::unique_lock<std::mutex> lock(chunks.lock);
+        chunks.failed |= !ok;
+        if (--chunks.remaining > 0) {
+            return;
+        }
+    }
+
+    if (chunks.failed || !ConcatVideos(chunks.parts, chunks.videoPath.string())) {
+        s_failedVideos.Add(chunks.videoPath.string());
+    } else {
+        std::cout << "Joined " << chunks.parts.size() << " chunks into " << chunks.videoPath << std::endl;
+        AddToManifest(p, chunks.videoPath);
+    }
+
+    for (const auto &part : chunks.parts) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(part, ec);
+    }
+}
+
+static void EncodeOneSegment(EncodingParams &p) {
+    const auto &start = p.gpx->GetItems()[p.seg.first];
+    const auto &end = p.gpx->GetItems()[p.seg.second];
+    std::cout << "Segment start=" << p.seg.first << " end=" << p.seg.second;
+    if (p.chunks) {
+        std::cout << " chunk " << p.chunkIndex + 1 << "/" << p.chunks->parts.size();
+    }
+    std::cout << std::endl;
     std::cout << "  " << start << "\n";
     std::cout << "  " << end << "\n";
 
-    auto duration = end.Timestamp - start.Timestamp;
-    auto largestZoomLevelIndex = 0;
+    // Interpolating the track once lets render threads jump to any frame
+    auto samples = p.samples;
+    if (!samples) {
+        samples = GeoSamples::Create(*p.gpx, p.seg.first, p.seg.second, s_fps);
+    }
 
-    auto overrideCb = [&](int second, int &index) {
-        // show largest zoom level at the beginning or end of a segment, to simplify synchronization
-        if ((second > duration - 40) || (second < 20)) {
-            index = largestZoomLevelIndex;
-            return true;
+    if (p.chunks) {
+        FinishChunk(p, EncodeFrames(p, samples, p.chunks->parts[p.chunkIndex]));
+        return;
+    }
+
+    auto videoPath = GetVideoPath(p);
+    if (!EncodeFrames(p, samples, videoPath)) {
+        s_failedVideos.Add(videoPath.string());
+    } else {
+        AddToManifest(p, videoPath);
+    }
+}
+
+// Bump when a change to the rendering code changes the videos
+static const uint64_t s_renderVersion = 1;
+
+// Returns a hash of every file of the resource directory
+static uint64_t HashResources(const boost::filesystem::path &dir) {
+    std::vector<boost::filesystem::path> files;
+    for (const auto &e : boost::filesystem::recursive_directory_iterator(dir)) {
+        if (boost::filesystem::is_regular_file(e.path())) {
+            files.push_back(e.path());
         }
-        return false;
-    };
+    }
+    std::sort(files.begin(), files.end());
+
+    ContentHash hash;
+    std::vector<char> buffer(1 << 16);
+    for (const auto &f : files) {
+        hash.AddString(boost::filesystem::relative(f, dir).string());
+        std::ifstream ifs(f.string(), std::ios::binary);
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0) {
+            hash.AddBytes(buffer.data(), ifs.gcount());
+        }
+    }
+    return hash.Value();
+}
 
-    FrameState fs;
-    fs.params = &p;
-    fs.failed = false;
-    fs.geoTracker = GeoTracker::Create(p.gpx, p.seg.first, p.seg.second);
-    fs.labelGen = LabelGenerator::Create(fs.geoTracker, p.resources->GetFontPath().string());
+// Returns a hash of everything that the video of a segment depends on, except the tiles,
+// which are not expected to change. resourcesHash is the result of HashResources().
+static uint64_t HashInputs(const EncodingParams &p, int chunkSeconds, uint64_t resourcesHash, TrackIndex &trackIndex) {
+    ContentHash hash;
+    hash.AddValue(s_renderVersion);
+    hash.AddValue(resourcesHash);
+
+    hash.AddValue(s_videoWidth);
+    hash.AddValue(s_videoHeight);
+    hash.AddValue(s_fps);
+    hash.AddValue(VideoEncoder::GopSize);
+    hash.AddString(p.encoder.backend);
+    hash.AddValue(p.encoder.bitrate);
+    hash.AddValue(p.encoder.encoderThreads);
+    hash.AddValue(chunkSeconds);
+    for (const auto &l : p.layers) {
+        hash.AddString(l);
+    }
 
-    auto markers = GetMarkers(p);
+    // Items of the segment, which include the distance of the previous files
+    const auto &items = p.gpx->GetItems();
+    hash.AddString(p.gpx->GetOriginalTimestamp(p.seg.first));
+    for (auto i = p.seg.first; i <= p.seg.second; ++i) {
+        const auto &item = items[i];
+        hash.AddValue((int64_t) item.Timestamp);
+        hash.AddValue(item.Latitude);
+        hash.AddValue(item.Longitude);
+        hash.AddValue(item.Speed);
+        hash.AddValue(item.Elevation);
+        hash.AddValue(item.TotalDistance);
+        hash.AddValue(item.Bearing);
+        hash.AddValue(item.Grade);
+        hash.AddValue(item.IsTrackStart);
+    }
 
-    // Round robin zoom
-    if (duration > 120) {
-        // Don't cycle through short segments.
-        // It's easier to do video synchronization with a precise map at all times.
-        MapImageGenerator::Params p1 = {p.wholeTrack, fs.geoTracker, p.tiles, p.resources, 5, markers};
-        MapImageGenerator::Params p2 = {p.wholeTrack, fs.geoTracker, p.tiles, p.resources, 7, markers};
-        MapImageGenerator::Params p3 = {p.wholeTrack, fs.geoTracker, p.tiles, p.resources, 11, markers};
+    hash.AddValue(p.startMarker.Latitude);
+    hash.AddValue(p.startMarker.Longitude);
+    hash.AddValue(p.endMarker.Latitude);
+    hash.AddValue(p.endMarker.Longitude);
 
-        zoomedMaps.push_back(std::make_pair(MapImageGenerator::Create(p1), 5));
-        zoomedMaps.push_back(std::make_pair(MapImageGenerator::Create(p2), 5));
-        zoomedMaps.push_back(std::make_pair(MapImageGenerator::Create(p3), 5));
+    auto duration = items[p.seg.second].Timestamp - items[p.seg.first].Timestamp;
+    auto levels = GetZoomLevels(duration, p.zooms);
+    for (const auto &l : levels) {
+        hash.AddValue(l.zoom);
+        hash.AddValue(l.duration);
     }
 
-    MapImageGenerator::Params p4 = {p.wholeTrack, fs.geoTracker, p.tiles, p.resources, 16, markers};
-    zoomedMaps.push_back(std::make_pair(MapImageGenerator::Create(p4), 60));
-    largestZoomLevelIndex = zoomedMaps.size() - 1;
+    // The maps also draw the parts of the whole track that are around the segment
+    for (const auto &t : TilePrefetcher::GetTrackTiles(*p.tiles, *p.gpx, p.seg.first, p.seg.second, GetZooms(levels))) {
+        auto level = trackIndex.GetLevel(t.z);
+        hash.AddValue(t.x);
+        hash.AddValue(t.y);
+        hash.AddValue(t.z);
+        for (auto s : TrackIndex::GetSegments(*level, t.x, t.y, t.x, t.y)) {
+            const auto &a = level->points[s - 1];
+            const auto &b = level->points[s];
+            hash.AddValue(a.x);
+            hash.AddValue(a.y);
+            hash.AddValue(b.x);
+            hash.AddValue(b.y);
+        }
+    }
 
-    std::stringstream videoFileName;
-    boost::filesystem::path videoPath(p.OutputDirectory);
+    return hash.Value();
+}
 
-    videoFileName << std::setw(3) << std::setfill('0') << p.fileSequenceId << "-" << std::setw(3) << std::setfill('0')
-                  << p.segmentSequenceId << " - " << StripSpecialCharacters(start.OriginalTimestamp) << ".mp4";
+// Drops the segments whose video is already in the output directory. Videos are matched by the hash
+// of their inputs, so a video that was encoded under another name, e.g. because a GPX file was added
+// before it, is renamed instead of being encoded again.
+static std::vector<EncodingParams> SkipUnchangedSegments(const std::vector<EncodingParams> &segments,
+                                                         OutputManifest &manifest) {
+    std::vector<EncodingParams> ret;
+    std::unordered_set<std::string> kept;
+    std::unordered_set<std::string> moved;
+    std::vector<std::pair<std::string, const EncodingParams *>> renames;
+
+    for (const auto &p : segments) {
+        auto videoPath = GetVideoPath(p);
+        auto name = videoPath.filename().string();
+        uint64_t hash;
+        if (manifest.Get(name, hash) && hash == p.inputHash && boost::filesystem::exists(videoPath)) {
+            kept.insert(name);
+        }
+    }
 
-    videoPath.append(videoFileName.str());
+    for (const auto &p : segments) {
+        auto name = GetVideoPath(p).filename().string();
+        if (kept.count(name)) {
+            continue;
+        }
 
-    std::cout << "Encoding to " << videoPath << std::endl;
+        auto source = manifest.Find(p.inputHash);
+        if (!source.empty() && !kept.count(source) && !moved.count(source) &&
+            boost::filesystem::exists(p.OutputDirectory / source)) {
+            moved.insert(source);
+            renames.push_back({source, &p});
+            continue;
+        }
 
-    fs.mapSwitcher = MapSwitcher::Create(fs.geoTracker, overrideCb);
-    for (auto m : zoomedMaps) {
-        fs.mapSwitcher->AddMapGenerator(m.first, m.second);
+        // A partial video must not be found in the manifest if the encoding is interrupted
+        manifest.Remove(name);
+        ret.push_back(p);
     }
 
-    auto cb = std::bind(&GenerateFrame, std::placeholders::_1, std::placeholders::_2, fs);
-    auto encoder = VideoEncoder::Create(videoPath.string(), 512, 512, 25, cb);
-    if (!encoder) {
+    // Videos that can't be renamed are encoded again
+    auto reencode = [&](const EncodingParams &p, const boost::filesystem::path &from,
+                        const boost::system::error_code &ec) {
+        auto to = GetVideoPath(p);
+        std::cerr << "Could not rename " << from << " to " << to.filename() << ": " << ec.message() << std::endl;
+        manifest.Remove(to.filename().string());
+        ret.push_back(p);
+    };
+
+    // Videos may swap names, move all of them out of the way first
+    std::vector<const std::pair<std::string, const EncodingParams *> *> moving;
+    for (const auto &r : renames) {
+        auto from = r.second->OutputDirectory / r.first;
+        boost::system::error_code ec;
+        manifest.Remove(r.first);
+        boost::filesystem::rename(from, from.string() + ".moving", ec);
+        if (ec) {
+            reencode(*r.second, from, ec);
+            continue;
+        }
+        moving.push_back(&r);
+    }
+
+    for (auto r : moving) {
+        auto from = boost::filesystem::path((r->second->OutputDirectory / r->first).string() + ".moving");
+        auto to = GetVideoPath(*r->second);
+        std::cout << "Renaming " << r->first << " to " << to.filename() << std::endl;
+        boost::system::error_code ec;
+        boost::filesystem::rename(from, to, ec);
+        if (ec) {
+            reencode(*r->second, from, ec);
+            boost::filesystem::remove(from, ec);
+            continue;
+        }
+        AddToManifest(*r->second, to);
+    }
+
+    std::cout << "Keeping " << segments.size() - ret.size() << " videos whose inputs did not change, " << ret.size()
+              << " to encode" << std::endl;
+    return ret;
+}
+
+using FrameRange = std::pair<int64_t, int64_t>;
+
+// Returns the frames [first, end) of each chunk of a segment of the given number of frames
+static std::vector<FrameRange> GetChunks(int64_t frames, int chunkSeconds) {
+    // Chunks start with a key frame, so make them whole GOPs to keep the key frames where
+    // the encoder would have put them in a single stream
+    const int64_t gop = VideoEncoder::GopSize;
+    auto chunkFrames = ((int64_t) chunkSeconds * s_fps + gop - 1) / gop * gop;
+
+    std::vector<FrameRange> ret;
+    for (int64_t first = 0; first < frames; first += chunkFrames) {
+        ret.push_back({first, std::min(frames, first + chunkFrames)});
+    }
+    return ret;
+}
+
+// Splits a long segment into chunks that are encoded concurrently
+static void SubmitChunks(SegmentScheduler &scheduler, const EncodingParams &p, int chunkSeconds) {
+    auto samples = GeoSamples::Create(*p.gpx, p.seg.first, p.seg.second, s_fps);
+    auto ranges = GetChunks(samples->Size(), chunkSeconds);
+    int64_t count = ranges.size();
+
+    if (count <= 1) {
+        auto q = p;
+        q.samples = samples;
+        scheduler.Submit((double) samples->Size() / s_fps, [q]() mutable { EncodeOneSegment(q); });
         return;
     }
 
-    encoder->EncodeLoop();
-    encoder->Finalize();
+    auto chunks = std::make_shared<SegmentChunks>();
+    chunks->videoPath = GetVideoPath(p);
+    chunks->remaining = count;
+    for (int64_t i = 0; i < count; ++i) {
+        chunks->parts.push_back(chunks->videoPath.string() + ".part" + std::to_string(i) + ".mp4");
+    }
 
-    if (fs.failed) {
-        std::cerr << "Error while generating map\n";
-        s_filesWithErrors.push_back(videoPath.string());
+    for (int64_t i = 0; i < count; ++i) {
+        auto q = p;
+        q.samples = samples;
+        q.firstFrame = ranges[i].first;
+        q.endFrame = ranges[i].second;
+        q.chunks = chunks;
+        q.chunkIndex = i;
+        scheduler.Submit((double) (q.endFrame - q.firstFrame) / s_fps, [q]() mutable { EncodeOneSegment(q); });
+    }
+}
+
+// Returns the tiles that the maps of all the segments need.
+// Segments are encoded concurrently, so interleave their tiles
+// in order to fetch the beginning of each segment first.
+static TileDescs GetTracksTiles(const TileManager &tiles, const std::vector<GPXPtr> &gpxs,
+                                const std::vector<int> &zooms, int margin) {
+    std::vector<TileDescs> segmentTiles;
+    for (auto gpx : gpxs) {
+        for (const auto &seg : gpx->GetSegments()) {
+            auto duration = gpx->GetItems()[seg.second].Timestamp - gpx->GetItems()[seg.first].Timestamp;
+            auto segmentZooms = GetZooms(GetZoomLevels(duration, zooms));
+            segmentTiles.push_back(
+                TilePrefetcher::GetTrackTiles(tiles, *gpx, seg.first, seg.second, segmentZooms, margin));
+        }
+    }
+
+    // Segments share tiles, only keep the first occurrence
+    TileDescs ret;
+    std::unordered_set<TileDesc> seen;
+    for (size_t i = 0, added = 1; added; ++i) {
+        added = 0;
+        for (const auto &st : segmentTiles) {
+            if (i < st.size()) {
+                if (seen.insert(st[i]).second) {
+                    ret.push_back(st[i]);
+                }
+                ++added;
+            }
+        }
+    }
+
+    return ret;
+}
+
+// Downloads and decodes the given tiles, then reports how many of them are available at each zoom level
+static bool SeedTiles(TileManager &tiles, TilePrefetcher &prefetcher, const TileDescs &descs) {
+    std::cout << "Seeding " << descs.size() << " tiles" << std::endl;
+    prefetcher.Enqueue(descs);
+    while (!prefetcher.WaitUntilIdle(std::chrono::seconds(5))) {
+        std::cout << prefetcher.Fetched() << " of " << descs.size() << " tiles fetched, " << prefetcher.Failed()
+                  << " failed" << std::endl;
+    }
+
+    // Tiles that could not be downloaded or decoded stay failed
+    std::map<int, std::pair<size_t, size_t>> coverage;
+    TileDescs missing;
+    for (const auto &d : descs) {
+        auto &c = coverage[d.z];
+        ++c.first;
+        if (tiles.RequestTile(d.x, d.y, d.z)->Failed()) {
+            missing.push_back(d);
+        } else {
+            ++c.second;
+        }
+    }
+
+    std::cout << "Tile coverage:\n";
+    for (const auto &c : coverage) {
+        std::cout << "  zoom " << std::setw(2) << std::setfill(' ') << c.first << ": " << c.second.second << "/"
+                  << c.second.first << " tiles (" << std::fixed << std::setprecision(1)
+                  << 100.0 * c.second.second / c.second.first << "%)\n";
+    }
+
+    if (missing.empty()) {
+        return true;
+    }
+
+    const size_t maxListed = 20;
+    std::cerr << missing.size() << " tiles are missing:\n";
+    for (size_t i = 0; i < std::min(maxListed, missing.size()); ++i) {
+        std::cerr << "  " << missing[i].z << "/" << missing[i].x << "/" << missing[i].y << "\n";
+    }
+    if (missing.size() > maxListed) {
+        std::cerr << "  ...\n";
+    }
+    return false;
+}
+
+// The caches count their own statistics, publish them with the other metrics
+template <typename Cache> static void AddCacheGauges(const std::string &prefix, std::shared_ptr<Cache> cache) {
+    std::weak_ptr<Cache> weak = cache;
+    auto add = [&](const char *name, std::function<double(const TileCacheStats &)> get) {
+        Metrics::AddGauge(prefix + "." + name, [weak, get] {
+            auto c = weak.lock();
+            return c ? get(c->GetCacheStats()) : 0.0;
+        });
+    };
+
+    add("hits", [](const TileCacheStats &s) { return (double) s.hits; });
+    add("misses", [](const TileCacheStats &s) { return (double) s.misses; });
+    add("evictions", [](const TileCacheStats &s) { return (double) s.evictions; });
+    add("resident_bytes", [](const TileCacheStats &s) { return (double) s.residentBytes; });
+    add("hit_rate", [](const TileCacheStats &s) {
+        auto lookups = s.hits + s.misses;
+        return lookups ? (double) s.hits / lookups : 0.0;
+    });
+}
+
+static std::string FormatDuration(double seconds) {
+    auto total = (int64_t) seconds;
+    std::stringstream ss;
+    ss << total / 3600 << ":" << std::setfill('0') << std::setw(2) << total / 60 % 60 << ":" << std::setw(2)
+       << total % 60;
+    return ss.str();
+}
+
+// Moves a video out of the job directory, which may be on another file system
+static bool MoveVideo(const boost::filesystem::path &from, const boost::filesystem::path &to) {
+    boost::system::error_code ec;
+    boost::filesystem::rename(from, to, ec);
+    if (ec) {
+        boost::filesystem::remove(to, ec);
+        boost::filesystem::copy_file(from, to, ec);
+        if (ec) {
+            std::cerr << "Could not move " << from << " to " << to << ": " << ec.message() << std::endl;
+            return false;
+        }
+        boost::filesystem::remove(from, ec);
+    }
+    return true;
+}
+
+// Hands the segments to the workers of the job directory, then collects their videos into the output
+// directory. Failed jobs are retried, on another node when there is one.
+static void RunCoordinator(JobQueue &queue, const std::vector<EncodingParams> &segments, const Arguments &args) {
+    struct Video {
+        const EncodingParams *params;
+        boost::filesystem::path path;
+        // Outputs of the chunk jobs, in order, empty if the video is a single job
+        std::vector<std::string> parts;
+        size_t remaining;
+        bool failed = false;
+    };
+
+    std::vector<Video> videos;
+    // Video and chunk of each job, by job name
+    std::map<std::string, std::pair<size_t, int>> jobs;
+
+    for (const auto &p : segments) {
+        Video v;
+        v.params = &p;
+        v.path = GetVideoPath(p);
+
+        std::stringstream name;
+        name << std::setw(3) << std::setfill('0') << p.fileSequenceId << "-" << std::setw(3) << std::setfill('0')
+             << p.segmentSequenceId;
+
+        RenderJob job;
+        job.fileSequenceId = p.fileSequenceId;
+        job.segmentSequenceId = p.segmentSequenceId;
+        job.name = name.str();
+        job.output = v.path.filename().string();
+
+        auto duration = p.gpx->GetItems()[p.seg.second].Timestamp - p.gpx->GetItems()[p.seg.first].Timestamp;
+        std::vector<FrameRange> ranges;
+        if (args.ChunkSeconds > 0 && duration > args.ChunkSeconds) {
+            auto samples = GeoSamples::Create(*p.gpx, p.seg.first, p.seg.second, s_fps);
+            ranges = GetChunks(samples->Size(), args.ChunkSeconds);
+        }
+
+        if (ranges.size() <= 1) {
+            jobs[job.name] = {videos.size(), -1};
+            queue.Submit(job);
+        } else {
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                auto chunk = job;
+                chunk.name = job.name + ".part" + std::to_string(i);
+                chunk.output = job.output + ".part" + std::to_string(i) + ".mp4";
+                chunk.firstFrame = ranges[i].first;
+                chunk.endFrame = ranges[i].second;
+                v.parts.push_back(chunk.output);
+                jobs[chunk.name] = {videos.size(), i};
+                queue.Submit(chunk);
+            }
+        }
+        v.remaining = std::max<size_t>(1, v.parts.size());
+        videos.push_back(v);
+    }
+
+    std::cout << "Submitted " << jobs.size() << " jobs for " << videos.size() << " videos" << std::endl;
+
+    // The last job of a video moves it to the output directory
+    auto finish = [&](Video &v, bool ok) {
+        v.failed |= !ok;
+        if (--v.remaining > 0) {
+            return;
+        }
+
+        if (v.parts.empty()) {
+            ok = !v.failed && MoveVideo(queue.GetVideoPath(v.path.filename().string()), v.path);
+        } else {
+            std::vector<std::string> parts;
+            for (const auto &part : v.parts) {
+                parts.push_back(queue.GetVideoPath(part));
+            }
+            ok = !v.failed && ConcatVideos(parts, v.path.string());
+            for (const auto &part : parts) {
+                boost::system::error_code ec;
+                boost::filesystem::remove(part, ec);
+            }
+        }
+
+        if (ok) {
+            std::cout << "Received " << v.path << std::endl;
+            AddToManifest(*v.params, v.path);
+        } else {
+            s_failedVideos.Add(v.path.string());
+        }
+    };
+
+    // A job can be both done and failed when its node was given up while it was finishing
+    std::unordered_set<std::string> finished;
+    while (finished.size() < jobs.size()) {
+        sleep(1);
+        queue.FailStaleJobs(args.NodeTimeout);
+
+        for (const auto &job : queue.TakeDone()) {
+            auto it = jobs.find(job.name);
+            if (it != jobs.end() && finished.insert(job.name).second) {
+                finish(videos[it->second.first], true);
+            }
+        }
+
+        for (auto &job : queue.TakeFailed()) {
+            auto it = jobs.find(job.name);
+            if (it == jobs.end() || finished.count(job.name)) {
+                continue;
+            }
+
+            if (++job.attempts < args.MaxAttempts) {
+                std::cerr << "Job " << job.name << " failed on " << job.failedNodes.back() << ", retrying"
+                          << std::endl;
+                queue.Submit(job);
+            } else {
+                std::cerr << "Job " << job.name << " failed " << job.attempts << " times, giving up" << std::endl;
+                finished.insert(job.name);
+                finish(videos[it->second.first], false);
+            }
+        }
+    }
+
+    queue.Stop();
+}
+
+// Lets each worker of the scheduler claim jobs from the job directory until the coordinator stops
+static void SubmitWorkers(SegmentScheduler &scheduler, JobQueuePtr queue, const std::vector<EncodingParams> &segments,
+                          const Arguments &args, int workers) {
+    std::map<std::pair<int, int>, EncodingParams> bySegment;
+    for (const auto &p : segments) {
+        bySegment[{p.fileSequenceId, p.segmentSequenceId}] = p;
+    }
+
+    auto node = args.Node;
+    queue->StartHeartbeat(node, std::max(1, args.NodeTimeout / 6));
+    std::cout << "Worker " << node << " waiting for jobs in " << args.WorkerDir << std::endl;
+
+    auto loop = [=] {
+        while (!queue->Stopped()) {
+            RenderJob job;
+            if (!queue->Claim(node, args.NodeTimeout, job)) {
+                sleep(1);
+                continue;
+            }
+
+            auto it = bySegment.find({job.fileSequenceId, job.segmentSequenceId});
+            if (it == bySegment.end()) {
+                std::cerr << "Job " << job.name << " is for an unknown segment, are the GPX files the same?\n";
+                queue->Fail(job, node);
+                continue;
+            }
+
+            auto p = it->second;
+            p.firstFrame = job.firstFrame;
+            p.endFrame = job.endFrame;
+
+            // Other nodes may write the same video if this one is given up, only complete videos get the name
+            auto videoPath = queue->GetVideoPath(job.output);
+            auto tmpPath = videoPath + "." + node + ".mp4";
+            auto samples = GeoSamples::Create(*p.gpx, p.seg.first, p.seg.second, s_fps);
+            if (EncodeFrames(p, samples, tmpPath) && !std::rename(tmpPath.c_str(), videoPath.c_str())) {
+                if (!queue->Complete(job, node)) {
+                    std::cerr << "The coordinator gave up on job " << job.name << std::endl;
+                }
+            } else {
+                boost::system::error_code ec;
+                boost::filesystem::remove(tmpPath, ec);
+                queue->Fail(job, node);
+            }
+        }
+    };
+
+    for (int i = 0; i < workers; ++i) {
+        scheduler.Submit(0, loop);
     }
 }
 
 int main(int argc, char **argv) {
     Arguments args;
 
-    if (!ParseCommandLine(argc, argv, args)) {
+    // Workers parse the command line of the coordinator, then their own one, which may override it
+    std::vector<std::string> argStrings(argv, argv + argc);
+    JobQueuePtr jobQueue;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        auto worker = !strcmp(argv[i], "-worker");
+        if (worker || !strcmp(argv[i], "-coordinator")) {
+            jobQueue = JobQueue::Create(argv[i + 1]);
+            if (!jobQueue) {
+                return -1;
+            }
+
+            std::vector<std::string> coordinatorArgs;
+            if (worker) {
+                if (!jobQueue->ReadArguments(coordinatorArgs)) {
+                    return -1;
+                }
+                argStrings.insert(argStrings.begin() + 1, coordinatorArgs.begin(), coordinatorArgs.end());
+            }
+            break;
+        }
+    }
+
+    std::vector<char *> argPointers;
+    for (auto &a : argStrings) {
+        argPointers.push_back(&a[0]);
+    }
+
+    if (!ParseCommandLine(argPointers.size(), argPointers.data(), args)) {
         printf("usage: %s -gpx file1.gpx [-gpx file2.gpx...] -tiles /path/to/tiles/dir -rsrcdir /path/to/resources "
-               "-outdir /path/to/out/dir\n",
-               argv[0]);
+               "-outdir /path/to/out/dir [-tile-store dir|pack] [-import-tiles /path/to/tiles/dir] "
+               "[-synthesize-tiles levels] [-prefetch-threads n] [-tile-cache-mb n] [-map-cache-mb n] "
+               "[-max-downloads n] [-download-retries n] [-jobs n] [-chunk-seconds n] [-render-threads n] "
+               "[-encoder-threads n] [-incremental 0|1] "
+               "[-encoder x265|x264|hevc_vaapi|hevc_nvenc|hevc_qsv] [-hwdevice path] [-bitrate kbps] "
+               "[-track-cache 0|1] [-layers map,date,stats] [-zooms 5,7,11,16] [-seed-only 0|1] [-seed-margin n] "
+               "[-metrics file.json] [-metrics-interval seconds] [-trace file.json] [-coordinator /path/to/job/dir] "
+               "[-max-attempts n] [-node-timeout seconds]\n"
+               "       %s -worker /path/to/job/dir [-node name] [-jobs n] [-render-threads n] [-encoder-threads n]\n",
+               argv[0], argv[0]);
         return -1;
     }
 
+    // Workers write their videos to the job directory, and import nothing.
+    // The files of the coordinator are its own, workers pass -metrics or -trace themselves.
+    // They get these arguments once the tiles are in the store.
+    static const char *const coordinatorOnly[] = {"-coordinator", "-outdir", "-import-tiles", "-metrics", "-trace",
+                                                  nullptr};
+    std::vector<std::string> workerArgs;
+    if (!args.CoordinatorDir.empty()) {
+        for (int i = 1; i + 1 < argc; i += 2) {
+            auto name = coordinatorOnly;
+            for (; *name && strcmp(argv[i], *name); ++name) {
+            }
+            if (!*name) {
+                workerArgs.push_back(argv[i]);
+                workerArgs.push_back(argv[i + 1]);
+            }
+        }
+        if (!jobQueue->Reset()) {
+            return -1;
+        }
+    }
+
+    if (!args.WorkerDir.empty()) {
+        // The coordinator keeps the manifest, and seeded the tile store with every tile the videos need.
+        // Workers only read it, so that a missing tile fails instead of being fetched by every node.
+        args.Incremental = false;
+        args.ImportTilesPath.clear();
+        args.PrefetchThreads = 0;
+        args.SynthesizeLevels = 0;
+        if (args.Node.empty()) {
+            char host[256] = {0};
+            gethostname(host, sizeof(host) - 1);
+            args.Node = std::string(host) + "-" + std::to_string(getpid());
+        }
+    }
+
+    auto store = ITileStore::Create(args.TileStore, args.TilesRootPath, !args.WorkerDir.empty());
+    if (!store) {
+        return -1;
+    }
+
+    if (args.ImportTilesPath.size() > 0) {
+        auto imported = ITileStore::ImportDirectory(*store, args.ImportTilesPath);
+        if (imported < 0) {
+            std::cerr << "Could not import tiles from " << args.ImportTilesPath << std::endl;
+            return -1;
+        }
+        std::cout << "Imported " << imported << " tiles from " << args.ImportTilesPath << std::endl;
+
+        if (args.InputGPXPaths.empty()) {
+            return 0;
+        }
+    }
+
     auto resources = Resources::Create(args.ResourceDir);
     if (!resources) {
         return -1;
     }
 
-    auto tiles = TileManager::Create(args.TilesRootPath, resources->GetMapPath().string());
+    DownloaderPtr downloader;
+    if (args.WorkerDir.empty()) {
+        downloader = Downloader::Create(args.Download);
+        if (!downloader) {
+            std::cerr << "Could not create downloader" << std::endl;
+            return -1;
+        }
+    }
+
+    auto tiles = TileManager::Create(store, resources->GetMapPath().string(), downloader);
     if (!tiles) {
         std::cerr << "Could not create tile manager" << std::endl;
         exit(-1);
     }
+    tiles->SetCacheBudget((size_t) std::max(0, args.TileCacheMB) * 1024 * 1024);
+    tiles->SetSynthesisLevels(args.SynthesizeLevels);
+    AddCacheGauges("tiles", tiles);
+
+    if (!args.TracePath.empty()) {
+        Tracer::Start();
+    }
 
     volatile bool terminated = false;
     auto printStats = [&] {
-        while (!terminated) {
-            auto totalSeconds = g_processedFrames / 25;
-            auto seconds = totalSeconds % 60;
-            auto minutes = totalSeconds / 60;
-            std::cout << g_processedFrames << " frames - " << std::setfill('0') << std::setw(2) << minutes << ":"
-                      << std::setfill('0') << std::setw(2) << seconds << "\n";
+        uint64_t prevFrames = 0;
+        for (int second = 1; !terminated; ++second) {
             sleep(1);
+
+            auto frames = s_renderedFrames.Value();
+            std::stringstream ss;
+            ss << frames << " frames (" << s_unchangedFrames.Value() << " unchanged), " << frames - prevFrames
+               << " fps\n";
+            prevFrames = frames;
+
+            for (const auto &p : Metrics::GetProgress()) {
+                ss << "  " << p->Name() << ": " << p->Done() << "/" << p->Total() << " frames";
+                auto eta = p->EtaSeconds();
+                if (eta >= 0) {
+                    ss << ", ETA " << FormatDuration(eta);
+                }
+                ss << "\n";
+            }
+            std::cout << ss.str();
+
+            if (!args.MetricsPath.empty() && second % args.MetricsInterval == 0) {
+                Metrics::WriteJson(args.MetricsPath);
+            }
         }
         std::cout << "Stats thread terminated\n";
     };
-    std::thread thr(printStats);
-    auto tp = default_thread_pool();
 
-    task_set tasks(tp);
+    // Each segment keeps its render threads and encoder threads busy, split the cores between segments
+    auto jobs = args.Jobs;
+    if (!jobs) {
+        auto cores = (int) std::max(1u, std::thread::hardware_concurrency());
+        jobs = std::max(1, cores / (args.Encoder.renderThreads + args.Encoder.encoderThreads));
+    }
+    // The job loops of workers never leave a scheduler worker idle, there is nobody to help render
+    args.Encoder.maxHelpers = args.WorkerDir.empty() ? jobs - 1 : 0;
+    auto scheduler = SegmentScheduler::Create(jobs);
+
+    TilePrefetcherPtr prefetcher;
+    if (args.PrefetchThreads > 0 || args.SeedOnly || !args.CoordinatorDir.empty()) {
+        prefetcher = TilePrefetcher::Create(tiles, std::max(1, args.PrefetchThreads));
+    }
+
+    ComposedTileCachePtr composedTiles;
+    std::vector<EncodingParams> segments;
     {
         std::sort(args.InputGPXPaths.begin(), args.InputGPXPaths.end());
 
         double initialDistance = 0.0;
         std::vector<GPXPtr> gpxs;
-        auto wholeTrack = gpsmap::GPX::Create();
 
         for (auto f : args.InputGPXPaths) {
             auto gpx = gpsmap::GPX::Create();
             std::cout << "Loading " << f << std::endl;
             gpx->SetInitialDistance(initialDistance);
-            gpx->LoadFromFile(f);
+            gpx->SetUseCache(args.TrackCache);
+            if (!gpx->LoadFromFile(f)) {
+                std::cerr << "Could not load " << f << std::endl;
+                exit(-1);
+            }
             gpx->CreateSegments();
 
-            wholeTrack->LoadFromFile(f);
             initialDistance = gpx->Last().TotalDistance;
             gpxs.push_back(gpx);
         }
 
+        // The whole track is only used to draw the path, reuse the items that were already parsed
+        auto wholeTrack = gpsmap::GPX::Merge(gpxs);
         wholeTrack->CreateSegments();
+        auto trackIndex = TrackIndex::Create(wholeTrack, tiles);
+        composedTiles = ComposedTileCache::Create(tiles, trackIndex);
+        composedTiles->SetCacheBudget((size_t) std::max(0, args.MapCacheMB) * 1024 * 1024);
+        AddCacheGauges("map_cache", composedTiles);
 
         auto firstItem = (*gpxs.begin())->First();
         auto lastItem = (*gpxs.rbegin())->Last();
 
+        if (args.SeedOnly) {
+            auto ok = SeedTiles(*tiles, *prefetcher, GetTracksTiles(*tiles, gpxs, args.Zooms, args.SeedMargin));
+            prefetcher->Stop();
+            return ok ? 0 : -1;
+        }
+
+        if (!args.CoordinatorDir.empty()) {
+            // Workers only read the tiles that the coordinator put in the shared tile store,
+            // they start once all of them are there
+            if (!SeedTiles(*tiles, *prefetcher, GetTracksTiles(*tiles, gpxs, args.Zooms, 1))) {
+                std::cerr << "Not starting the workers, some tiles are missing" << std::endl;
+                prefetcher->Stop();
+                return -1;
+            }
+            if (!jobQueue->WriteArguments(workerArgs)) {
+                prefetcher->Stop();
+                return -1;
+            }
+        } else if (prefetcher && args.WorkerDir.empty()) {
+            auto queue = GetTracksTiles(*tiles, gpxs, args.Zooms, 1);
+            std::cout << "Prefetching " << queue.size() << " tiles" << std::endl;
+            prefetcher->Enqueue(queue);
+        }
+
+        OutputManifestPtr manifest;
+        uint64_t resourcesHash = 0;
+        if (args.Incremental) {
+            manifest = OutputManifest::Create(args.OutputDirectory.string());
+            if (!manifest) {
+                return -1;
+            }
+            resourcesHash = HashResources(args.ResourceDir);
+        }
+
         int j = 0;
         for (auto gpx : gpxs) {
             int i = 0;
             for (const auto &seg : gpx->GetSegments()) {
                 EncodingParams p;
                 p.wholeTrack = wholeTrack;
+                p.composedTiles = composedTiles;
+                p.scheduler = scheduler;
                 p.gpx = gpx;
                 p.seg = seg;
                 p.tiles = tiles;
@@ -354,23 +1360,79 @@ int main(int argc, char **argv) {
                 p.fileSequenceId = j;
                 p.segmentSequenceId = i;
                 p.OutputDirectory = args.OutputDirectory;
+                p.encoder = args.Encoder;
+                p.layers = args.Layers;
+                p.zooms = args.Zooms;
                 p.startMarker.Latitude = firstItem.Latitude;
                 p.startMarker.Longitude = firstItem.Longitude;
                 p.endMarker.Latitude = lastItem.Latitude;
                 p.endMarker.Longitude = lastItem.Longitude;
-                tasks.push(tp->push(EncodeOneSegment, p));
+                if (manifest) {
+                    p.manifest = manifest;
+                    p.inputHash = HashInputs(p, args.ChunkSeconds, resourcesHash, *trackIndex);
+                }
+                segments.push_back(p);
                 ++i;
             }
             ++j;
         }
+
+        if (manifest) {
+            segments = SkipUnchangedSegments(segments, *manifest);
+        }
+
+        if (!args.WorkerDir.empty()) {
+            SubmitWorkers(*scheduler, jobQueue, segments, args, jobs);
+        } else if (args.CoordinatorDir.empty()) {
+            for (auto &p : segments) {
+                // Longest segments first, the cost of a segment is roughly proportional to its frames
+                auto cost = p.gpx->GetItems()[p.seg.second].Timestamp - p.gpx->GetItems()[p.seg.first].Timestamp;
+                if (args.ChunkSeconds > 0 && cost > args.ChunkSeconds) {
+                    SubmitChunks(*scheduler, p, args.ChunkSeconds);
+                } else {
+                    scheduler->Submit(cost, [p]() mutable { EncodeOneSegment(p); });
+                }
+            }
+        }
+    }
+
+    if (!args.CoordinatorDir.empty()) {
+        RunCoordinator(*jobQueue, segments, args);
+    } else {
+        std::thread thr(printStats);
+        std::cout << "Encoding on " << jobs << " workers" << std::endl;
+        scheduler->Run();
+        terminated = true;
+        thr.join();
+    }
+
+    if (prefetcher) {
+        prefetcher->Stop();
+        std::cout << "Prefetched " << prefetcher->Fetched() << " tiles, " << prefetcher->Failed() << " failed\n";
+    }
+
+    auto cacheStats = tiles->GetCacheStats();
+    std::cout << "Tile cache: " << cacheStats.hits << " hits, " << cacheStats.misses << " misses, "
+              << cacheStats.evictions << " evictions, " << cacheStats.residentTiles << " tiles ("
+              << cacheStats.residentBytes / (1024 * 1024) << " MB) resident\n";
+
+    auto mapStats = composedTiles->GetCacheStats();
+    std::cout << "Map cache: " << mapStats.hits << " hits, " << mapStats.misses << " misses, " << mapStats.evictions
+              << " evictions, " << mapStats.residentTiles << " tiles (" << mapStats.residentBytes / (1024 * 1024)
+              << " MB) resident\n";
+
+    if (!args.MetricsPath.empty()) {
+        Metrics::WriteJson(args.MetricsPath);
+    }
+
+    if (!args.TracePath.empty() && Tracer::Write(args.TracePath)) {
+        std::cout << "Wrote trace to " << args.TracePath << "\n";
     }
-    tasks.wait(true);
-    terminated = true;
-    thr.join();
 
-    if (s_filesWithErrors.size() > 0) {
+    auto failedVideos = s_failedVideos.Get();
+    if (failedVideos.size() > 0) {
         std::cerr << "Encoding failed for these files:\n";
-        for (const auto &f : s_filesWithErrors) {
+        for (const auto &f : failedVideos) {
             std::cerr << f << "\n";
         }
         return -1;
@@ -0,0 +1,143 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include <gpsmap/manifest.h>
+
+// Output manifest.
+//
+// A text file with a header line, followed by one line per video: the hash of its inputs
+// in hexadecimal, a space, and the name of the video, which may contain spaces.
+
+namespace gpsmap {
+
+static const char *s_manifestName = "gpsmap.manifest";
+static const char *s_manifestHeader = "# gpsmap manifest 1";
+
+OutputManifestPtr OutputManifest::Create(const std::string &outputDirectory) {
+    auto path = (boost::filesystem::path(outputDirectory) / s_manifestName).string();
+    auto ret = OutputManifestPtr(new OutputManifest(path));
+    if (!ret->Load()) {
+        return nullptr;
+    }
+    return ret;
+}
+
+bool OutputManifest::Load() {
+    std::ifstream ifs(m_path);
+    if (!ifs) {
+        // Nothing was encoded in this directory yet
+        return true;
+    }
+
+    std::string line;
+    if (!std::getline(ifs, line) || line != s_manifestHeader) {
+        std::cerr << m_path << " is not a manifest of this version" << std::endl;
+        return false;
+    }
+
+    while (std::getline(ifs, line)) {
+        auto space = line.find(' ');
+        if (space == std::string::npos || space == 0 || space + 1 >= line.size()) {
+            std::cerr << "Ignoring invalid line in " << m_path << ": " << line << std::endl;
+            continue;
+        }
+
+        char *end;
+        auto hash = strtoull(line.substr(0, space).c_str(), &end, 16);
+        if (*end) {
+            std::cerr << "Ignoring invalid line in " << m_path << ": " << line << std::endl;
+            continue;
+        }
+
+        m_entries[line.substr(space + 1)] = hash;
+    }
+
+    return true;
+}
+
+// Must be called with m_lock held
+bool OutputManifest::Save() {
+    std::stringstream ss;
+    ss << s_manifestHeader << "\n";
+    for (const auto &e : m_entries) {
+        ss << std::hex << std::setw(16) << std::setfill('0') << e.second << " " << e.first << "\n";
+    }
+
+    // Replace the file at once, readers see either version
+    auto tmpPath = m_path + ".tmp";
+    {
+        std::ofstream ofs(tmpPath, std::ios::trunc);
+        ofs << ss.str();
+        if (!ofs) {
+            std::cerr << "Could not write " << tmpPath << std::endl;
+            return false;
+        }
+    }
+
+    if (std::rename(tmpPath.c_str(), m_path.c_str())) {
+        std::cerr << "Could not rename " << tmpPath << " to " << m_path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool OutputManifest::Get(const std::string &name, uint64_t &hash) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) {
+        return false;
+    }
+    hash = it->second;
+    return true;
+}
+
+std::string OutputManifest::Find(uint64_t hash) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (const auto &e : m_entries) {
+        if (e.second == hash) {
+            return e.first;
+        }
+    }
+    return "";
+}
+
+void OutputManifest::Set(const std::string &name, uint64_t hash) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_entries[name] = hash;
+    Save();
+}
+
+void OutputManifest::Remove(const std::string &name) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (m_entries.erase(name)) {
+        Save();
+    }
+}
+
+} // namespace gpsmap
@@ -24,95 +24,105 @@ OIIO_NAMESPACE_USING
 
 namespace gpsmap {
 
-bool Overlay(ImageBuf &dest, const ImageBuf &source, int x, int y) {
-    auto w = source.spec().width;
-    auto h = source.spec().height;
-    OIIO::ROI roi(x, x + w, y, y + h, 0, 1, /*chans:*/ 0, dest.nchannels());
+bool MapImageGenerator::LoadGrid(int x, int y) {
+    ScopedTimer timer(m_gridLoads, "load grid");
 
-    auto subimg = ImageBufAlgo::copy(dest, TypeUnknown, roi, 1);
-    subimg.set_origin(0, 0);
-
-    auto comp = ImageBufAlgo::over(source, subimg, {}, 1);
-    if (comp.has_error()) {
-        return false;
-    }
-
-    if (!ImageBufAlgo::paste(dest, x, y, 0, 0, comp, {}, 1)) {
-        std::cerr << "Could not paste" << std::endl;
-        return false;
-    }
-
-    return true;
-}
-
-bool MapImageGenerator::LoadGrid(TilePtr tile) {
-    auto td = tile->Desc();
-    auto tw = tile->GetImage().xmax() + 1;
-    auto th = tile->GetImage().ymax() + 1;
-
-    TilePtr grid[3][3];
-    grid[1][1] = tile;
+    ComposedTilePtr grid[3][3];
     for (auto i = -1; i <= 1; i++) {
         for (auto j = -1; j <= 1; j++) {
-            auto t = m_tiles->GetTile(td.x + i, td.y + j, m_zoom);
+            auto t = m_composedTiles->GetTile(x + i, y + j, m_zoom);
             if (!t) {
-                std::cerr << "Could not get tile x=" << td.x + i << " y=" << td.y + j << "\n";
                 return false;
             }
-            auto img = t->GetImage();
             grid[j + 1][i + 1] = t;
         }
     }
 
-    // Paint the whole grid
-    int cx = 0;
-    for (auto i = -1; i <= 1; i++) {
-        int cy = 0;
-        for (auto j = -1; j <= 1; j++) {
-            auto img = grid[j + 1][i + 1]->GetImage();
-            if (!ImageBufAlgo::paste(m_grid, cx, cy, 0, 0, img, {}, 1)) {
-                std::cerr << "Could not copy image" << std::endl;
-                return false;
-            }
-            cy += th;
+    for (auto i = 0; i < 3; i++) {
+        for (auto j = 0; j < 3; j++) {
+            m_gridTiles[j][i] = grid[j][i];
         }
-        cx += tw;
     }
 
-    m_centerx = td.x;
-    m_centery = td.y;
-
+    m_centerx = x;
+    m_centery = y;
+    m_gridLoaded = true;
     return true;
 }
 
-bool MapImageGenerator::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
-    int px, py;
-    auto lat = m_tracker->Latitude();
-    auto lon = m_tracker->Longitude();
+// Copies the window of the grid that starts at (x, y) into ib, one tile at a time.
+// Pixels of ib that are outside of the grid are left as they are.
+bool MapImageGenerator::CopyViewport(OIIO::ImageBuf &ib, int x, int y) {
+    const auto &is = ib.spec();
+    auto tw = m_tiles->TileWidth();
+    auto th = m_tiles->TileHeight();
+
+    // Composed tiles are always 4 channels of UINT8
+    auto pixelBytes = (stride_t) 4;
+    bool fast = is.format == TypeDesc::UINT8 && is.nchannels == 4 && ib.localpixels() &&
+                ib.pixel_stride() == pixelBytes;
+
+    for (auto i = 0; i < 3; i++) {
+        for (auto j = 0; j < 3; j++) {
+            const auto &img = m_gridTiles[j][i]->GetImage();
+
+            // Top left corner of the tile in the viewport
+            auto tx = i * tw - x;
+            auto ty = j * th - y;
+
+            if (!fast) {
+                if (!ImageBufAlgo::paste(ib, tx, ty, 0, 0, img, {}, 1)) {
+                    std::cerr << "Could not paste" << std::endl;
+                    return false;
+                }
+                continue;
+            }
 
-    auto tile = m_tiles->GetTile(lat, lon, px, py, m_zoom);
-    if (!tile) {
-        std::cerr << "Could not get tile for " << lat << " " << lon << std::endl;
-        return false;
+            auto x0 = std::max(0, tx);
+            auto x1 = std::min(is.width, tx + tw);
+            auto y0 = std::max(0, ty);
+            auto y1 = std::min(is.height, ty + th);
+            if (x0 >= x1 || y0 >= y1) {
+                continue;
+            }
+
+            auto rowBytes = (x1 - x0) * pixelBytes;
+            for (auto row = y0; row < y1; ++row) {
+                auto src = img.pixeladdr(x0 - tx, row - ty);
+                auto dst = ib.pixeladdr(ib.xbegin() + x0, ib.ybegin() + row);
+                memcpy(dst, src, rowBytes);
+            }
+        }
     }
-    auto td = tile->Desc();
-    auto tw = tile->GetImage().xmax() + 1;
-    auto th = tile->GetImage().ymax() + 1;
 
-    if (m_centerx != td.x || m_centery != td.y) {
-        if (!LoadGrid(tile)) {
+    return true;
+}
+
+bool MapImageGenerator::IsOpaque(const OIIO::ImageSpec &spec) const {
+    // The viewport is centered on a point of the center tile of the grid,
+    // so it stays inside the grid as long as it is at most two tiles wide.
+    return spec.width <= 2 * m_tiles->TileWidth() && spec.height <= 2 * m_tiles->TileHeight();
+}
+
+bool MapImageGenerator::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
+    int xt, yt, px, py;
+    m_tiles->GetTileCoordsMercator(m_tracker->MercatorX(), m_tracker->MercatorY(), m_zoom, xt, yt, px, py);
+    auto tw = m_tiles->TileWidth();
+    auto th = m_tiles->TileHeight();
+
+    if (!m_gridLoaded || m_centerx != xt || m_centery != yt) {
+        if (!LoadGrid(xt, yt)) {
+            std::cerr << "Could not get tiles for " << m_tracker->Latitude() << " " << m_tracker->Longitude()
+                      << std::endl;
             return false;
         }
-
-        DrawTrack(m_grid);
     }
 
     // Render centered image
     px += tw;
     py += th;
 
-    if (!ImageBufAlgo::paste(ib, -(px - tw / 2), -(py - th / 2), 0, 0, m_grid, {}, 1)) {
-        std::cerr << "Could not paste" << std::endl;
+    if (!CopyViewport(ib, px - tw / 2, py - th / 2)) {
         return false;
     }
 
@@ -125,28 +135,46 @@ bool MapImageGenerator::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
     return true;
 }
 
+bool MapImageGenerator::GetStateKey(FrameKey &key) const {
+    // The viewport only depends on the pixel under the current position,
+    // the track and the markers are fixed relative to the map
+    int xt, yt, px, py;
+    m_tiles->GetTileCoordsMercator(m_tracker->MercatorX(), m_tracker->MercatorY(), m_zoom, xt, yt, px, py);
+    key.Add(xt);
+    key.Add(yt);
+    key.Add(px);
+    key.Add(py);
+
+    if (m_zoom >= 11) {
+        // Arrows are rotated in whole degrees
+        key.Add((int) m_tracker->Bearing());
+    }
+
+    return true;
+}
+
 bool MapImageGenerator::DrawDot(ImageBuf &ib) {
     // Draw the dot
-    auto dot = m_res->Dot();
+    const auto &dot = m_res->Dot();
 
-    auto w = dot.spec().width / 2;
-    auto h = dot.spec().height / 2;
+    auto w = dot.Width() / 2;
+    auto h = dot.Height() / 2;
     auto px = ib.spec().width / 2;
     auto py = ib.spec().height / 2;
 
-    return Overlay(ib, dot, px - w, py - h);
+    return dot.Blit(ib, px - w, py - h);
 }
 
 bool MapImageGenerator::DrawArrow(ImageBuf &ib, double bearing) {
     auto angle = bearing;
-    auto arrow = m_res->GetArrow(angle);
+    const auto &arrow = m_res->GetArrow(angle);
 
-    auto w = arrow.spec().width / 2;
-    auto h = arrow.spec().height / 2;
+    auto w = arrow.Width() / 2;
+    auto h = arrow.Height() / 2;
     auto px = ib.spec().width / 2;
     auto py = ib.spec().height / 2;
 
-    return Overlay(ib, arrow, px - w, py - h);
+    return arrow.Blit(ib, px - w, py - h);
 }
 
 void MapImageGenerator::DrawMarkers(ImageBuf &ib) {
@@ -159,34 +187,15 @@ void MapImageGenerator::DrawMarkers(ImageBuf &ib) {
 
     int vx, vy;
     for (const auto &marker : m_markers) {
-        ToViewPortCoordinates(marker.Latitude, marker.Longitude, vx, vy);
-        auto &img = *marker.Image;
-        Overlay(ib, img, vx - marker.x, vy - marker.y);
-    }
-}
-
-// TODO: optimize this, do not scan the entire list of items
-void MapImageGenerator::DrawTrack(ImageBuf &ib) {
-    bool hasPrev = false;
-    int prevx, prevy;
-
-    for (const auto &item : m_gpx->GetItems()) {
-        int x, y;
-        ToGridCoordinates(item.Latitude, item.Longitude, x, y);
-        if (hasPrev && !item.IsTrackStart) {
-            ImageBufAlgo::render_line(ib, prevx, prevy, x, y, {0.0f, 0.0f, 1.0f}, false, {}, 1);
-            ImageBufAlgo::render_line(ib, prevx, prevy, x + 1, y, {0.0f, 0.0f, 1.0f}, false, {}, 1);
-        }
-        prevx = x;
-        prevy = y;
-        hasPrev = true;
+        ToViewPortCoordinates(marker.MercatorX, marker.MercatorY, vx, vy);
+        marker.Image->Blit(ib, vx - marker.x, vy - marker.y);
     }
 }
 
 // This function may return negative coordinates.
 // The drawing functions will do the clipping.
-void MapImageGenerator::ToViewPortCoordinates(double lat, double lon, int &x, int &y) const {
-    ToGridCoordinates(lat, lon, x, y);
+void MapImageGenerator::ToViewPortCoordinates(double mx, double my, int &x, int &y) const {
+    ToGridCoordinates(mx, my, x, y);
 
     // 3. Translate grid coords to viewport coords
     auto vx = x - m_viewportx;
@@ -198,10 +207,10 @@ void MapImageGenerator::ToViewPortCoordinates(double lat, double lon, int &x, in
 
 // This function may return negative coordinates.
 // The drawing functions will do the clipping.
-void MapImageGenerator::ToGridCoordinates(double lat, double lon, int &x, int &y) const {
+void MapImageGenerator::ToGridCoordinates(double mx, double my, int &x, int &y) const {
     // 1. Get tile coordinates
     int xt, yt, px, py;
-    m_tiles->GetTileCoords(lat, lon, m_zoom, xt, yt, px, py);
+    m_tiles->GetTileCoordsMercator(mx, my, m_zoom, xt, yt, px, py);
 
     // 2. Translate to pixel coords in the internal grid
     auto topx = m_centerx - 1;
@@ -209,8 +218,8 @@ void MapImageGenerator::ToGridCoordinates(double lat, double lon, int &x, int &y
 
     xt -= topx;
     yt -= topy;
-    px += xt * 512;
-    py += yt * 512;
+    px += xt * m_tiles->TileWidth();
+    py += yt * m_tiles->TileHeight();
 
     x = px;
     y = py;
@@ -231,38 +240,75 @@ double angle_distance(double a1, double a2) {
     return result * sign;
 }
 
-bool GeoTracker::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
-    TrackItem firstItem;
-    if (!m_gpx->GetItem(m_firstItemIdx, firstItem)) {
-        // Nothing more to render
-        return false;
+GeoSamplesPtr GeoSamples::Create(const GPX &gpx, size_t first, size_t last, int fps) {
+    auto ret = GeoSamplesPtr(new GeoSamples(fps));
+    ret->Compute(gpx, first, last);
+    return ret;
+}
+
+void GeoSamples::Compute(const GPX &gpx, size_t first, size_t last) {
+    auto firstItem = gpx.GetItem(first);
+    if (!firstItem) {
+        return;
     }
 
-    auto second = (double) frameIndex / (double) fps;
-    auto date = (double) firstItem.Timestamp + second;
+    const auto &items = gpx.GetItems();
 
-    TrackItem item;
-    size_t prev_item = m_nextItemIdx;
+    // Find the item of each frame. A frame interpolates between its item and the next one,
+    // except for the first frame of each item, which shows the item as is.
+    std::vector<size_t> indices;
+    std::vector<uint8_t> interpolate;
+    std::vector<double> dates;
 
-    if (prev_item >= m_lastItemIdx) {
-        return false;
-    }
+    size_t nextItemIdx = first;
+    for (int64_t frameIndex = 0;; ++frameIndex) {
+        auto second = (double) frameIndex / (double) m_fps;
+        auto date = (double) firstItem->Timestamp + second;
 
-    if (!m_gpx->GetClosestItem(date, m_nextItemIdx, item)) {
-        // Nothing more to render
-        return false;
-    }
+        size_t prev_item = nextItemIdx;
 
-    // Interpolate speed and position
-    auto speedInc = item.Speed;
-    auto lat = item.Latitude;
-    auto lon = item.Longitude;
-    auto distInc = item.TotalDistance;
-    auto bearingInc = item.Bearing;
+        if (prev_item >= last) {
+            break;
+        }
 
-    if (prev_item == m_nextItemIdx) {
-        TrackItem next_item;
-        if (m_gpx->GetItem(m_nextItemIdx + 1, next_item)) {
+        if (!gpx.GetClosestItem(date, nextItemIdx)) {
+            // Nothing more to render
+            break;
+        }
+
+        indices.push_back(nextItemIdx);
+        interpolate.push_back(prev_item == nextItemIdx && nextItemIdx + 1 < items.size());
+        dates.push_back(date);
+    }
+
+    auto count = indices.size();
+    m_date.resize(count);
+    m_lon.resize(count);
+    m_lat.resize(count);
+    m_mercx.resize(count);
+    m_mercy.resize(count);
+    m_speed.resize(count);
+    m_dist.resize(count);
+    m_elevation.resize(count);
+    m_bearing.resize(count);
+    m_grade.resize(count);
+
+    // Frames don't depend on each other from here on
+    for (size_t i = 0; i < count; ++i) {
+        const auto &item = items[indices[i]];
+        auto date = dates[i];
+
+        // Interpolate speed and position
+        auto speedInc = item.Speed;
+        auto lat = item.Latitude;
+        auto lon = item.Longitude;
+        auto mx = item.MercatorX;
+        auto my = item.MercatorY;
+        auto distInc = item.TotalDistance;
+        auto bearingInc = item.Bearing;
+
+        if (interpolate[i]) {
+            const auto &next_item = items[indices[i] + 1];
             auto timeDiff = next_item.Timestamp - item.Timestamp;
             auto speedDiff = next_item.Speed - item.Speed;
             auto speedIncrement = speedDiff / timeDiff * (date - item.Timestamp);
@@ -278,117 +324,168 @@ bool GeoTracker::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
 
             lon += (next_item.Longitude - item.Longitude) / timeDiff * (date - item.Timestamp);
             lat += (next_item.Latitude - item.Latitude) / timeDiff * (date - item.Timestamp);
+
+            // Interpolating in projected space keeps the map projection out of the per-frame path
+            mx += (next_item.MercatorX - item.MercatorX) / timeDiff * (date - item.Timestamp);
+            my += (next_item.MercatorY - item.MercatorY) / timeDiff * (date - item.Timestamp);
         }
+
+        m_lon[i] = lon;
+        m_lat[i] = lat;
+        m_mercx[i] = mx;
+        m_mercy[i] = my;
+        m_dist[i] = distInc;
+        m_speed[i] = speedInc;
+        m_grade[i] = item.Grade;
+        m_elevation[i] = item.Elevation;
+        m_date[i] = date;
+        m_bearing[i] = bearingInc;
     }
+}
 
-    m_lon = lon;
-    m_lat = lat;
-    m_dist = distInc;
-    m_speed = speedInc;
-    m_grade = item.Grade;
-    m_elevation = item.Elevation;
-    m_date = date;
-    m_bearing = bearingInc;
+bool GeoTracker::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
+    if (fps != m_samples->GetFPS()) {
+        std::cerr << "Geo samples were computed for " << m_samples->GetFPS() << " fps, not " << fps << std::endl;
+        return false;
+    }
+
+    if (frameIndex < 0 || (size_t) frameIndex >= m_samples->Size()) {
+        // Nothing more to render
+        return false;
+    }
+
+    const auto &s = *m_samples;
+    m_lon = s.m_lon[frameIndex];
+    m_lat = s.m_lat[frameIndex];
+    m_mercx = s.m_mercx[frameIndex];
+    m_mercy = s.m_mercy[frameIndex];
+    m_dist = s.m_dist[frameIndex];
+    m_speed = s.m_speed[frameIndex];
+    m_grade = s.m_grade[frameIndex];
+    m_elevation = s.m_elevation[frameIndex];
+    m_date = s.m_date[frameIndex];
+    m_bearing = s.m_bearing[frameIndex];
 
     return true;
 }
 
-static std::string PrintTime(time_t ts) {
-    char buff[32];
-    struct tm res;
-    strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", localtime_r(&ts, &res));
-    return buff;
-}
+void LabelGenerator::GetLabel(TextBuffer &text) const {
+    if (m_kind == Stats) {
+        text.Append((int64_t) (m_geo->Speed() * 3600 / 1000));
+        text.Append(" km/h  ");
+        text.Append((int64_t) m_geo->Elevation());
+        text.Append(" m  ");
+        text.AppendFixed(m_geo->Distance() / 1000.0, 2);
+        text.Append(" km");
+        return;
+    }
 
-bool LabelGenerator::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
-    int width = ib.spec().width;
-    int height = ib.spec().height;
+    auto date = m_geo->Date();
+    if (date != m_lastDate) {
+        localtime_r(&date, &m_lastTime);
+        m_lastDate = date;
+    }
 
-    std::stringstream lbl1;
-    lbl1 << (int) (m_geo->Speed() * 3600 / 1000) << " km/h";
-    lbl1 << "  " << (int) m_geo->Elevation() << " m";
-    lbl1 << "  " << std::fixed << std::setprecision(2) << m_geo->Distance() / 1000.0 << " km";
-    auto lbl1Str = lbl1.str();
+    // %Y-%m-%d %H:%M:%S
+    const auto &t = m_lastTime;
+    text.Append(t.tm_year + 1900);
+    text.Append("-");
+    text.Append(t.tm_mon + 1, 2);
+    text.Append("-");
+    text.Append(t.tm_mday, 2);
+    text.Append(" ");
+    text.Append(t.tm_hour, 2);
+    text.Append(":");
+    text.Append(t.tm_min, 2);
+    text.Append(":");
+    text.Append(t.tm_sec, 2);
+}
 
-    std::stringstream lbl2;
-    lbl2 << PrintTime(m_geo->Date());
-    auto lbl2Str = lbl2.str();
+bool LabelGenerator::GetStateKey(FrameKey &key) const {
+    TextBuffer text;
+    GetLabel(text);
+    key.Add(text.View());
+    return true;
+}
 
-    if (m_lbl2 != lbl2.str()) {
+OIIO::ROI LabelGenerator::GetBounds(const OIIO::ImageSpec &spec) const {
+    auto roi = spec.roi();
+    auto height = m_res->GetLabelFont().Height();
+    if (m_kind == Date) {
+        roi.yend = roi.ybegin + height;
+    } else {
+        roi.ybegin = roi.yend - height;
+    }
+    return roi;
+}
 
-        // Top label
-        if (!ImageBufAlgo::render_box(m_buf2, 0, 0, width, 32, 1.0f, true, {}, 1)) {
-            std::cerr << "Could not render box" << std::endl;
-            return false;
-        }
+bool LabelGenerator::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
+    TextBuffer text;
+    GetLabel(text);
+    return m_res->GetLabelFont().DrawLabel(ib, GetBounds(ib.spec()).ybegin, text.View());
+}
 
-        if (!ImageBufAlgo::render_text(m_buf2, width / 2, 32 - 5, lbl2Str.c_str(), 32, m_fontPath,
-                                       {0.0f, 0.0f, 0.0f, 1.0f}, ImageBufAlgo::TextAlignX::Center,
-                                       ImageBufAlgo::TextAlignY::Baseline, 0, {}, 1)) {
-            fprintf(stderr, "Could not render text\n");
-            return false;
-        }
+void MapSwitcher::NextSecond() {
+    int second = m_prevSecond + 1;
 
-        m_lbl2 = lbl2.str();
+    if (m_prevSecond >= 0) {
+        --m_remainingDuration;
     }
 
-    if (!ImageBufAlgo::paste(ib, 0, 0, 0, 0, m_buf2, {}, 1)) {
-        std::cerr << "Could not paste" << std::endl;
-        return false;
+    if (!m_remainingDuration) {
+        m_currentMapIndex = (m_currentMapIndex + 1) % m_maps.size();
+        m_remainingDuration = m_maps[m_currentMapIndex].second;
     }
 
-    if (m_lbl1 != lbl1.str()) {
-        // Bottom label
-        if (!ImageBufAlgo::render_box(m_buf1, 0, 0, width, 32, 1.0f, true, {}, 1)) {
-            std::cerr << "Could not render box" << std::endl;
-            return false;
+    // Let clients override the displayed map if needed
+    if (m_maps.size() > 1) {
+        int overrideIndex = 0;
+        if (m_cb(second, overrideIndex)) {
+            if (overrideIndex < (int) m_maps.size()) {
+                m_currentMapIndex = overrideIndex;
+            }
         }
+    }
 
-        if (!ImageBufAlgo::render_text(m_buf1, width / 2, 32 - 5, lbl1Str.c_str(), 32, m_fontPath,
-                                       {0.0f, 0.0f, 0.0f, 1.0f}, ImageBufAlgo::TextAlignX::Center,
-                                       ImageBufAlgo::TextAlignY::Baseline, 0, {}, 1)) {
-            fprintf(stderr, "Could not render text\n");
-            return false;
-        }
+    m_prevSecond = second;
+}
 
-        m_lbl1 = lbl1.str();
-    }
+void MapSwitcher::Update(int frameIndex, int fps) {
+    int second = frameIndex / fps;
 
-    if (!ImageBufAlgo::paste(ib, 0, height - 32, 0, 0, m_buf1, {}, 1)) {
-        std::cerr << "Could not paste" << std::endl;
-        return false;
+    // Step through every second, including those whose frames were rendered by
+    // another thread, so that the displayed map only depends on the frame index.
+    while (m_prevSecond < second) {
+        NextSecond();
     }
-
-    return true;
 }
 
 bool MapSwitcher::Generate(OIIO::ImageBuf &ib, int frameIndex, int fps) {
-    int second = frameIndex / fps;
+    Update(frameIndex, fps);
+    return m_maps[m_currentMapIndex].first->Generate(ib, frameIndex, fps);
+}
 
-    if (second != m_prevSecond) {
-        if (m_prevSecond >= 0) {
-            --m_remainingDuration;
-        }
+bool MapSwitcher::GetStateKey(FrameKey &key) const {
+    if (m_maps.empty()) {
+        return false;
+    }
 
-        if (!m_remainingDuration) {
-            m_currentMapIndex = (m_currentMapIndex + 1) % m_maps.size();
-            m_remainingDuration = m_maps[m_currentMapIndex].second;
-        }
+    key.Add(m_currentMapIndex);
+    return m_maps[m_currentMapIndex].first->GetStateKey(key);
+}
 
-        // Let clients override the displayed map if needed
-        if (m_maps.size() > 1) {
-            int overrideIndex = 0;
-            if (m_cb(second, overrideIndex)) {
-                if (overrideIndex < (int) m_maps.size()) {
-                    m_currentMapIndex = overrideIndex;
-                }
-            }
-        }
+bool MapSwitcher::IsOpaque(const OIIO::ImageSpec &spec) const {
+    if (m_maps.empty()) {
+        return false;
+    }
 
-        m_prevSecond = second;
+    for (const auto &m : m_maps) {
+        if (!m.first->IsOpaque(spec)) {
+            return false;
+        }
     }
 
-    return m_maps[m_currentMapIndex].first->Generate(ib, frameIndex, fps);
+    return true;
 }
 
 } // namespace gpsmap
@@ -0,0 +1,77 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gpsmap/mappedfile.h>
+
+namespace gpsmap {
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        munmap(m_data, m_mappedSize);
+    }
+}
+
+MappedFilePtr MappedFile::Create(const std::string &path, bool sequential, size_t reserve) {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        std::cerr << "Could not stat " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return nullptr;
+    }
+
+    auto ret = MappedFilePtr(new MappedFile());
+
+    // Empty files cannot be mapped
+    auto size = std::max<size_t>(st.st_size, reserve);
+    if (size > 0) {
+        // Shared mappings see what is appended to the file after they were made
+        auto data = mmap(nullptr, size, PROT_READ, reserve ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "Could not map " << path << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return nullptr;
+        }
+
+        madvise(data, size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+
+        ret->m_data = data;
+        ret->m_size = st.st_size;
+        ret->m_mappedSize = size;
+    }
+
+    close(fd);
+    return ret;
+}
+
+} // namespace gpsmap
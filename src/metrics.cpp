@@ -0,0 +1,358 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include <gpsmap/metrics.h>
+
+namespace gpsmap {
+
+uint64_t MetricCounter::Value() const {
+    uint64_t ret = 0;
+    for (const auto &s : m_shards) {
+        ret += s.value.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+MetricHistogram::MetricHistogram() {
+    for (auto &s : m_shards) {
+        s.count = 0;
+        s.sum = 0;
+        s.max = 0;
+        for (auto &b : s.buckets) {
+            b = 0;
+        }
+    }
+}
+
+MetricHistogram::Snapshot MetricHistogram::GetSnapshot() const {
+    Snapshot ret;
+    for (const auto &s : m_shards) {
+        ret.count += s.count.load(std::memory_order_relaxed);
+        ret.sum += s.sum.load(std::memory_order_relaxed);
+        ret.max = std::max(ret.max, s.max.load(std::memory_order_relaxed));
+        for (int i = 0; i < Buckets; ++i) {
+            ret.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return ret;
+}
+
+double MetricHistogram::Snapshot::Percentile(double p) const {
+    // Shards are read one after the other, so use the buckets rather than count
+    uint64_t total = 0;
+    for (auto b : buckets) {
+        total += b;
+    }
+    if (!total) {
+        return 0;
+    }
+
+    auto rank = std::min(1.0, std::max(0.0, p)) * total;
+    uint64_t seen = 0;
+    for (int i = 0; i < Buckets; ++i) {
+        if (!buckets[i]) {
+            continue;
+        }
+
+        if (seen + buckets[i] >= rank) {
+            auto hi = std::min(std::ldexp(1.0, i + 1), (double) max);
+            auto lo = std::min(i ? std::ldexp(1.0, i) : 0.0, hi);
+            return lo + (hi - lo) * (rank - seen) / buckets[i];
+        }
+        seen += buckets[i];
+    }
+
+    return max;
+}
+
+double Progress::EtaSeconds() const {
+    auto done = Done();
+    if (!done) {
+        return -1;
+    }
+
+    if (done >= m_total) {
+        return 0;
+    }
+
+    return ElapsedSeconds() * (m_total - done) / done;
+}
+
+namespace {
+
+struct Registry {
+    std::mutex lock;
+    std::map<std::string, std::unique_ptr<MetricCounter>> counters;
+    std::map<std::string, std::unique_ptr<MetricHistogram>> histograms;
+    std::map<std::string, std::function<double()>> gauges;
+    std::vector<std::weak_ptr<Progress>> progress;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+Registry &GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+void WriteString(std::ostream &os, const std::string &str) {
+    os << '"';
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if ((unsigned char) c < 0x20) {
+            os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+        } else {
+            os << c;
+        }
+    }
+    os << '"';
+}
+
+bool ReplaceFile(const std::string &path, const std::string &contents) {
+    auto tmpPath = path + ".tmp";
+    {
+        std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+        ofs << contents;
+        if (!ofs) {
+            std::cerr << "Could not write " << tmpPath << std::endl;
+            return false;
+        }
+    }
+
+    if (std::rename(tmpPath.c_str(), path.c_str())) {
+        std::cerr << "Could not rename " << tmpPath << " to " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace
+
+MetricCounter &Metrics::GetCounter(const std::string &name) {
+    auto &r = GetRegistry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    auto &ret = r.counters[name];
+    if (!ret) {
+        ret.reset(new MetricCounter());
+    }
+    return *ret;
+}
+
+MetricHistogram &Metrics::GetHistogram(const std::string &name) {
+    auto &r = GetRegistry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    auto &ret = r.histograms[name];
+    if (!ret) {
+        ret.reset(new MetricHistogram());
+    }
+    return *ret;
+}
+
+void Metrics::AddGauge(const std::string &name, std::function<double()> read) {
+    auto &r = GetRegistry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    r.gauges[name] = read;
+}
+
+ProgressPtr Metrics::StartProgress(const std::string &name, uint64_t total) {
+    auto ret = std::make_shared<Progress>(name, total);
+
+    auto &r = GetRegistry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    r.progress.erase(std::remove_if(r.progress.begin(), r.progress.end(),
+                                    [](const std::weak_ptr<Progress> &p) { return p.expired(); }),
+                     r.progress.end());
+    r.progress.push_back(ret);
+    return ret;
+}
+
+std::vector<ProgressPtr> Metrics::GetProgress() {
+    std::vector<ProgressPtr> ret;
+
+    auto &r = GetRegistry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    for (const auto &p : r.progress) {
+        if (auto progress = p.lock()) {
+            ret.push_back(progress);
+        }
+    }
+    return ret;
+}
+
+void Metrics::WriteJson(std::ostream &os) {
+    auto &r = GetRegistry();
+
+    // Gauges may take locks of their own, don't call them with the registry locked
+    std::map<std::string, std::function<double()>> gauges;
+    std::vector<std::pair<std::string, uint64_t>> counters;
+    std::vector<std::pair<std::string, MetricHistogram::Snapshot>> histograms;
+    double uptime;
+    {
+        std::unique_lock<std::mutex> lock(r.lock);
+        gauges = r.gauges;
+        for (const auto &c : r.counters) {
+            counters.push_back({c.first, c.second->Value()});
+        }
+        for (const auto &h : r.histograms) {
+            histograms.push_back({h.first, h.second->GetSnapshot()});
+        }
+        uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.start).count();
+    }
+    auto progress = GetProgress();
+
+    os << std::fixed << std::setprecision(3);
+    os << "{\n  \"uptime_s\": " << uptime << ",\n  \"counters\": {";
+    for (size_t i = 0; i < counters.size(); ++i) {
+        os << (i ? ",\n    " : "\n    ");
+        WriteString(os, counters[i].first);
+        os << ": " << counters[i].second;
+    }
+    os << "\n  },\n  \"gauges\": {";
+    auto first = true;
+    for (const auto &g : gauges) {
+        os << (first ? "\n    " : ",\n    ");
+        WriteString(os, g.first);
+        auto value = g.second();
+        os << ": " << (std::isfinite(value) ? value : 0);
+        first = false;
+    }
+    os << "\n  },\n  \"histograms\": {";
+    for (size_t i = 0; i < histograms.size(); ++i) {
+        const auto &s = histograms[i].second;
+        os << (i ? ",\n    " : "\n    ");
+        WriteString(os, histograms[i].first);
+        os << ": {\"count\": " << s.count << ", \"sum\": " << s.sum << ", \"mean\": " << s.Mean()
+           << ", \"p50\": " << s.Percentile(0.5) << ", \"p90\": " << s.Percentile(0.9)
+           << ", \"p99\": " << s.Percentile(0.99) << ", \"max\": " << s.max << "}";
+    }
+    os << "\n  },\n  \"progress\": [";
+    for (size_t i = 0; i < progress.size(); ++i) {
+        const auto &p = *progress[i];
+        os << (i ? ",\n    " : "\n    ") << "{\"name\": ";
+        WriteString(os, p.Name());
+        os << ", \"done\": " << p.Done() << ", \"total\": " << p.Total() << ", \"elapsed_s\": " << p.ElapsedSeconds()
+           << ", \"eta_s\": " << p.EtaSeconds() << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+bool Metrics::WriteJson(const std::string &path) {
+    std::stringstream ss;
+    WriteJson(ss);
+    return ReplaceFile(path, ss.str());
+}
+
+namespace {
+
+struct TraceEvent {
+    std::string name;
+    Tracer::Clock::time_point begin;
+    Tracer::Clock::time_point end;
+};
+
+// Spans of one thread. They are only read when the trace is written,
+// so the lock is almost never contended.
+struct ThreadTrace {
+    std::mutex lock;
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+// Bounds the memory of long runs, a span takes about 64 bytes
+const size_t s_maxEventsPerThread = 1 << 20;
+
+std::mutex s_traceLock;
+std::vector<std::shared_ptr<ThreadTrace>> s_threadTraces;
+Tracer::Clock::time_point s_traceStart;
+std::atomic<uint64_t> s_droppedEvents(0);
+
+ThreadTrace &GetThreadTrace() {
+    thread_local std::shared_ptr<ThreadTrace> trace;
+    if (!trace) {
+        trace = std::make_shared<ThreadTrace>();
+        std::unique_lock<std::mutex> lock(s_traceLock);
+        trace->tid = s_threadTraces.size() + 1;
+        s_threadTraces.push_back(trace);
+    }
+    return *trace;
+}
+
+} // namespace
+
+std::atomic_bool Tracer::s_enabled(false);
+
+void Tracer::Start() {
+    {
+        std::unique_lock<std::mutex> lock(s_traceLock);
+        s_traceStart = Clock::now();
+    }
+    s_enabled = true;
+}
+
+void Tracer::AddSpan(const std::string &name, Clock::time_point begin, Clock::time_point end) {
+    auto &trace = GetThreadTrace();
+    std::unique_lock<std::mutex> lock(trace.lock);
+    if (trace.events.size() >= s_maxEventsPerThread) {
+        ++s_droppedEvents;
+        return;
+    }
+    trace.events.push_back({name, begin, end});
+}
+
+bool Tracer::Write(const std::string &path) {
+    auto micros = [](Clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    auto first = true;
+    {
+        std::unique_lock<std::mutex> lock(s_traceLock);
+        for (const auto &t : s_threadTraces) {
+            std::unique_lock<std::mutex> threadLock(t->lock);
+            for (const auto &e : t->events) {
+                ss << (first ? "\n" : ",\n") << "{\"name\": ";
+                WriteString(ss, e.name);
+                ss << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << t->tid
+                   << ", \"ts\": " << micros(e.begin - s_traceStart) << ", \"dur\": " << micros(e.end - e.begin) << "}";
+                first = false;
+            }
+        }
+    }
+    ss << "\n]}\n";
+
+    if (s_droppedEvents) {
+        std::cerr << "Trace is missing " << s_droppedEvents << " spans, only the first ones of each thread are kept\n";
+    }
+
+    return ReplaceFile(path, ss.str());
+}
+
+} // namespace gpsmap
@@ -0,0 +1,181 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+
+#include <gpsmap/prefetcher.h>
+
+namespace gpsmap {
+
+TilePrefetcherPtr TilePrefetcher::Create(TileManagerPtr tiles, int threads) {
+    auto ret = TilePrefetcherPtr(new TilePrefetcher(tiles));
+    ret->Start(threads);
+    return ret;
+}
+
+TilePrefetcher::~TilePrefetcher() {
+    Stop();
+}
+
+void TilePrefetcher::Start(int threads) {
+    for (auto i = 0; i < threads; ++i) {
+        m_workers.emplace_back(&TilePrefetcher::WorkerLoop, this);
+    }
+}
+
+void TilePrefetcher::Stop() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_terminated = true;
+        m_queue.clear();
+    }
+    m_cv.notify_all();
+    m_idle.notify_all();
+
+    for (auto &t : m_workers) {
+        t.join();
+    }
+    m_workers.clear();
+}
+
+void TilePrefetcher::Enqueue(const TileDescs &tiles) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        for (const auto &t : tiles) {
+            if (m_queued.insert(t).second) {
+                m_queue.push_back(t);
+            }
+        }
+    }
+    m_cv.notify_all();
+}
+
+bool TilePrefetcher::WaitUntilIdle(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lk(m_lock);
+    return m_idle.wait_for(lk, timeout, [&] { return m_terminated || (m_queue.empty() && m_busy == 0); });
+}
+
+void TilePrefetcher::WorkerLoop() {
+    // Requesting several tiles before waiting for them keeps
+    // the concurrent transfers of the downloader busy.
+    const size_t batchSize = 8;
+
+    while (true) {
+        TileDescs batch;
+        {
+            std::unique_lock<std::mutex> lk(m_lock);
+            m_cv.wait(lk, [&] { return m_terminated || !m_queue.empty(); });
+            if (m_terminated) {
+                return;
+            }
+
+            while (!m_queue.empty() && batch.size() < batchSize) {
+                batch.push_back(m_queue.front());
+                m_queue.pop_front();
+            }
+            ++m_busy;
+        }
+
+        std::vector<TilePtr> tiles;
+        for (const auto &desc : batch) {
+            tiles.push_back(m_tiles->RequestTile(desc.x, desc.y, desc.z));
+        }
+
+        // This also decodes the tiles, unless another thread is already doing it
+        for (auto &tile : tiles) {
+            if (m_tiles->WaitForTile(tile)) {
+                ++m_fetched;
+            } else {
+                ++m_failed;
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lk(m_lock);
+            --m_busy;
+        }
+        m_idle.notify_all();
+    }
+}
+
+TileDescs TilePrefetcher::GetTrackTiles(const TileManager &tiles, const GPX &gpx, size_t first, size_t last,
+                                        const std::vector<int> &zooms, int margin) {
+    TileDescs ret;
+    std::unordered_set<TileDesc> seen;
+
+    const auto &items = gpx.GetItems();
+    if (items.empty() || first >= items.size()) {
+        return ret;
+    }
+
+    last = std::min(last, items.size() - 1);
+
+    auto addNeighborhood = [&](int x, int y, int zoom) {
+        for (auto i = -margin; i <= margin; i++) {
+            for (auto j = -margin; j <= margin; j++) {
+                // Tiles past the edges of the map don't exist
+                TileDesc d(x + i, y + j, zoom);
+                auto size = 1 << zoom;
+                if (d.x < 0 || d.y < 0 || d.x >= size || d.y >= size) {
+                    continue;
+                }
+
+                if (seen.insert(d).second) {
+                    ret.push_back(d);
+                }
+            }
+        }
+    };
+
+    // Fractional tile coordinates of the previous item, for each zoom level
+    std::vector<std::pair<double, double>> prev(zooms.size());
+
+    for (auto i = first; i <= last; ++i) {
+        const auto &item = items[i];
+        for (size_t z = 0; z < zooms.size(); ++z) {
+            int xt, yt, px, py;
+            tiles.GetTileCoordsMercator(item.MercatorX, item.MercatorY, zooms[z], xt, yt, px, py);
+            auto xd = xt + (double) px / tiles.TileWidth();
+            auto yd = yt + (double) py / tiles.TileHeight();
+
+            // The tracker interpolates positions between items, so also get the tiles
+            // crossed between two distant items. Sampling one point per tile is
+            // enough because we take the neighborhood of each sample anyway.
+            if (i > first && !item.IsTrackStart) {
+                auto pxd = prev[z].first;
+                auto pyd = prev[z].second;
+                auto steps = (int) ceil(std::max(fabs(xd - pxd), fabs(yd - pyd)));
+                for (auto s = 1; s < steps; ++s) {
+                    auto t = (double) s / steps;
+                    addNeighborhood(floor(pxd + (xd - pxd) * t), floor(pyd + (yd - pyd) * t), zooms[z]);
+                }
+            }
+
+            addNeighborhood(xt, yt, zooms[z]);
+            prev[z] = std::make_pair(xd, yd);
+        }
+    }
+
+    return ret;
+}
+
+} // namespace gpsmap
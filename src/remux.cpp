@@ -0,0 +1,151 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <iostream>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+}
+
+#include <gpsmap/remux.h>
+
+namespace gpsmap {
+
+// Copies the video stream of inputPath to out, shifted by offset.
+// Updates offset to the end of the input, and lastDts to the dts of the last packet.
+static bool AppendVideo(const std::string &inputPath, AVFormatContext *out, int64_t &offset, int64_t &lastDts) {
+    AVFormatContext *in = nullptr;
+    if (avformat_open_input(&in, inputPath.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Could not open " << inputPath << "\n";
+        return false;
+    }
+
+    bool ok = avformat_find_stream_info(in, nullptr) >= 0 && in->nb_streams == 1;
+    if (!ok) {
+        std::cerr << "Could not find the video stream of " << inputPath << "\n";
+        avformat_close_input(&in);
+        return false;
+    }
+
+    auto inStream = in->streams[0];
+    auto outStream = out->streams[0];
+    auto end = offset;
+
+    // For packets without a duration
+    int64_t frameDuration = 1;
+    if (inStream->avg_frame_rate.num > 0) {
+        frameDuration = std::max<int64_t>(1, av_rescale_q(1, av_inv_q(inStream->avg_frame_rate), outStream->time_base));
+    }
+
+    auto pkt = av_packet_alloc();
+    while (ok && av_read_frame(in, pkt) >= 0) {
+        av_packet_rescale_ts(pkt, inStream->time_base, outStream->time_base);
+        pkt->pts += offset;
+        pkt->dts += offset;
+        pkt->stream_index = 0;
+
+        // Reordering delays may differ between parts, muxers reject decreasing dts
+        if (lastDts != AV_NOPTS_VALUE && pkt->dts <= lastDts) {
+            pkt->dts = lastDts + 1;
+            pkt->pts = std::max(pkt->pts, pkt->dts);
+        }
+        lastDts = pkt->dts;
+        end = std::max(end, pkt->pts + (pkt->duration > 0 ? pkt->duration : frameDuration));
+
+        ok = av_interleaved_write_frame(out, pkt) >= 0;
+        av_packet_unref(pkt);
+    }
+
+    av_packet_free(&pkt);
+    avformat_close_input(&in);
+
+    if (!ok) {
+        std::cerr << "Could not copy " << inputPath << "\n";
+        return false;
+    }
+
+    offset = end;
+    return true;
+}
+
+bool ConcatVideos(const std::vector<std::string> &parts, const std::string &outputPath) {
+    if (parts.empty()) {
+        return false;
+    }
+
+    // The output gets the stream parameters of the first part
+    AVFormatContext *first = nullptr;
+    if (avformat_open_input(&first, parts[0].c_str(), nullptr, nullptr) < 0 ||
+        avformat_find_stream_info(first, nullptr) < 0 || first->nb_streams != 1) {
+        std::cerr << "Could not open " << parts[0] << "\n";
+        avformat_close_input(&first);
+        return false;
+    }
+
+    AVFormatContext *out = nullptr;
+    avformat_alloc_output_context2(&out, nullptr, nullptr, outputPath.c_str());
+    if (!out) {
+        avformat_close_input(&first);
+        return false;
+    }
+
+    auto st = avformat_new_stream(out, nullptr);
+    bool ok = st && avcodec_parameters_copy(st->codecpar, first->streams[0]->codecpar) >= 0;
+    if (ok) {
+        st->codecpar->codec_tag = 0;
+        st->time_base = first->streams[0]->time_base;
+        st->avg_frame_rate = first->streams[0]->avg_frame_rate;
+    }
+    avformat_close_input(&first);
+
+    if (ok && !(out->oformat->flags & AVFMT_NOFILE)) {
+        ok = avio_open(&out->pb, outputPath.c_str(), AVIO_FLAG_WRITE) >= 0;
+    }
+
+    bool headerWritten = ok && avformat_write_header(out, nullptr) >= 0;
+    ok = headerWritten;
+
+    // The muxer may change the time base in avformat_write_header()
+    int64_t offset = 0;
+    int64_t lastDts = AV_NOPTS_VALUE;
+    for (size_t i = 0; ok && i < parts.size(); ++i) {
+        ok = AppendVideo(parts[i], out, offset, lastDts);
+    }
+
+    if (headerWritten && av_write_trailer(out) < 0) {
+        ok = false;
+    }
+
+    if (!(out->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&out->pb);
+    }
+    avformat_free_context(out);
+
+    if (!ok) {
+        std::cerr << "Could not write " << outputPath << "\n";
+    }
+
+    return ok;
+}
+
+} // namespace gpsmap
@@ -22,6 +22,11 @@
 #include <OpenImageIO/imagebufalgo.h>
 #include <OpenImageIO/imageio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include <gpsmap/resources.h>
 
 OIIO_NAMESPACE_USING
@@ -51,22 +56,22 @@ static OIIO::ImageBuf Resize(const OIIO::ImageBuf in, int nw, int nh) {
 
 namespace gpsmap {
 
-bool Resources::Load() {
-    if (!LoadFromFile(m_dir, "dot32.png", m_dot)) {
+bool Resources::Load(int arrowAngles) {
+    OIIO::ImageBuf dot;
+    if (!LoadFromFile(m_dir, "dot32.png", dot) || !m_dot.Load(Resize(dot, 16, 16))) {
         return false;
     }
-    m_dot = Resize(m_dot, 16, 16);
 
-    if (!LoadFromFile(m_dir, "pin_start.png", m_startPin)) {
+    OIIO::ImageBuf startPin;
+    if (!LoadFromFile(m_dir, "pin_start.png", startPin) || !m_startPin.Load(Resize(startPin, 45, 64))) {
         return false;
     }
-    m_startPin = Resize(m_startPin, 45, 64);
 
-    if (!LoadFromFile(m_dir, "pin_finish.png", m_finishPin)) {
+    OIIO::ImageBuf finishPin;
+    if (!LoadFromFile(m_dir, "pin_finish.png", finishPin) ||
+        !m_finishPin.Load(OIIO::ImageBufAlgo::flip(Resize(finishPin, 45, 64)))) {
         return false;
     }
-    m_finishPin = Resize(m_finishPin, 45, 64);
-    m_finishPin = OIIO::ImageBufAlgo::flip(m_finishPin);
 
     m_map = boost::filesystem::path(m_dir).append("OpenStreetMap-HiDPI.xml");
     if (!boost::filesystem::exists(m_map)) {
@@ -80,28 +85,58 @@ bool Resources::Load() {
         return false;
     }
 
+    // Everything the speed, elevation, distance and date labels need
+    m_labelFont = GlyphAtlas::Create(m_font.string(), 32, 32, 32 - 5, "0123456789 .:-/kmh");
+    if (!m_labelFont) {
+        return false;
+    }
+
     // Initialize arrows in various angles
-    if (!LoadFromFile(m_dir, "arrow.png", m_arrow)) {
+    OIIO::ImageBuf arrow;
+    if (!LoadFromFile(m_dir, "arrow.png", arrow)) {
         return false;
     }
-    m_arrow = Resize(m_arrow, 96, 96);
 
-    return true;
+    return LoadArrows(Resize(arrow, 96, 96), arrowAngles);
 }
 
-const OIIO::ImageBuf &Resources::GetArrow(int angle) {
-    std::unique_lock<std::mutex> lock(m_lock);
-    {
-        angle = angle % 360;
-        auto it = m_arrows.find(angle);
-        if (it != m_arrows.end()) {
-            return it->second;
+bool Resources::LoadArrows(const OIIO::ImageBuf &arrow, int count) {
+    if (count < 1) {
+        std::cerr << "Invalid number of arrow angles: " << count << std::endl;
+        return false;
+    }
+
+    m_arrows.resize(count);
+    std::atomic_bool ok(true);
+    std::atomic_int next(0);
+
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            auto angle = i * 2 * M_PI / count;
+            auto rotated = ImageBufAlgo::rotate(arrow, angle, string_view(), 0.0f, false, {}, 1);
+            if (rotated.has_error() || !m_arrows[i].Load(rotated)) {
+                std::cerr << "Could not rotate arrow: " << rotated.geterror() << std::endl;
+                ok = false;
+            }
         }
+    };
 
-        auto rotated = ImageBufAlgo::rotate(m_arrow, angle * M_PI / 180.0, string_view(), 0.0f, false, {}, 1);
-        m_arrows[angle] = rotated;
-        return m_arrows[angle];
+    std::vector<std::thread> threads;
+    auto threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threadCount; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto &t : threads) {
+        t.join();
     }
+
+    return ok;
+}
+
+const Sprite &Resources::GetArrow(int angle) const {
+    int count = m_arrows.size();
+    angle = ((angle % 360) + 360) % 360;
+    return m_arrows[angle * count / 360];
 }
 
 } // namespace gpsmap
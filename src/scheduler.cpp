@@ -0,0 +1,107 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+
+#include <gpsmap/scheduler.h>
+
+namespace gpsmap {
+
+void SegmentScheduler::Submit(double cost, JobFunction job) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_jobs.push_back({cost, job});
+}
+
+void SegmentScheduler::Run() {
+    {
+        // Jobs are popped from the back, keep the longest ones there
+        std::unique_lock<std::mutex> lock(m_lock);
+        std::stable_sort(m_jobs.begin(), m_jobs.end(), [](const Job &a, const Job &b) { return a.cost < b.cost; });
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < m_workers; ++i) {
+        workers.emplace_back(&SegmentScheduler::WorkerLoop, this);
+    }
+
+    for (auto &t : workers) {
+        t.join();
+    }
+}
+
+void SegmentScheduler::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (true) {
+        if (!m_jobs.empty()) {
+            auto job = std::move(m_jobs.back());
+            m_jobs.pop_back();
+            ++m_activeJobs;
+
+            lock.unlock();
+            job.run();
+            lock.lock();
+
+            --m_activeJobs;
+            m_cv.notify_all();
+            continue;
+        }
+
+        if (!m_activeJobs) {
+            return;
+        }
+
+        // Segments start longest first, so the oldest one likely has the most frames left
+        auto it = std::find_if(m_running.begin(), m_running.end(), [](const Running &r) { return !r.exhausted; });
+        if (it == m_running.end()) {
+            m_cv.wait(lock);
+            continue;
+        }
+
+        auto encoder = it->encoder;
+        lock.unlock();
+        encoder->HelpRender();
+        lock.lock();
+
+        // Either all frames are claimed or the encoder has enough helpers
+        for (auto &r : m_running) {
+            if (r.encoder == encoder) {
+                r.exhausted = true;
+            }
+        }
+    }
+}
+
+void SegmentScheduler::AddEncoder(VideoEncoderPtr encoder) {
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_running.push_back({encoder});
+    }
+    m_cv.notify_all();
+}
+
+void SegmentScheduler::RemoveEncoder(VideoEncoderPtr encoder) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_running.erase(std::remove_if(m_running.begin(), m_running.end(),
+                                   [&](const Running &r) { return r.encoder == encoder; }),
+                    m_running.end());
+}
+
+} // namespace gpsmap
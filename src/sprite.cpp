@@ -0,0 +1,218 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SPRITE_HAVE_AVX2
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <gpsmap/sprite.h>
+
+OIIO_NAMESPACE_USING
+
+namespace gpsmap {
+
+// Composites count premultiplied RGBA pixels of src over dst:
+// dst = src + dst * (255 - src.alpha) / 255, rounded to the nearest integer.
+using BlendRowFn = void (*)(uint8_t *dst, const uint8_t *src, int count);
+
+static inline uint8_t Div255(unsigned v) {
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
+
+static void BlendRowScalar(uint8_t *dst, const uint8_t *src, int count) {
+    for (int i = 0; i < count; ++i, dst += 4, src += 4) {
+        unsigned alpha = src[3];
+        if (alpha == 0) {
+            continue;
+        }
+
+        if (alpha == 255) {
+            memcpy(dst, src, 4);
+            continue;
+        }
+
+        unsigned inv = 255 - alpha;
+        for (int c = 0; c < 4; ++c) {
+            dst[c] = src[c] + Div255(dst[c] * inv);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Blends the four pixels held in the 16 bit lanes of s and d
+static inline __m128i BlendSSE2(__m128i s, __m128i d) {
+    auto alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    auto inv = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    auto v = _mm_add_epi16(_mm_mullo_epi16(d, inv), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+static void BlendRowSSE2(uint8_t *dst, const uint8_t *src, int count) {
+    auto zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto s = _mm_loadu_si128((const __m128i *) (src + i * 4));
+        auto d = _mm_loadu_si128((const __m128i *) (dst + i * 4));
+        auto lo = BlendSSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        auto hi = BlendSSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        auto r = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *) (dst + i * 4), r);
+    }
+
+    BlendRowScalar(dst + i * 4, src + i * 4, count - i);
+}
+#endif
+
+#if defined(SPRITE_HAVE_AVX2)
+// Same as the SSE2 version, on eight pixels. Unpacking and packing both
+// work within 128 bit lanes, so pixels end up where they started.
+__attribute__((target("avx2"))) static inline __m256i BlendAVX2(__m256i s, __m256i d) {
+    auto alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    auto inv = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    auto v = _mm256_add_epi16(_mm256_mullo_epi16(d, inv), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static void BlendRowAVX2(uint8_t *dst, const uint8_t *src, int count) {
+    auto zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto s = _mm256_loadu_si256((const __m256i *) (src + i * 4));
+        auto d = _mm256_loadu_si256((const __m256i *) (dst + i * 4));
+        auto lo = BlendAVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        auto hi = BlendAVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        auto r = _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+        _mm256_storeu_si256((__m256i *) (dst + i * 4), r);
+    }
+
+    BlendRowSSE2(dst + i * 4, src + i * 4, count - i);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void BlendRowNEON(uint8_t *dst, const uint8_t *src, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto s = vld4_u8(src + i * 4);
+        auto d = vld4_u8(dst + i * 4);
+        auto inv = vsub_u8(vdup_n_u8(255), s.val[3]);
+        for (int c = 0; c < 4; ++c) {
+            // (v + ((v + 128) >> 8) + 128) >> 8
+            auto v = vmull_u8(d.val[c], inv);
+            d.val[c] = vqadd_u8(s.val[c], vraddhn_u16(v, vrshrq_n_u16(v, 8)));
+        }
+        vst4_u8(dst + i * 4, d);
+    }
+
+    BlendRowScalar(dst + i * 4, src + i * 4, count - i);
+}
+#endif
+
+static BlendRowFn SelectBlendRow() {
+#if defined(SPRITE_HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return BlendRowAVX2;
+    }
+#endif
+
+#if defined(__SSE2__)
+    return BlendRowSSE2;
+#elif defined(__ARM_NEON)
+    return BlendRowNEON;
+#else
+    return BlendRowScalar;
+#endif
+}
+
+static const BlendRowFn s_blendRow = SelectBlendRow();
+
+bool Sprite::Load(const ImageBuf &img) {
+    auto roi = img.roi();
+    auto nchannels = img.nchannels();
+    if (nchannels < 1 || nchannels > 4) {
+        std::cerr << "Unsupported number of channels for a sprite: " << nchannels << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> pixels(roi.width() * roi.height() * nchannels);
+    if (!img.get_pixels(roi, TypeUInt8, pixels.data())) {
+        std::cerr << "Could not read sprite pixels: " << img.geterror() << std::endl;
+        return false;
+    }
+
+    m_width = roi.width();
+    m_height = roi.height();
+    m_pixels.resize(m_width * m_height * 4);
+
+    // Gray images have one color channel, an alpha channel comes last if there is one
+    bool hasAlpha = nchannels == 2 || nchannels == 4;
+    int colors = nchannels >= 3 ? 3 : 1;
+    for (int i = 0; i < m_width * m_height; ++i) {
+        const auto *in = &pixels[i * nchannels];
+        auto *out = &m_pixels[i * 4];
+        for (int c = 0; c < 3; ++c) {
+            out[c] = in[colors == 3 ? c : 0];
+        }
+        out[3] = hasAlpha ? in[nchannels - 1] : 255;
+    }
+
+    return true;
+}
+
+bool Sprite::Blit(ImageBuf &dest, int x, int y) const {
+    const auto &spec = dest.spec();
+    if (spec.format != TypeUInt8 || spec.nchannels != 4 || !dest.localpixels()) {
+        std::cerr << "Sprites can only be drawn on 8 bits RGBA images in memory" << std::endl;
+        return false;
+    }
+
+    auto roi = dest.roi();
+    auto x0 = std::max(x, roi.xbegin);
+    auto x1 = std::min(x + m_width, roi.xend);
+    auto y0 = std::max(y, roi.ybegin);
+    auto y1 = std::min(y + m_height, roi.yend);
+    if (x0 >= x1 || y0 >= y1) {
+        return true;
+    }
+
+    for (auto py = y0; py < y1; ++py) {
+        auto *dst = (uint8_t *) dest.pixeladdr(x0, py);
+        const auto *src = &m_pixels[((py - y) * m_width + (x0 - x)) * 4];
+        s_blendRow(dst, src, x1 - x0);
+    }
+
+    return true;
+}
+
+} // namespace gpsmap
@@ -22,108 +22,75 @@
 #include <boost/filesystem.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
-#include <curl/curl.h>
+#include <algorithm>
 #include <iostream>
 #include <math.h>
 #include <mutex>
+#include <vector>
 
-#include <gpsmap/tilemanager.h>
-
-namespace pt = boost::property_tree;
-
-// https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames#C.2FC.2B.2B
-template <typename T> static T long2tilex(double lon, int z) {
-    return (T)(((lon + 180.0) / 360.0 * (double) (1 << z)));
-}
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-template <typename T> static T lat2tiley(double lat, int z) {
-    double latrad = lat * M_PI / 180.0;
-    return (T)(((1.0 - asinh(tan(latrad)) / M_PI) / 2.0 * (double) (1 << z)));
-}
-
-static bool DownloadFile(const std::string &url, const std::string &filePath) {
-    static bool inited = false;
-    CURL *curl = nullptr;
-    CURLcode res = CURLE_OK;
-    bool ret = false;
-    FILE *fp = nullptr;
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define TILEMANAGER_HAVE_AVX2
+#endif
 
-    if (!inited) {
-        curl_global_init(CURL_GLOBAL_DEFAULT);
-        inited = true;
-    }
+#include <OpenImageIO/filesystem.h>
 
-    std::cout << "Downloading " << url << std::endl;
-
-    curl = curl_easy_init();
-    if (!curl) {
-        std::cerr << "Could not init curl" << std::endl;
-        goto err;
-    }
-
-    fp = fopen(filePath.c_str(), "wb");
-    if (!fp) {
-        std::cerr << "Could not open " << filePath << std::endl;
-        goto err;
-    }
-
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        std::cerr << "Could not download " << url << std::endl;
-        goto err;
-    }
-
-    ret = true;
-err:
-    if (curl) {
-        curl_easy_cleanup(curl);
-    }
-
-    if (fp) {
-        fclose(fp);
-    }
+#include <gpsmap/gpx.h>
+#include <gpsmap/metrics.h>
+#include <gpsmap/tilemanager.h>
 
-    return ret;
-}
+namespace pt = boost::property_tree;
 
 namespace gpsmap {
 
-Tile::Tile(const std::string &filePath, const TileDesc &desc) : m_filePath(filePath), m_desc(desc), m_state(LOADED) {
-    Load(filePath);
+Tile::Tile(const TileData &data, const TileDesc &desc) : m_data(data), m_desc(desc), m_state(DOWNLOADED) {
 }
 
 Tile::Tile(const TileDesc &desc) : m_desc(desc), m_state(LOADING) {
 }
 
-void Tile::Load(const std::string &filePath) {
+void Tile::SetDownloaded(const TileData &data) {
     {
         std::lock_guard<std::mutex> lk(m_lock);
         if (m_state != LOADING) {
             return;
         }
 
-        m_filePath = filePath;
-        m_image = OIIO::ImageBuf(m_filePath);
-
-        if (m_image.read()) {
-            int channelorder[] = {0, 1, 2, -1 /*use a float value*/};
-            float channelvalues[] = {0 /*ignore*/, 0 /*ignore*/, 0 /*ignore*/, 1.0};
-            std::string channelnames[] = {"", "", "", "A"};
-            m_image = OIIO::ImageBufAlgo::channels(m_image, 4, channelorder, channelvalues, channelnames);
-            m_state = LOADED;
-        } else {
-            std::cerr << "Could not load " << m_filePath << "\n";
-            m_state = FAILED;
-        }
+        m_data = data;
+        m_state = DOWNLOADED;
     }
     m_cv.notify_all();
 }
 
-TilePtr Tile::Create(const std::string &filePath, const TileDesc &desc) {
-    return TilePtr(new Tile(filePath, desc));
+// Must be called with m_lock held
+void Tile::Decode() {
+    // Tiles of a pack are decoded straight from its mapping
+    std::unique_ptr<OIIO::Filesystem::IOProxy> proxy;
+    if (m_data.mapping) {
+        proxy.reset(new OIIO::Filesystem::IOMemReader(m_data.data, m_data.size));
+    }
+
+    m_image = OIIO::ImageBuf(m_data.path, 0, 0, nullptr, nullptr, proxy.get());
+
+    if (m_image.read(0, 0, true)) {
+        int channelorder[] = {0, 1, 2, -1 /*use a float value*/};
+        float channelvalues[] = {0 /*ignore*/, 0 /*ignore*/, 0 /*ignore*/, 1.0};
+        std::string channelnames[] = {"", "", "", "A"};
+        m_image = OIIO::ImageBufAlgo::channels(m_image, 4, channelorder, channelvalues, channelnames);
+        m_state = LOADED;
+    } else {
+        std::cerr << "Could not load " << m_data.path << "\n";
+        m_image = OIIO::ImageBuf();
+        m_state = FAILED;
+    }
+}
+
+TilePtr Tile::Create(const TileData &data, const TileDesc &desc) {
+    return TilePtr(new Tile(data, desc));
 }
 
 TilePtr Tile::Create(const TileDesc &desc) {
@@ -131,15 +98,31 @@ TilePtr Tile::Create(const TileDesc &desc) {
 }
 
 bool Tile::WaitUntilDownloaded() {
+    static auto &waits = Metrics::GetHistogram("tiles.wait_ns");
+    static auto &decodes = Metrics::GetHistogram("tiles.decode_ns");
+
     std::unique_lock<std::mutex> lk(m_lock);
-    if (m_state != LOADING) {
-        return m_state == LOADED;
+    if (m_state == LOADING) {
+        ScopedTimer timer(waits, "tile wait");
+        m_cv.wait(lk, [&] { return m_state != LOADING; });
+    }
+
+    if (m_state == DOWNLOADED) {
+        ScopedTimer timer(decodes, "tile decode");
+        Decode();
     }
 
-    m_cv.wait(lk, [&] { return m_state != LOADING; });
     return m_state == LOADED;
 }
 
+void Tile::Unload() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (m_state == LOADED) {
+        m_image = OIIO::ImageBuf();
+        m_state = DOWNLOADED;
+    }
+}
+
 void Tile::Fail() {
     {
         std::lock_guard<std::mutex> lk(m_lock);
@@ -148,12 +131,7 @@ void Tile::Fail() {
     m_cv.notify_all();
 }
 
-TileManagerPtr TileManager::Create(const std::string &tilesRootPath, const std::string &mapDescPath) {
-    if (!boost::filesystem::is_directory(tilesRootPath)) {
-        std::cerr << tilesRootPath << " does not exist or is not a directory." << std::endl;
-        return nullptr;
-    }
-
+TileManagerPtr TileManager::Create(ITileStorePtr store, const std::string &mapDescPath, DownloaderPtr downloader) {
     pt::ptree tree;
     pt::read_xml(mapDescPath, tree);
     auto mapUrl = tree.get_child("map.url").get_value("");
@@ -164,7 +142,7 @@ TileManagerPtr TileManager::Create(const std::string &tilesRootPath, const std::
 
     std::cout << "Using map URL " << mapUrl << std::endl;
 
-    return TileManagerPtr(new TileManager(tilesRootPath, mapUrl));
+    return TileManagerPtr(new TileManager(store, mapUrl, downloader));
 }
 
 bool TileManager::DownloadTile(TilePtr &tilep) const {
@@ -174,40 +152,226 @@ bool TileManager::DownloadTile(TilePtr &tilep) const {
     boost::replace_all(url, "$y", std::to_string(tile.y));
     boost::replace_all(url, "$z", std::to_string(tile.z));
 
-    std::stringstream fp;
-    fp << m_tilesRootPath << "/" << tile.z << "/" << tile.x;
+    TileData data;
+    if (m_store->Find(tile, data)) {
+        tilep->SetDownloaded(data);
+        return true;
+    }
+
+    // Saves a download, but decodes the tiles it is built from on this thread
+    if (CanSynthesize(tile, m_synthesisLevels) && SynthesizeTile(tile, m_synthesisLevels, data)) {
+        tilep->SetDownloaded(data);
+        return true;
+    }
+
+    // Tiles that are not in the store fail right away without a downloader
+    if (!m_downloader) {
+        return false;
+    }
+
+    // The tile is decoded later by the thread that waits for it,
+    // so that the downloader thread can keep the transfers going.
+    // Adding the tile to the store is a local write, short enough not to stall it.
+    auto t = tilep;
+    auto store = m_store;
+    m_downloader->Submit(url, m_store->GetDownloadPath(tile), [t, store](bool success) {
+        TileData data;
+        if (success && store->Add(t->Desc(), data)) {
+            t->SetDownloaded(data);
+        } else {
+            t->Fail();
+        }
+    });
+
+    return true;
+}
+
+// Averages each 2x2 block of RGBA pixels of the rows r0 and r1 into count pixels of out,
+// rounded to the nearest integer
+using HalveRowFn = void (*)(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int count);
+
+static void HalveRowScalar(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int count) {
+    for (int x = 0; x < count; ++x) {
+        for (int c = 0; c < 4; ++c) {
+            out[x * 4 + c] = (r0[x * 8 + c] + r0[x * 8 + 4 + c] + r1[x * 8 + c] + r1[x * 8 + 4 + c] + 2) >> 2;
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Sums the channels of the two pixels of each 2x2 block of a and b, in the four low 16 bit lanes
+static inline __m128i SumBlocksSSE2(__m128i a, __m128i b) {
+    auto zero = _mm_setzero_si128();
+    auto lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    auto hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    return _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi16(2)), 2);
+}
+
+static void HalveRowSSE2(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int count) {
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        auto lo = SumBlocksSSE2(_mm_loadu_si128((const __m128i *) (r0 + x * 8)),
+                                _mm_loadu_si128((const __m128i *) (r1 + x * 8)));
+        auto hi = SumBlocksSSE2(_mm_loadu_si128((const __m128i *) (r0 + x * 8 + 16)),
+                                _mm_loadu_si128((const __m128i *) (r1 + x * 8 + 16)));
+        _mm_storeu_si128((__m128i *) (out + x * 4), _mm_packus_epi16(lo, hi));
+    }
+
+    HalveRowScalar(r0 + x * 8, r1 + x * 8, out + x * 4, count - x);
+}
+#endif
+
+#if defined(TILEMANAGER_HAVE_AVX2)
+// Same as the SSE2 version, within each 128 bit lane
+__attribute__((target("avx2"))) static inline __m256i SumBlocksAVX2(__m256i a, __m256i b) {
+    auto zero = _mm256_setzero_si256();
+    auto lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+    auto hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2"))) static void HalveRowAVX2(const uint8_t *r0, const uint8_t *r1, uint8_t *out,
+                                                         int count) {
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        auto lo = SumBlocksAVX2(_mm256_loadu_si256((const __m256i *) (r0 + x * 8)),
+                                _mm256_loadu_si256((const __m256i *) (r1 + x * 8)));
+        auto hi = SumBlocksAVX2(_mm256_loadu_si256((const __m256i *) (r0 + x * 8 + 32)),
+                                _mm256_loadu_si256((const __m256i *) (r1 + x * 8 + 32)));
+        // Packing works within lanes, which interleaves the pixels of lo and hi
+        auto r = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *) (out + x * 4), r);
+    }
+
+    HalveRowSSE2(r0 + x * 8, r1 + x * 8, out + x * 4, count - x);
+}
+#endif
+
+static HalveRowFn SelectHalveRow() {
+#if defined(TILEMANAGER_HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return HalveRowAVX2;
+    }
+#endif
+
+#if defined(__SSE2__)
+    return HalveRowSSE2;
+#else
+    return HalveRowScalar;
+#endif
+}
+
+static const HalveRowFn s_halveRow = SelectHalveRow();
 
-    auto dir = fp.str();
-    if (!boost::filesystem::is_directory(dir)) {
-        if (!boost::filesystem::create_directories(dir)) {
-            std::cerr << "Could not create directory " << dir << std::endl;
+// Averages each 2x2 block of src into one pixel of dst
+static void HalveRGBA(const uint8_t *src, size_t srcStride, int width, int height, uint8_t *dst, size_t dstStride) {
+    for (int y = 0; y < height / 2; ++y) {
+        auto r0 = src + 2 * y * srcStride;
+        s_halveRow(r0, r0 + srcStride, dst + y * dstStride, width / 2);
+    }
+}
+
+// Tiles of the next zoom level that cover the given tile
+static void GetChildren(const TileDesc &desc, TileDesc children[4]) {
+    for (int i = 0; i < 4; ++i) {
+        children[i] = TileDesc(desc.x * 2 + (i & 1), desc.y * 2 + (i >> 1), desc.z + 1);
+    }
+}
+
+// Tiles that are being downloaded or built are not complete in the store yet
+bool TileManager::IsLoading(const TileDesc &desc) const {
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_tiles.find(desc);
+    return it != m_tiles.end() && it->second->Loading();
+}
+
+// Only checks the store, so that nothing is decoded unless the whole tile can be built.
+// Subtrees that miss tiles are remembered, so that overlapping zoom levels don't probe them again.
+// Tiles downloaded later in such a subtree are not used to build the tiles above it.
+bool TileManager::CanSynthesize(const TileDesc &desc, int levels) const {
+    if (levels <= 0) {
+        return false;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        auto it = m_unbuildable.find(desc);
+        if (it != m_unbuildable.end() && it->second >= levels) {
             return false;
         }
     }
 
-    fp << "/" << tile.y << ".png";
-    auto filePath = fp.str();
+    TileDesc children[4];
+    GetChildren(desc, children);
+    for (const auto &child : children) {
+        // Loading tiles will be in the store soon, that is not worth remembering
+        if (IsLoading(child)) {
+            return false;
+        }
 
-    if (boost::filesystem::exists(filePath)) {
-        if (boost::filesystem::file_size(filePath) > 0) {
-            tilep->Load(filePath);
-            return true;
-        } else {
-            boost::filesystem::remove(filePath);
+        TileData data;
+        if (!m_store->Find(child, data) && !CanSynthesize(child, levels - 1)) {
+            std::unique_lock<std::mutex> lock(m_lock);
+            auto &tried = m_unbuildable[desc];
+            tried = std::max(tried, levels);
+            return false;
         }
     }
+    return true;
+}
 
-    if (!DownloadFile(url, filePath)) {
-        boost::filesystem::remove(filePath);
+bool TileManager::SynthesizeTile(const TileDesc &desc, int levels, TileData &data) const {
+    static auto &synthesized = Metrics::GetCounter("tiles.synthesized");
+    static auto &synthesisTime = Metrics::GetHistogram("tiles.synthesis_ns");
+    ScopedTimer timer(synthesisTime, "synthesize tile");
+
+    auto tw = m_tileWidth;
+    auto th = m_tileHeight;
+    std::vector<uint8_t> pixels((size_t) tw * th * 4);
+    std::vector<uint8_t> childPixels(pixels.size());
+
+    TileDesc children[4];
+    GetChildren(desc, children);
+    for (int i = 0; i < 4; ++i) {
+        TileData childData;
+        if (IsLoading(children[i]) ||
+            (!m_store->Find(children[i], childData) && !SynthesizeTile(children[i], levels - 1, childData))) {
+            return false;
+        }
+
+        // Decoded apart from the cache, the child is only needed once
+        auto child = Tile::Create(childData, children[i]);
+        if (!child->WaitUntilDownloaded()) {
+            return false;
+        }
+
+        const auto &img = child->GetImage();
+        if (img.spec().width != tw || img.spec().height != th ||
+            !img.get_pixels(OIIO::ROI(0, tw, 0, th, 0, 1, 0, 4), OIIO::TypeUInt8, childPixels.data())) {
+            std::cerr << "Could not build tile from " << childData.path << std::endl;
+            return false;
+        }
+
+        auto quadrant = pixels.data() + (size_t) (i >> 1) * (th / 2) * tw * 4 + (size_t) (i & 1) * (tw / 2) * 4;
+        HalveRGBA(childPixels.data(), (size_t) tw * 4, tw, th, quadrant, (size_t) tw * 4);
+    }
+
+    auto path = m_store->GetDownloadPath(desc);
+    OIIO::ImageBuf ib(OIIO::ImageSpec(tw, th, 4, OIIO::TypeDesc::UINT8), pixels.data());
+    if (!ib.write(path) || !m_store->Add(desc, data)) {
+        std::cerr << "Could not store tile built for x=" << desc.x << " y=" << desc.y << " z=" << desc.z << std::endl;
         return false;
     }
 
-    tilep->Load(fp.str());
-    return !tilep->Failed();
+    synthesized.Add();
+    return true;
 }
 
-TilePtr TileManager::GetTile(int x, int y, int zoom) {
-    bool found = false;
+TilePtr TileManager::RequestTile(int x, int y, int zoom) {
     TilePtr ret;
     {
         std::unique_lock<std::mutex> lock(m_lock);
@@ -216,34 +380,103 @@ TilePtr TileManager::GetTile(int x, int y, int zoom) {
         auto it = m_tiles.find(d);
 
         if (it != m_tiles.end()) {
-            ret = it->second;
-            found = true;
-        } else {
-            ret = Tile::Create(d);
-            m_tiles[d] = ret;
+            return it->second;
         }
+
+        ret = Tile::Create(d);
+        m_tiles[d] = ret;
+    }
+
+    if (!DownloadTile(ret)) {
+        ret->Fail();
+    }
+
+    return ret;
+}
+
+bool TileManager::WaitForTile(const TilePtr &tile) {
+    if (!tile->WaitUntilDownloaded()) {
+        return false;
     }
 
-    if (found) {
-        ret->WaitUntilDownloaded();
+    Touch(tile);
+    return true;
+}
+
+TilePtr TileManager::GetTile(int x, int y, int zoom) {
+    auto ret = RequestTile(x, y, zoom);
+
+    if (ret->Loaded()) {
+        ++m_hits;
     } else {
-        if (!DownloadTile(ret)) {
-            std::cerr << "Could not download " << ret->FilePath() << "\n";
-            ret->Fail();
-            return nullptr;
-        }
+        ++m_misses;
     }
 
-    if (ret->Failed()) {
+    if (!WaitForTile(ret)) {
         return nullptr;
     }
 
     return ret;
 }
 
-void TileManager::GetTileCoords(double lat, double lon, int zoom, int &xt, int &yt, int &px, int &py) const {
-    auto xd = long2tilex<double>(lon, zoom);
-    auto yd = lat2tiley<double>(lat, zoom);
+void TileManager::Touch(const TilePtr &tile) {
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    auto it = m_resident.find(tile->Desc());
+    if (it != m_resident.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, it->second.first);
+        return;
+    }
+
+    auto bytes = tile->GetImage().spec().image_bytes();
+    m_lru.push_front(tile->Desc());
+    m_resident[tile->Desc()] = std::make_pair(m_lru.begin(), bytes);
+    m_residentBytes += bytes;
+
+    Evict();
+}
+
+// Must be called with m_lock held
+void TileManager::Evict() {
+    if (!m_cacheBudget) {
+        return;
+    }
+
+    auto it = m_lru.end();
+    while (m_residentBytes > m_cacheBudget && it != m_lru.begin()) {
+        --it;
+
+        // Tiles can only be referenced from outside while m_lock is held,
+        // so a tile that only the map references can be safely unloaded.
+        auto &tile = m_tiles[*it];
+        if (tile.use_count() > 1) {
+            continue;
+        }
+
+        tile->Unload();
+
+        auto rit = m_resident.find(*it);
+        m_residentBytes -= rit->second.second;
+        m_resident.erase(rit);
+        it = m_lru.erase(it);
+        ++m_evictions;
+    }
+}
+
+TileCacheStats TileManager::GetCacheStats() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    TileCacheStats ret;
+    ret.hits = m_hits;
+    ret.misses = m_misses;
+    ret.evictions = m_evictions;
+    ret.residentTiles = m_resident.size();
+    ret.residentBytes = m_residentBytes;
+    return ret;
+}
+
+void TileManager::GetTileCoordsMercator(double mx, double my, int zoom, int &xt, int &yt, int &px, int &py) const {
+    auto xd = mx * (double) (1 << zoom);
+    auto yd = my * (double) (1 << zoom);
 
     // Get the pixel coordinates inside the tile
     double dummy;
@@ -253,16 +486,18 @@ void TileManager::GetTileCoords(double lat, double lon, int zoom, int &xt, int &
     yt = yd;
 }
 
-TilePtr TileManager::GetTile(double lat, double lon, int &px, int &py, int zoom) {
-    int x = 0, y = 0;
-    GetTileCoords(lat, lon, zoom, x, y, px, py);
+void TileManager::GetTileCoords(double lat, double lon, int zoom, int &xt, int &yt, int &px, int &py) const {
+    GetTileCoordsMercator(to_mercator_x(lon), to_mercator_y(lat), zoom, xt, yt, px, py);
+}
 
-    TilePtr ret = GetTile(x, y, zoom);
-    if (!ret) {
-        return nullptr;
-    }
+TilePtr TileManager::GetTileMercator(double mx, double my, int &px, int &py, int zoom) {
+    int x = 0, y = 0;
+    GetTileCoordsMercator(mx, my, zoom, x, y, px, py);
+    return GetTile(x, y, zoom);
+}
 
-    return ret;
+TilePtr TileManager::GetTile(double lat, double lon, int &px, int &py, int zoom) {
+    return GetTileMercator(to_mercator_x(lon), to_mercator_y(lat), px, py, zoom);
 }
 
 } // namespace gpsmap
@@ -0,0 +1,518 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <boost/filesystem.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gpsmap/tilestore.h>
+
+// Tile pack.
+//
+// The pack starts with a header and is followed by the images of the tiles, one after
+// the other. The index starts with a header too, followed by the location of each tile in
+// the pack, in the order in which they were added. Tiles that are added again get a new
+// entry, the last entry of a tile wins. Data is always written to the pack before its entry,
+// under a lock of the file, so several processes may share a pack. Entries that point past
+// the end of the pack, e.g. after a crash, are ignored.
+
+namespace gpsmap {
+
+static const char s_packMagic[8] = {'G', 'P', 'S', 'M', 'P', 'A', 'C', 'K'};
+static const char s_indexMagic[8] = {'G', 'P', 'S', 'M', 'I', 'D', 'X', 0};
+static const uint32_t s_packVersion = 1;
+
+// Smallest mapping of the pack, it is doubled when it gets full
+static const size_t s_minPackMapping = 64 * 1024 * 1024;
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+};
+
+struct PackIndexEntry {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+    uint32_t size;
+    uint64_t offset;
+};
+
+const char *const ITileStore::Types[] = {"dir", "pack", nullptr};
+
+ITileStorePtr ITileStore::Create(const std::string &type, const std::string &rootPath, bool readOnly) {
+    if (type == "dir") {
+        return DirTileStore::Create(rootPath, readOnly);
+    } else if (type == "pack") {
+        return PackTileStore::Create(rootPath, readOnly);
+    }
+
+    std::cerr << "Unknown tile store " << type << std::endl;
+    return nullptr;
+}
+
+static bool ParseInt(const std::string &str, int &value) {
+    char *end;
+    errno = 0;
+    auto v = strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end || errno || v < 0 || v > INT32_MAX) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+int ITileStore::ImportDirectory(ITileStore &store, const std::string &rootPath) {
+    namespace fs = boost::filesystem;
+
+    if (!fs::is_directory(rootPath)) {
+        std::cerr << rootPath << " does not exist or is not a directory." << std::endl;
+        return -1;
+    }
+
+    int imported = 0;
+    boost::system::error_code ec;
+    for (fs::recursive_directory_iterator it(rootPath, ec), end; it != end; it.increment(ec)) {
+        if (ec) {
+            std::cerr << "Could not read " << rootPath << ": " << ec.message() << std::endl;
+            return -1;
+        }
+
+        const auto &path = it->path();
+        if (it.depth() != 2 || !fs::is_regular_file(path) || path.extension() != ".png") {
+            continue;
+        }
+
+        TileDesc desc;
+        if (!ParseInt(path.stem().string(), desc.y) || !ParseInt(path.parent_path().filename().string(), desc.x) ||
+            !ParseInt(path.parent_path().parent_path().filename().string(), desc.z)) {
+            continue;
+        }
+
+        // Interrupted downloads leave empty files behind
+        TileData data;
+        if (fs::file_size(path, ec) == 0 || store.Find(desc, data)) {
+            continue;
+        }
+
+        if (!store.Import(desc, path.string())) {
+            return -1;
+        }
+
+        if (++imported % 10000 == 0) {
+            std::cout << "Imported " << imported << " tiles" << std::endl;
+        }
+    }
+
+    return imported;
+}
+
+ITileStorePtr DirTileStore::Create(const std::string &rootPath, bool readOnly) {
+    if (!boost::filesystem::is_directory(rootPath)) {
+        std::cerr << rootPath << " does not exist or is not a directory." << std::endl;
+        return nullptr;
+    }
+
+    return ITileStorePtr(new DirTileStore(rootPath, readOnly));
+}
+
+std::string DirTileStore::GetPath(const TileDesc &desc) const {
+    std::stringstream fp;
+    fp << m_rootPath << "/" << desc.z << "/" << desc.x << "/" << desc.y << ".png";
+    return fp.str();
+}
+
+bool DirTileStore::Find(const TileDesc &desc, TileData &data) {
+    auto filePath = GetPath(desc);
+
+    boost::system::error_code ec;
+    auto size = boost::filesystem::file_size(filePath, ec);
+    if (ec) {
+        return false;
+    }
+
+    if (size == 0) {
+        if (!m_readOnly) {
+            boost::filesystem::remove(filePath, ec);
+        }
+        return false;
+    }
+
+    data = TileData();
+    data.path = filePath;
+    return true;
+}
+
+// Tiles are downloaded next to their final path and renamed once complete, so that Find() never
+// sees a partial tile. Processes that share the directory may download the same tile.
+std::string DirTileStore::GetDownloadPath(const TileDesc &desc) {
+    auto filePath = boost::filesystem::path(GetPath(desc));
+
+    auto dir = filePath.parent_path();
+    boost::system::error_code ec;
+    if (!m_readOnly && !boost::filesystem::is_directory(dir) && !boost::filesystem::create_directories(dir, ec)) {
+        std::cerr << "Could not create directory " << dir << std::endl;
+    }
+
+    std::stringstream fp;
+    fp << (dir / filePath.stem()).string() << "." << getpid() << ".png";
+    return fp.str();
+}
+
+bool DirTileStore::Add(const TileDesc &desc, TileData &data) {
+    if (m_readOnly) {
+        std::cerr << "Could not add tile to read-only store " << m_rootPath << std::endl;
+        return false;
+    }
+
+    auto downloadPath = GetDownloadPath(desc);
+    auto filePath = GetPath(desc);
+
+    boost::system::error_code ec;
+    auto size = boost::filesystem::file_size(downloadPath, ec);
+    if (ec || size == 0) {
+        std::cerr << "Invalid tile " << downloadPath << std::endl;
+        boost::filesystem::remove(downloadPath, ec);
+        return false;
+    }
+
+    boost::filesystem::rename(downloadPath, filePath, ec);
+    if (ec) {
+        std::cerr << "Could not rename " << downloadPath << " to " << filePath << ": " << ec.message() << std::endl;
+        boost::filesystem::remove(downloadPath, ec);
+        return false;
+    }
+
+    data = TileData();
+    data.path = filePath;
+    return true;
+}
+
+bool DirTileStore::Import(const TileDesc &desc, const std::string &path) {
+    if (m_readOnly) {
+        std::cerr << "Could not import " << path << " to read-only store " << m_rootPath << std::endl;
+        return false;
+    }
+
+    boost::system::error_code ec;
+    if (boost::filesystem::equivalent(path, GetPath(desc), ec)) {
+        return true;
+    }
+
+    auto downloadPath = GetDownloadPath(desc);
+    boost::filesystem::copy_file(path, downloadPath, boost::filesystem::copy_option::overwrite_if_exists, ec);
+    if (ec) {
+        std::cerr << "Could not copy " << path << " to " << downloadPath << ": " << ec.message() << std::endl;
+        return false;
+    }
+
+    TileData data;
+    return Add(desc, data);
+}
+
+PackTileStore::PackTileStore(const std::string &rootPath, bool readOnly)
+    : m_readOnly(readOnly), m_packFd(-1), m_indexFd(-1), m_indexEnd(0) {
+    m_packPath = rootPath + "/tiles.pack";
+    m_indexPath = rootPath + "/tiles.pack.idx";
+    m_incomingPath = rootPath + "/incoming";
+}
+
+PackTileStore::~PackTileStore() {
+    if (m_packFd >= 0) {
+        close(m_packFd);
+    }
+
+    if (m_indexFd >= 0) {
+        close(m_indexFd);
+    }
+}
+
+ITileStorePtr PackTileStore::Create(const std::string &rootPath, bool readOnly) {
+    if (!boost::filesystem::is_directory(rootPath)) {
+        std::cerr << rootPath << " does not exist or is not a directory." << std::endl;
+        return nullptr;
+    }
+
+    auto ret = std::shared_ptr<PackTileStore>(new PackTileStore(rootPath, readOnly));
+    if (!ret->Open() || !ret->LoadIndex()) {
+        return nullptr;
+    }
+
+    return ret;
+}
+
+static bool WriteAll(int fd, const void *data, size_t size) {
+    auto p = (const char *) data;
+    while (size > 0) {
+        auto ret = write(fd, p, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+// Writes the header of a new pack or index file, or checks the header of an existing one.
+// Partial entries at the end, left by a crash, are truncated so that new entries stay aligned.
+// Read-only files are only checked, readers skip partial entries anyway.
+static bool PrepareFile(int fd, const std::string &path, const char *magic, uint32_t entrySize, bool readOnly) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        std::cerr << "Could not stat " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    PackHeader header;
+    if (st.st_size == 0 && !readOnly) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = s_packVersion;
+        header.entrySize = entrySize;
+        if (!WriteAll(fd, &header, sizeof(header))) {
+            std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if ((size_t) st.st_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, magic, sizeof(header.magic)) || header.version != s_packVersion ||
+        header.entrySize != entrySize) {
+        std::cerr << path << " is not a tile pack of this version" << std::endl;
+        return false;
+    }
+
+    auto tail = entrySize ? (st.st_size - sizeof(header)) % entrySize : 0;
+    if (tail && !readOnly && ftruncate(fd, st.st_size - tail) < 0) {
+        std::cerr << "Could not truncate " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool PackTileStore::Open() {
+    boost::system::error_code ec;
+    if (!m_readOnly && !boost::filesystem::is_directory(m_incomingPath) &&
+        !boost::filesystem::create_directories(m_incomingPath, ec)) {
+        std::cerr << "Could not create directory " << m_incomingPath << std::endl;
+        return false;
+    }
+
+    auto flags = m_readOnly ? O_RDONLY : O_RDWR | O_CREAT | O_APPEND;
+    m_packFd = open(m_packPath.c_str(), flags, 0644);
+    m_indexFd = open(m_indexPath.c_str(), flags, 0644);
+    if (m_packFd < 0 || m_indexFd < 0) {
+        std::cerr << "Could not open " << (m_packFd < 0 ? m_packPath : m_indexPath) << ": " << strerror(errno)
+                  << std::endl;
+        return false;
+    }
+
+    // Writers of either file hold the lock of the pack. The pack has no entries to align.
+    flock(m_packFd, m_readOnly ? LOCK_SH : LOCK_EX);
+    auto ok = PrepareFile(m_packFd, m_packPath, s_packMagic, 0, m_readOnly) &&
+              PrepareFile(m_indexFd, m_indexPath, s_indexMagic, sizeof(PackIndexEntry), m_readOnly);
+    flock(m_packFd, LOCK_UN);
+    return ok;
+}
+
+bool PackTileStore::LoadIndex() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_indexEnd = sizeof(PackHeader);
+    if (!ReadNewEntries(false)) {
+        return false;
+    }
+
+    std::cout << "Loaded " << m_index.size() << " tiles from " << m_packPath << std::endl;
+    return true;
+}
+
+// Loads the entries that were added to the index since the last call, by this process or others.
+// Must be called with m_lock held. Writers hold the lock of the pack, locked tells that this process does.
+bool PackTileStore::ReadNewEntries(bool locked) {
+    struct stat st;
+    if (fstat(m_indexFd, &st) < 0) {
+        std::cerr << "Could not stat " << m_indexPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Most lookups of missing tiles end here
+    if ((uint64_t) st.st_size < m_indexEnd + sizeof(PackIndexEntry)) {
+        return true;
+    }
+
+    if (!locked) {
+        flock(m_packFd, LOCK_SH);
+    }
+
+    // The entries are complete under the lock, and the pack has their data
+    struct stat packSt;
+    auto ok = fstat(m_indexFd, &st) == 0 && fstat(m_packFd, &packSt) == 0;
+    std::vector<PackIndexEntry> entries;
+    if (ok) {
+        entries.resize((st.st_size - m_indexEnd) / sizeof(PackIndexEntry));
+        auto size = entries.size() * sizeof(PackIndexEntry);
+        ok = pread(m_indexFd, entries.data(), size, m_indexEnd) == (ssize_t) size;
+    }
+
+    if (!locked) {
+        flock(m_packFd, LOCK_UN);
+    }
+
+    if (!ok) {
+        std::cerr << "Could not read " << m_indexPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    m_index.reserve(m_index.size() + entries.size());
+    for (const auto &e : entries) {
+        if (e.offset < sizeof(PackHeader) || e.offset + e.size > (uint64_t) packSt.st_size) {
+            continue;
+        }
+        m_index[TileDesc(e.x, e.y, e.z)] = {e.offset, e.size};
+    }
+    m_indexEnd += entries.size() * sizeof(PackIndexEntry);
+    return true;
+}
+
+// Must be called with m_lock held
+bool PackTileStore::GetData(const TileDesc &desc, const Location &location, TileData &data) {
+    auto end = location.offset + location.size;
+    if (!m_mapping || end > m_mapping->MappedSize()) {
+        auto mapping = MappedFile::Create(m_packPath, false, std::max<size_t>(end * 2, s_minPackMapping));
+        if (!mapping) {
+            return false;
+        }
+        // Tiles that are already in use keep the previous mapping alive
+        m_mapping = mapping;
+    }
+
+    std::stringstream name;
+    name << desc.z << "-" << desc.x << "-" << desc.y << ".png";
+
+    data = TileData();
+    data.path = name.str();
+    data.mapping = m_mapping;
+    data.data = m_mapping->Data() + location.offset;
+    data.size = location.size;
+    return true;
+}
+
+bool PackTileStore::Find(const TileDesc &desc, TileData &data) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_index.find(desc);
+    if (it == m_index.end()) {
+        // Another process may have added it
+        if (!ReadNewEntries(false) || (it = m_index.find(desc)) == m_index.end()) {
+            return false;
+        }
+    }
+
+    return GetData(desc, it->second, data);
+}
+
+std::string PackTileStore::GetDownloadPath(const TileDesc &desc) {
+    // Processes that share the pack may download the same tile
+    std::stringstream fp;
+    fp << m_incomingPath << "/" << desc.z << "-" << desc.x << "-" << desc.y << "." << getpid() << ".png";
+    return fp.str();
+}
+
+bool PackTileStore::Append(const TileDesc &desc, const std::string &path) {
+    if (m_readOnly) {
+        std::cerr << "Could not add " << path << " to read-only store " << m_packPath << std::endl;
+        return false;
+    }
+
+    auto file = MappedFile::Create(path);
+    if (!file) {
+        return false;
+    }
+
+    if (file->Size() == 0 || file->Size() > UINT32_MAX) {
+        std::cerr << "Invalid tile " << path << std::endl;
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    // Other processes append to the pack too, the end only moves while the lock is held.
+    // Their entries are read first, so that the entry of this tile is the last one read.
+    flock(m_packFd, LOCK_EX);
+    if (!ReadNewEntries(true)) {
+        flock(m_packFd, LOCK_UN);
+        return false;
+    }
+
+    PackIndexEntry e;
+    e.x = desc.x;
+    e.y = desc.y;
+    e.z = desc.z;
+    e.size = file->Size();
+    auto end = lseek(m_packFd, 0, SEEK_END);
+    e.offset = end;
+    auto ok = end >= 0 && WriteAll(m_packFd, file->Data(), file->Size()) && WriteAll(m_indexFd, &e, sizeof(e));
+    auto error = errno;
+
+    // Drop what was written of the tile, or the entries that others append would start in the middle of this one
+    if (!ok && end >= 0) {
+        if (ftruncate(m_indexFd, m_indexEnd) < 0 || ftruncate(m_packFd, end) < 0) {
+            std::cerr << "Could not roll back the write to " << m_packPath << ": " << strerror(errno) << std::endl;
+        }
+    }
+    flock(m_packFd, LOCK_UN);
+
+    if (!ok) {
+        std::cerr << "Could not add " << path << " to " << m_packPath << ": " << strerror(error) << std::endl;
+        return false;
+    }
+
+    m_index[desc] = {e.offset, e.size};
+    m_indexEnd += sizeof(e);
+    return true;
+}
+
+bool PackTileStore::Add(const TileDesc &desc, TileData &data) {
+    auto path = GetDownloadPath(desc);
+    auto ok = Append(desc, path);
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+
+    return ok && Find(desc, data);
+}
+
+bool PackTileStore::Import(const TileDesc &desc, const std::string &path) {
+    return Append(desc, path);
+}
+
+} // namespace gpsmap
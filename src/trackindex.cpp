@@ -0,0 +1,131 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <math.h>
+
+#include <gpsmap/trackindex.h>
+
+namespace gpsmap {
+
+static inline int floor_div(int a, int b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+TrackIndex::LevelPtr TrackIndex::GetLevel(int zoom) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_levels.find(zoom);
+    if (it != m_levels.end()) {
+        return it->second;
+    }
+
+    // Generators of other segments will wait for the build instead of doing it again
+    auto ret = Build(zoom);
+    m_levels[zoom] = ret;
+    return ret;
+}
+
+TrackIndex::LevelPtr TrackIndex::Build(int zoom) const {
+    auto ret = std::make_shared<Level>();
+    ret->zoom = zoom;
+
+    const auto &items = m_gpx->GetItems();
+    auto tw = m_tiles->TileWidth();
+    auto th = m_tiles->TileHeight();
+
+    ret->points.reserve(items.size());
+    for (const auto &item : items) {
+        int xt, yt, px, py;
+        m_tiles->GetTileCoordsMercator(item.MercatorX, item.MercatorY, zoom, xt, yt, px, py);
+        ret->points.push_back({xt * tw + px, yt * th + py});
+    }
+
+    auto add = [&](int tx, int ty, uint32_t segment) {
+        auto &v = ret->tiles[TileDesc(tx, ty, zoom)];
+        if (v.empty() || v.back() != segment) {
+            v.push_back(segment);
+        }
+    };
+
+    for (size_t i = 1; i < items.size(); ++i) {
+        if (items[i].IsTrackStart) {
+            continue;
+        }
+
+        const auto &p0 = ret->points[i - 1];
+        const auto &p1 = ret->points[i];
+
+        // The track is drawn two pixels wide, so grow the bounding box
+        // to catch segments that run along a tile border.
+        auto tx0 = floor_div(std::min(p0.x, p1.x) - 1, tw);
+        auto tx1 = floor_div(std::max(p0.x, p1.x) + 1, tw);
+        auto ty0 = floor_div(std::min(p0.y, p1.y) - 1, th);
+        auto ty1 = floor_div(std::max(p0.y, p1.y) + 1, th);
+
+        if ((tx1 - tx0 + 1) * (ty1 - ty0 + 1) <= 16) {
+            for (auto tx = tx0; tx <= tx1; ++tx) {
+                for (auto ty = ty0; ty <= ty1; ++ty) {
+                    add(tx, ty, i);
+                }
+            }
+            continue;
+        }
+
+        // Long segments (e.g., GPS glitches or gaps in the recording) would cover
+        // too many tiles with their bounding box. Walk along them in half-tile steps
+        // instead. Every point of the segment is then within a quarter tile of a step,
+        // so the tiles it crosses are in the neighborhood of the tile of some step.
+        auto dx = p1.x - p0.x;
+        auto dy = p1.y - p0.y;
+        auto steps = (int) ceil(std::max(fabs((double) dx) / (tw / 2), fabs((double) dy) / (th / 2)));
+        for (auto s = 0; s <= steps; ++s) {
+            auto x = p0.x + (int) ((double) dx * s / steps);
+            auto y = p0.y + (int) ((double) dy * s / steps);
+            auto tx = floor_div(x, tw);
+            auto ty = floor_div(y, th);
+            for (auto j = -1; j <= 1; ++j) {
+                for (auto k = -1; k <= 1; ++k) {
+                    add(tx + j, ty + k, i);
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+std::vector<uint32_t> TrackIndex::GetSegments(const Level &level, int x0, int y0, int x1, int y1) {
+    std::vector<uint32_t> ret;
+    for (auto x = x0; x <= x1; ++x) {
+        for (auto y = y0; y <= y1; ++y) {
+            auto it = level.tiles.find(TileDesc(x, y, level.zoom));
+            if (it != level.tiles.end()) {
+                ret.insert(ret.end(), it->second.begin(), it->second.end());
+            }
+        }
+    }
+
+    // Segments that cross several tiles must only be drawn once
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+} // namespace gpsmap
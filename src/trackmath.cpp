@@ -0,0 +1,230 @@
+// Copyright (c) 2020 Vitaly Chipounov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <gpsmap/trackmath.h>
+
+namespace gpsmap {
+
+// Radius of Earth in meters
+static const double s_earthRadius = 6371 * 1000;
+
+static inline double ToRad(double deg) {
+    return deg * M_PI / 180.0;
+}
+
+static inline double ToDeg(double rad) {
+    return rad * 180.0 / M_PI;
+}
+
+// Quadrant selection works on the bits of the values, with masks
+// instead of branches, so that it vectorizes along with the arithmetic.
+static inline uint64_t ToBits(double d) {
+    uint64_t ret;
+    memcpy(&ret, &d, sizeof(ret));
+    return ret;
+}
+
+static inline double FromBits(uint64_t b) {
+    double ret;
+    memcpy(&ret, &b, sizeof(ret));
+    return ret;
+}
+
+// Computes sin(x) and cos(x) for |x| up to a few turns.
+// Coefficients are those of the fdlibm kernels.
+static inline void SinCos(double x, double &s, double &c) {
+    const double twoOverPi = 6.36619772367581382433e-01;
+    const double pio2_1 = 1.57079632673412561417e+00;
+    const double pio2_1t = 6.07710050650619224932e-11;
+
+    // Adding and subtracting 1.5 * 2^52 rounds to the nearest integer without a libm call
+    const double shifter = 6755399441055744.0;
+
+    const double S1 = -1.66666666666666324348e-01;
+    const double S2 = 8.33333333332248946124e-03;
+    const double S3 = -1.98412698298579493134e-04;
+    const double S4 = 2.75573137070700676789e-06;
+    const double S5 = -2.50507602534068634195e-08;
+    const double S6 = 1.58969099521155010221e-10;
+
+    const double C1 = 4.16666666666666019037e-02;
+    const double C2 = -1.38888888888741095749e-03;
+    const double C3 = 2.48015872894767294178e-05;
+    const double C4 = -2.75573143513906633035e-07;
+    const double C5 = 2.08757232129817482790e-09;
+    const double C6 = -1.13596475577881948265e-11;
+
+    // Reduce to [-pi/4, pi/4]. The quadrant is small, so two parts of pi/2 are enough.
+    // The low bits of the shifted value hold the quadrant in two's complement.
+    double shifted = x * twoOverPi + shifter;
+    double k = shifted - shifter;
+    double r = (x - k * pio2_1) - k * pio2_1t;
+    uint64_t q = ToBits(shifted);
+
+    double z = r * r;
+    double ps = r + r * z * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)))));
+    double pc = 1.0 - 0.5 * z + z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+
+    // Odd quadrants swap sin and cos, then the sign comes from the quadrant
+    uint64_t swap = 0 - (q & 1);
+    uint64_t ss = (ToBits(pc) & swap) | (ToBits(ps) & ~swap);
+    uint64_t cc = (ToBits(ps) & swap) | (ToBits(pc) & ~swap);
+    s = FromBits(ss ^ ((q & 2) << 62));
+    c = FromBits(cc ^ (((q + 1) & 2) << 62));
+}
+
+// Same as atan2(y, x), except for signed zeros and NaNs
+static inline double Atan2(double y, double x) {
+    const double tanPio8 = 4.14213562373095034e-01;
+    const double pio4_hi = 7.85398163397448278999e-01;
+    const double pio4_lo = 3.06161699786838301793e-17;
+    const double pio2_hi = 1.57079632679489655800e+00;
+    const double pio2_lo = 6.12323399573676603587e-17;
+    const double pi_hi = 3.14159265358979311600e+00;
+    const double pi_lo = 1.22464679914735317720e-16;
+
+    const double aT0 = 3.33333333333329318027e-01;
+    const double aT1 = -1.99999999998764832476e-01;
+    const double aT2 = 1.42857142725034663711e-01;
+    const double aT3 = -1.11111104054623557880e-01;
+    const double aT4 = 9.09088713343650656196e-02;
+    const double aT5 = -7.69187620504482999495e-02;
+    const double aT6 = 6.66107313738753120669e-02;
+    const double aT7 = -5.83357013379057348645e-02;
+    const double aT8 = 4.97687799461593236017e-02;
+    const double aT9 = -3.65315727442169155270e-02;
+    const double aT10 = 1.62858201153657823623e-02;
+
+    double ax = fabs(x);
+    double ay = fabs(y);
+    double mx = ax > ay ? ax : ay;
+    double mn = ax > ay ? ay : ax;
+
+    // atan(t) for t in [0, 1], reduced to |u| <= tan(pi/8)
+    double t = mn / (mx > 0 ? mx : 1.0);
+    bool reduced = t > tanPio8;
+    double u = reduced ? (t - 1.0) / (t + 1.0) : t;
+
+    double z = u * u;
+    double w = z * z;
+    double s1 = z * (aT0 + w * (aT2 + w * (aT4 + w * (aT6 + w * (aT8 + w * aT10)))));
+    double s2 = w * (aT1 + w * (aT3 + w * (aT5 + w * (aT7 + w * aT9))));
+    double a = u - u * (s1 + s2);
+
+    a = reduced ? pio4_hi + (pio4_lo + a) : a;
+    a = ay > ax ? pio2_hi + (pio2_lo - a) : a;
+    a = x < 0 ? pi_hi + (pi_lo - a) : a;
+    return y < 0 ? -a : a;
+}
+
+void ComputeDistances(const double *lat, const double *lon, size_t count, double *distances) {
+    if (!count) {
+        return;
+    }
+
+    std::vector<double> cosLat(count);
+    for (size_t i = 0; i < count; ++i) {
+        double s;
+        SinCos(ToRad(lat[i]), s, cosLat[i]);
+    }
+
+    distances[0] = 0;
+
+    // Haversine formula
+    for (size_t i = 1; i < count; ++i) {
+        double dlat = ToRad(lat[i]) - ToRad(lat[i - 1]);
+        double dlon = ToRad(lon[i]) - ToRad(lon[i - 1]);
+
+        double sdlat, sdlon, c;
+        SinCos(dlat / 2, sdlat, c);
+        SinCos(dlon / 2, sdlon, c);
+
+        double a = sdlat * sdlat + cosLat[i - 1] * cosLat[i] * sdlon * sdlon;
+        a = a > 1.0 ? 1.0 : a;
+
+        // 2 * asin(sqrt(a)), without losing precision for nearby points
+        distances[i] = s_earthRadius * 2 * Atan2(sqrt(a), sqrt(1.0 - a));
+    }
+}
+
+void ComputeBearings(const double *lat, const double *lon, size_t count, double *bearings) {
+    if (count < 2) {
+        return;
+    }
+
+    std::vector<double> sinLat(count), cosLat(count);
+    for (size_t i = 0; i < count; ++i) {
+        SinCos(ToRad(lat[i]), sinLat[i], cosLat[i]);
+    }
+
+    for (size_t i = 0; i + 1 < count; ++i) {
+        double sdlon, cdlon;
+        SinCos(ToRad(lon[i + 1]) - ToRad(lon[i]), sdlon, cdlon);
+
+        auto x = cosLat[i + 1] * sdlon;
+        auto y = cosLat[i] * sinLat[i + 1] - sinLat[i] * cosLat[i + 1] * cdlon;
+        bearings[i] = ToDeg(Atan2(x, y));
+    }
+}
+
+void ComputeGrades(const double *distanceDeltas, const double *elevations, size_t count, double *grades) {
+    const double maxDist = 50.0;
+
+    // prefix[k] is the sum of the first k deltas
+    std::vector<double> prefix(count + 1);
+    prefix[0] = 0;
+    for (size_t k = 0; k < count; ++k) {
+        prefix[k + 1] = prefix[k] + distanceDeltas[k];
+    }
+
+    // Both ends of the window only move forward. The delta of the
+    // current point is counted on both sides.
+    size_t l = 0;
+    size_t r = 0;
+    for (size_t i = 0; i < count; ++i) {
+        while (l < i && prefix[i + 1] - prefix[l + 1] >= maxDist) {
+            ++l;
+        }
+
+        if (r < i) {
+            r = i;
+        }
+        while (r + 1 < count && prefix[r + 1] - prefix[i] < maxDist) {
+            ++r;
+        }
+
+        auto ldist = prefix[i + 1] - prefix[l];
+        auto rdist = prefix[r + 1] - prefix[i];
+
+        auto td = ldist + rdist;
+        if (td < 0.01) {
+            grades[i] = 0.0;
+        } else {
+            grades[i] = (elevations[r] - elevations[l]) / td * 100;
+        }
+    }
+}
+
+} // namespace gpsmap